@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,374 +6,7193 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "transaction_log.h"
+
+// Build: gcc -O2 -pthread BS.c -o BS -lm
 
 // Directory to store account files
 #define ACCOUNTS_DIR "accounts"
 
-// Maximum number of accounts
-#define MAX_ACCOUNTS 100
+// Number of accounts in the first storage segment; each later segment doubles
+#define ACCOUNT_SEGMENT_BASE 64
+
+// Number of storage segments (the last one ends just below INT_MAX accounts)
+#define ACCOUNT_SEGMENT_COUNT 25
+
+// Default limit on the number of accounts that can be created
+#define DEFAULT_MAX_ACCOUNTS 1000000
+
+// Initial number of slots in the account index (must be a power of two)
+#define ACCOUNT_INDEX_INITIAL_SLOTS 256
+
+// Accounts handed to the balance store at a time by the flusher
+#define BALANCE_FLUSH_BATCH 64
+
+// Default interval between background balance flushes, in milliseconds
+#define DEFAULT_FLUSH_INTERVAL_MS 100
+
+// Prefix of write-ahead log segment files; the suffix is the segment's first LSN
+#define WAL_SEGMENT_PREFIX "wal-"
+
+// Name of the WAL checkpoint snapshot
+#define CHECKPOINT_FILE "checkpoint.bin"
+
+// Default size a WAL segment may reach before the flusher checkpoints it
+#define DEFAULT_WAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+// Upper bound on entries in one WAL record, used to reject garbage on replay
+#define WAL_MAX_RECORD_ENTRIES (1 << 20)
+
+// Initial size of each of the two WAL staging buffers under --wal-io=uring;
+// a buffer grows if a single record does not fit
+#define WAL_RING_BUFFER_BYTES (1024 * 1024)
+
+#define WAL_RECORD_MAGIC 0x4C415742u  // "BWAL"
+#define CHECKPOINT_MAGIC 0x504B4342u  // "BCKP"
+
+// Size of each of the two group-commit buffers for the transaction log
+#define LOG_BUFFER_BYTES (256 * 1024)
+
+// Longest formatted transaction log record
+#define LOG_RECORD_MAX 512
+
+// Default group-commit batch: flush after this many records...
+#define DEFAULT_LOG_BATCH_RECORDS 64
+
+// ...or this many microseconds after the first record of the batch
+#define DEFAULT_LOG_MAX_WAIT_US 500
+
+// Returned by balance updates that would overdraw an account
+#define BALANCE_INSUFFICIENT_FUNDS 1
+
+// Returned by balance updates that would take a balance past MONEY_MAX
+#define BALANCE_OVERFLOW 2
+
+// Default number of operations the worker pool queue can hold
+#define DEFAULT_QUEUE_DEPTH 1024
+
+// Name of the central log of account balances
+#define CENTRAL_LOG_FILE "central_log.txt"
+
+// Minimum accounts per startup recovery thread
+#define RECOVERY_ACCOUNTS_PER_THREAD 1024
+
+// Name of the memory-mapped balance store
+#define BALANCE_STORE_FILE "balances.dat"
+
+#define BALANCE_STORE_MAGIC 0x4C414242u  // "BBAL"
+
+// Slots in a new balance store; the file doubles whenever it fills up
+#define BALANCE_STORE_INITIAL_SLOTS 1024
+
+// Slots of address space reserved for the balance store mapping
+#define BALANCE_STORE_MAX_SLOTS (1u << 26)
+
+// Assumed cache line size, used to keep accounts from sharing lines
+#define CACHE_LINE_SIZE 64
+
+// Default workload benchmark size and duration
+#define DEFAULT_BENCH_ACCOUNTS 10000
+#define DEFAULT_BENCH_SECONDS 5
+
+// Default seconds without progress before the stress benchmark calls it a deadlock
+#define DEFAULT_BENCH_TIMEOUT 10
+
+// Default operations the stress benchmark runs, split over the balance stores
+#define DEFAULT_BENCH_OPS 1000000
+
+// Initial balance of workload benchmark accounts, and the largest amount it moves
+#define BENCH_INITIAL_BALANCE 1000000
+#define BENCH_MAX_AMOUNT 100
+
+// Name of the transaction log file
+#define TRANSACTION_LOG "transactions.log"
+
+// Name of the transaction log file in the binary format
+#define TRANSACTION_LOG_BINARY "transactions.bin"
+
+// An amount of money as a count of the currency's minor units (cents, say):
+// fixed point with the decimal point implied, so sums are exact. Text files
+// and messages carry the plain count. Arithmetic on balances goes through
+// the checked helpers below; balances stay within 0..MONEY_MAX.
+typedef int64_t Money;
+
+#define MONEY_MAX INT64_MAX
+
+// Function to add two amounts; returns -1 instead of overflowing
+static inline int money_add(Money a, Money b, Money *sum) {
+    return __builtin_add_overflow(a, b, sum) ? -1 : 0;
+}
+
+// Function to parse a whole, non-negative amount; returns -1 for anything else
+static int money_parse(const char *text, Money *amount) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if(end == text || errno != 0 || value < 0) {
+        return -1;
+    }
+    while(*end == '\n' || *end == ' ') {
+        end++;
+    }
+    if(*end != '\0') {
+        return -1;
+    }
+    *amount = (Money)value;
+    return 0;
+}
+
+// Structure representing an account: the fields every operation reads or
+// writes, aligned and padded to whole cache lines so threads working on
+// neighbouring accounts never share a line. The ID and other rarely written
+// fields live in the account's AccountInfo.
+typedef struct Account {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    _Atomic Money balance;      // Resident balance, valid once balance_loaded is set
+    _Atomic uint64_t version;   // Finished writes above BALANCE_VERSION_SHIFT, writers in progress below
+    int number;                 // Position in account storage, fixed for the run
+    _Atomic uint8_t balance_loaded;
+    _Atomic uint8_t dirty;      // Queued for the balance flusher
+} Account;
+
+_Static_assert(sizeof(Account) == CACHE_LINE_SIZE, "Account must stay one cache line");
+
+// Cold part of an account, stored under the same number in its own table
+typedef struct {
+    char account_id[50];
+    _Atomic int wal_touched;    // Changed through the WAL during this run
+    _Atomic int store_slot;     // Slot in the mmap balance store, -1 if none yet
+    struct Account *next_dirty;
+    _Atomic int report_dirty;   // Changed since the last central log report
+    struct Account *next_report_dirty;
+    Money reported_balance;     // Balance in the last central log report (reporter only)
+    _Atomic Money pending_credit;   // Applied by update_balances() but not yet committed or undone
+    _Atomic Money pending_debit;
+} AccountInfo;
+
+// Account.version layout: a balance read is only valid if no write was in
+// progress when it started and the version did not move while it ran.
+// Writers may overlap (credits take no lock), so each one adds itself to
+// the low half on entry and moves from there to the high half on exit.
+#define BALANCE_VERSION_SHIFT 32
+#define BALANCE_WRITERS_MASK ((UINT64_C(1) << BALANCE_VERSION_SHIFT) - 1)
+
+// Versioned balance reads spin this many times before yielding to the writer
+#define BALANCE_READ_SPINS 64
+
+// A place account balances are kept between runs. The engine reaches the
+// selected backend only through these operations; the WAL, when enabled,
+// sits in front of whichever backend is selected and folds into it.
+typedef struct {
+    const char *name;
+    int (*open)();                              // Prepare the backend at startup
+    int (*load)(Account *account, Money *balance);
+    int (*store)(Account *account, Money balance);
+    // Store balances in order; returns how many were stored before a failure
+    int (*store_batch)(Account *accounts[], const Money balances[], int count);
+    int (*exists)(Account *account);
+    int (*sync)();                              // Make every stored balance durable
+    // Hand the ID of every stored account in part of the store (0 to
+    // parts - 1; the parts split the accounts between them) to visit(),
+    // which returns the account (NULL on failure) so the backend can
+    // remember where it lives. Parts may be visited concurrently.
+    int (*iterate)(int part, int parts, Account* (*visit)(const char *account_id));
+    void (*close)();
+} BalanceStore;
+
+// One slot of the balance store file. Slot 0 of the file holds the header;
+// account slots are handed out in order and never move, so an account's
+// slot always holds its ID and last stored balance.
+typedef struct {
+    char account_id[50];
+    uint8_t reserved[6];
+    int64_t balance;
+} BalanceSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t used_slots;        // Account slots handed out so far
+    uint8_t reserved[56];
+} BalanceStoreHeader;
+
+_Static_assert(sizeof(BalanceSlot) == 64 && sizeof(BalanceStoreHeader) == sizeof(BalanceSlot),
+               "balance store slots must stay 64 bytes");
+
+// The open balance store mapping; lock serializes slot assignment and growth
+struct {
+    int fd;
+    BalanceSlot *slots;         // File contents; slots[0] is the header
+    uint32_t capacity;          // Account slots the file currently has room for
+    pthread_mutex_t lock;
+} balance_store_map = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+// When balance updates reach the account files
+typedef enum {
+    DURABILITY_WRITE_THROUGH,   // Rewrite the file before the operation completes
+    DURABILITY_GROUP_COMMIT,    // Batch dirty balances; operations wait for their batch
+    DURABILITY_PERIODIC         // Batch dirty balances on a timer; operations do not wait
+} DurabilityPolicy;
+
+DurabilityPolicy durability_policy = DURABILITY_WRITE_THROUGH;
+int flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+
+// How WAL records reach the disk. With the ring, buffered log writers and
+// the balance flusher write through io_uring as well.
+typedef enum {
+    WAL_IO_SYNC,                // write() under the WAL lock; write-through syncs there too
+    WAL_IO_URING                // Staged in memory; a ring thread writes and syncs them
+} WalIoMode;
+
+// Write-ahead log settings; with the WAL the account files are only rewritten at checkpoints
+int wal_enabled = 1;
+off_t wal_checkpoint_bytes = DEFAULT_WAL_CHECKPOINT_BYTES;
+WalIoMode wal_io_mode = WAL_IO_SYNC;
+
+// Most accounts create_account() makes; 0 means no limit. Recovery still
+// registers every stored account.
+int max_accounts = DEFAULT_MAX_ACCOUNTS;
+
+// Simulated per-operation delay range in microseconds; 0 disables it
+int latency_min_us = 0;
+int latency_max_us = 0;
+
+// Worker pool settings; 0 workers means one per core. With shard_count set
+// the pool runs as a sharded engine of that many single-writer threads.
+int worker_count = 0;
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+int shard_count = 0;
+
+// Benchmark to run instead of the demo operations, if any
+const char *benchmark_name = NULL;
+
+// Operation stream to replay instead of the demo operations ("-" is stdin)
+const char *ingest_path = NULL;
+
+// Address to serve operations on instead of the demo ("unix:PATH" or [HOST:]PORT)
+const char *listen_address = NULL;
+
+// Benchmark settings; 0 threads means one per core. bench_mix holds the
+// percentage of transfers, deposits, withdrawals and balance views, and
+// bench_skew the Zipfian theta used to pick accounts (0 is uniform).
+int bench_accounts = DEFAULT_BENCH_ACCOUNTS;
+int bench_threads = 0;
+int bench_seconds = DEFAULT_BENCH_SECONDS;
+int bench_mix[4] = {50, 20, 20, 10};
+double bench_skew = 0;
+
+// Stress benchmark limits: seconds without progress before it declares a
+// deadlock, the ops/s every balance store must reach (0 for no gate) and
+// the operations to run over all the stores (0 runs each for bench_seconds)
+int bench_timeout = DEFAULT_BENCH_TIMEOUT;
+long bench_min_ops = 0;
+long bench_ops = DEFAULT_BENCH_OPS;
+
+// On-disk WAL record: a header followed by entry_count entries. The checksum
+// covers the header (with checksum zeroed) and all entries.
+typedef struct {
+    uint32_t magic;
+    uint32_t entry_count;
+    uint64_t lsn;
+    uint32_t checksum;
+    uint32_t reserved;
+} WalRecordHeader;
+
+// One balance change inside a WAL record. Changes are deltas so records for
+// the same account can be replayed without relying on their order.
+typedef struct {
+    char account_id[50];
+    int64_t delta;
+} WalEntry;
+
+// On-disk checkpoint snapshot: a header, entry_count entries and a trailing CRC-32
+typedef struct {
+    uint32_t magic;
+    uint32_t entry_count;
+    uint64_t lsn;               // Last WAL record reflected in the snapshot
+    uint64_t reserved;
+} CheckpointHeader;
+
+typedef struct {
+    char account_id[50];
+    int64_t balance;
+} CheckpointEntry;
+
+// Submission and completion queues of an io_uring, mapped from the kernel.
+// Only one thread drives a ring, so the indexes it owns need no locking.
+typedef struct {
+    int fd;
+    unsigned entries;           // Most requests that can be queued at once
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} IoRing;
+
+// State of the current WAL segment
+typedef struct {
+    int fd;
+    uint64_t segment_start;     // LSN of the segment's first record
+    off_t segment_bytes;
+    uint64_t next_lsn;
+    uint64_t synced_lsn;        // Every record up to here is on disk
+    int syncing;                // A wal_sync() leader is in fdatasync
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    // --wal-io=uring: appends fill staging[filling] while the ring thread
+    // writes and syncs the other buffer
+    IoRing ring;
+    char *staging[2];
+    size_t staging_capacity[2];
+    size_t staged_bytes;        // Bytes in staging[filling]
+    int filling;
+    off_t ring_offset;          // Segment offset of the next batch
+    int ring_busy;              // The ring thread is writing a batch
+    int ring_failed;            // A batch failed; no later record becomes durable
+    int ring_stop;
+    pthread_cond_t ring_wakeup;
+    pthread_cond_t ring_room;   // The filling buffer was taken
+    pthread_t ring_thread;
+} WriteAheadLog;
+
+WriteAheadLog wal = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .synced = PTHREAD_COND_INITIALIZER,
+                     .ring = {.fd = -1}, .ring_wakeup = PTHREAD_COND_INITIALIZER, .ring_room = PTHREAD_COND_INITIALIZER};
+
+// Size of a shard's WAL buffer
+#define SHARD_WAL_BUFFER_BYTES (64 * 1024)
+
+// WAL records a shard has committed but not yet appended to the WAL. Under
+// periodic durability nothing waits for a record to be durable, so a shard
+// appends its records in batches (see wal_append_buffered()) instead of
+// taking wal.lock for each.
+typedef struct {
+    char *data;
+    size_t used;
+    size_t capacity;
+} WalBuffer;
+
+// The calling shard's WAL buffer, or NULL where records go straight to the WAL
+static __thread WalBuffer *shard_wal_buffer = NULL;
+
+// Held for reading by every balance update outside the sharded engine and
+// for writing while a checkpoint or a balance snapshot picks its cut, so
+// neither ever sees half of an update applied. Shards do not take it: a
+// cut stops them between operations instead (see cut_begin()).
+pthread_rwlock_t checkpoint_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Serializes cuts with each other and with starting and stopping the
+// sharded engine
+pthread_mutex_t cut_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The running sharded engine, if any (guarded by cut_lock)
+struct WorkerPool *sharded_engine = NULL;
+
+// Set on the threads of the sharded engine
+static __thread int on_shard_thread = 0;
+
+// Slot values of a BalanceSnapshot that are not balances
+#define SNAPSHOT_UNCAPTURED INT64_MIN       // Not changed since the cut, not scanned yet
+#define SNAPSHOT_MISSING (INT64_MIN + 1)    // The account did not exist at the cut
+
+// Copy-on-write view of every balance at one cut. While a snapshot is
+// active, each account's slot receives its balance as of the cut, either
+// from the first update after the cut (before it changes anything) or from
+// the scan, whichever gets there first.
+typedef struct {
+    int count;                  // Accounts that existed at the cut
+    Money total;                // Book total at the cut
+    _Atomic int64_t balances[];
+} BalanceSnapshot;
+
+// The snapshot in progress, if any; replaced only during a cut (see cut_begin())
+_Atomic(BalanceSnapshot*) active_snapshot = NULL;
+
+// Running total of every resident balance, split into stripes so deposits
+// and withdrawals on different threads do not share a line. Stripes are
+// added to with the balances, inside cut_hold(), so their sum taken during
+// a cut matches the balances exactly. They wrap
+// like the atomics they are; the sum is only read as a whole.
+#define BOOK_TOTAL_STRIPES 16
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t value;
+} BookTotalStripe;
+
+BookTotalStripe book_total_stripes[BOOK_TOTAL_STRIPES];
+
+// Accounts changed since the last central log report, linked through
+// AccountInfo.next_report_dirty; taken whole during a cut
+_Atomic(Account*) report_dirty_accounts = NULL;
+
+// Account storage: segment k holds ACCOUNT_SEGMENT_BASE << k accounts and is
+// allocated the first time it is needed. Existing accounts never move, so
+// pointers returned by get_account() and the mutexes inside them stay valid.
+Account *account_segments[ACCOUNT_SEGMENT_COUNT];
+AccountInfo *account_info_segments[ACCOUNT_SEGMENT_COUNT];
+_Atomic int account_count = 0;
+
+// Interned account reference: the account's storage number. Handles are
+// fixed for the run, so callers can resolve an ID once and skip the hash
+// lookup and string compares on every later operation.
+typedef uint32_t AccountHandle;
+
+#define INVALID_ACCOUNT_HANDLE UINT32_MAX
+
+// Mutex serializing account creation (lookups do not take it)
+pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Open-addressing hash index over the accounts array.
+// Readers load the current table without locking; writers insert under
+// global_lock and, when the table fills up, publish a larger copy. Replaced
+// tables stay readable until shutdown so in-flight lookups never touch freed
+// memory.
+typedef struct AccountIndex {
+    size_t mask;
+    struct AccountIndex *retired;
+    _Atomic(Account*) slots[];
+} AccountIndex;
+
+_Atomic(AccountIndex*) account_index = NULL;
+
+// Accounts whose resident balance has not been written back yet
+_Atomic(Account*) dirty_accounts = NULL;
+
+// State shared with the balance flusher thread
+pthread_t balance_flusher_thread;
+pthread_mutex_t balance_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t balance_flush_request = PTHREAD_COND_INITIALIZER;
+pthread_cond_t balance_flush_done = PTHREAD_COND_INITIALIZER;
+_Atomic uint64_t balance_flush_started = 0;
+uint64_t balance_flush_completed = 0;
+uint64_t balance_flush_failed = 0;
+uint64_t balance_flush_wanted = 0;
+int balance_flusher_stop = 0;
+int balance_flusher_running = 0;
+
+// --wal-io=uring with the file store: flushed account files are written
+// through this ring, guarded by balance_ring_lock
+IoRing balance_ring = {.fd = -1};
+pthread_mutex_t balance_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Path to the central transaction log
+char central_transaction_log[100] = ACCOUNTS_DIR "/" TRANSACTION_LOG;
+
+// How a log writer gets records to its file
+typedef enum {
+    LOG_DIRECT,                 // write() each record as it is appended
+    LOG_BUFFERED,               // queue records; a writer thread writes them in batches
+    LOG_GROUP_COMMIT            // as buffered, but appenders wait for their batch
+} LogMode;
+
+// A long-lived, append-only log file. The descriptor stays open across
+// records; in the buffered modes callers fill the active buffer while the
+// writer thread writes the standby one. The file is rotated by size or age
+// from the writing side, so appenders never wait on a rotation.
+typedef struct {
+    char path[100];
+    int fd;
+    off_t size;
+    time_t opened_at;
+    off_t rotate_bytes;         // 0 disables size-based rotation
+    int rotate_seconds;         // 0 disables age-based rotation
+    int rotations;
+    int fsync;                  // Sync after every write
+    LogMode mode;
+    int batch_records;
+    int max_wait_us;
+    pthread_mutex_t io_lock;    // Serializes writes and rotation
+    IoRing ring;                // --wal-io=uring, buffered modes: writes go through it (under io_lock)
+    // Buffered modes only, guarded by lock
+    pthread_mutex_t lock;
+    char *active;
+    char *standby;
+    size_t active_used;
+    int pending_records;
+    struct timespec batch_deadline;
+    uint64_t appended;          // Records handed to the writer so far
+    uint64_t durable;           // Records written (and synced, with fsync)
+    pthread_cond_t request;
+    pthread_cond_t space;
+    pthread_cond_t done;
+    pthread_t thread;
+    int stop;
+} LogWriter;
+
+// Transaction log record encodings
+typedef enum {
+    LOG_FORMAT_TEXT,            // "timestamp | op | user | details | status" lines
+    LOG_FORMAT_BINARY           // BinaryLogRecord, see transaction_log.h
+} LogFormat;
+
+// Transaction log settings
+LogFormat log_format = LOG_FORMAT_TEXT;
+LogMode log_mode = LOG_DIRECT;
+int log_fsync = 0;
+int log_batch_records = DEFAULT_LOG_BATCH_RECORDS;
+int log_max_wait_us = DEFAULT_LOG_MAX_WAIT_US;
+off_t log_rotate_bytes = 0;
+int log_rotate_seconds = 0;
+
+// The transaction log shared by every operation
+LogWriter transaction_log = {.fd = -1};
+
+// How operation results reach the console
+typedef enum {
+    CONSOLE_DIRECT,             // Printed through stdio as they happen
+    CONSOLE_ASYNC,              // Queued; a writer thread prints them in batches
+    CONSOLE_OFF                 // Not printed at all
+} ConsoleMode;
+
+ConsoleMode console_mode = CONSOLE_DIRECT;
+
+// The console writer under CONSOLE_ASYNC, on a duplicate of stdout
+LogWriter console = {.fd = -1};
+
+// Operation outcomes reported to the console, with the OperationResult
+// fields each one uses
+typedef enum {
+    RESULT_ACCOUNT_CREATED,         // account, amount (initial balance)
+    RESULT_ACCOUNT_EXISTS,          // account
+    RESULT_CREATE_ERROR,            // account
+    RESULT_ACCOUNT_LIMIT,           // account
+    RESULT_CREATE_FAILED,           // account
+    RESULT_ACCOUNT_NOT_FOUND,       // account
+    RESULT_BALANCE_CORRUPT,         // account
+    RESULT_READ_FAILED,             // account
+    RESULT_INVALID_AMOUNT,          // account, amount
+    RESULT_TRANSFERRED,             // account, target, amount
+    RESULT_TRANSFER_INSUFFICIENT,   // account, balance
+    RESULT_TRANSFER_OVERFLOW,       // account, target
+    RESULT_BATCH_INSUFFICIENT,      // account
+    RESULT_TRANSFER_FAILED,         // account, target
+    RESULT_TRANSFER_ROLLED_BACK,    // account, target
+    RESULT_TRANSFER_TO_SELF,
+    RESULT_TRANSFER_READ_FAILED,
+    RESULT_TRANSFER_MISSING,        // account, target
+    RESULT_DEPOSITED,               // account, amount, balance
+    RESULT_DEPOSIT_FAILED,          // account, amount
+    RESULT_DEPOSIT_OVERFLOW,        // account, amount
+    RESULT_DEPOSIT_MISSING,         // account
+    RESULT_WITHDRAWN,               // account, amount, balance
+    RESULT_WITHDRAW_INSUFFICIENT,   // account, balance
+    RESULT_WITHDRAW_FAILED,         // account, amount
+    RESULT_WITHDRAW_MISSING,        // account
+    RESULT_BALANCE,                 // account, balance
+    RESULT_VIEW_MISSING             // account
+} ResultEvent;
+
+// One operation outcome. Accounts are named by ID; the *_MISSING events
+// name them by handle instead when the ID is NULL.
+typedef struct {
+    ResultEvent event;
+    const char *account_id;
+    const char *target_id;
+    AccountHandle handle;
+    AccountHandle target_handle;
+    Money amount;
+    Money balance;
+} OperationResult;
+
+// Function to read the clock as a timestamp
+Timestamp timestamp_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (Timestamp)now.tv_sec * 1000000u + (Timestamp)(now.tv_nsec / 1000);
+}
+
+// Latency histograms: the power-of-two range of a value in nanoseconds,
+// split into 2^LATENCY_SUB_BUCKET_BITS linear buckets, keeps every
+// percentile within about 6% of the true value
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+} LatencyHistogram;
+
+// Function to find the bucket of a latency in nanoseconds
+static int latency_bucket(uint64_t nanoseconds) {
+    if(nanoseconds < LATENCY_SUB_BUCKETS) {
+        return (int)nanoseconds;
+    }
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    int sub = (int)(nanoseconds >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// Function to get the smallest latency, in nanoseconds, that falls in a bucket
+static uint64_t latency_bucket_floor(int bucket) {
+    if(bucket < LATENCY_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    uint64_t sub = (uint64_t)(bucket % LATENCY_SUB_BUCKETS);
+    return (LATENCY_SUB_BUCKETS + sub) << (exponent - LATENCY_SUB_BUCKET_BITS);
+}
+
+// Function to record one latency
+static void latency_record(LatencyHistogram *histogram, uint64_t nanoseconds) {
+    histogram->counts[latency_bucket(nanoseconds)]++;
+    histogram->total++;
+}
+
+// Function to add one histogram's samples to another
+static void latency_merge(LatencyHistogram *into, const LatencyHistogram *from) {
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+}
+
+// Function to find the latency below which a fraction of the samples fall
+static uint64_t latency_percentile(const LatencyHistogram *histogram, double fraction) {
+    if(histogram->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->total);
+    uint64_t seen = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if(seen > rank) {
+            return latency_bucket_floor(i);
+        }
+    }
+    return latency_bucket_floor(LATENCY_BUCKETS - 1);
+}
+
+// Function to read a monotonic clock in nanoseconds
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Points in the engine that instrumentation measures. Lock probes count
+// every acquisition and time only the ones that had to wait; the others
+// time every event.
+typedef enum {
+    PROBE_GLOBAL_LOCK,          // global_lock, taken when an account is created
+    PROBE_ACCOUNT_LOCK,         // Account.lock
+    PROBE_LOG_LOCK,             // Transaction log writer locks taken by appenders
+    PROBE_BALANCE_LOAD,         // Reading a balance from the balance store
+    PROBE_BALANCE_STORE,        // Writing balances to the balance store
+    PROBE_WAL_LOCK,             // wal.lock, taken to append a record
+    PROBE_WAL_SYNC,             // fdatasync of the write-ahead log
+    PROBE_TRANSFER,
+    PROBE_DEPOSIT,
+    PROBE_WITHDRAW,
+    PROBE_VIEW_BALANCE,
+    PROBE_COUNT
+} Probe;
+
+#ifdef BS_INSTRUMENT
+static const char *const probe_names[PROBE_COUNT] = {
+    "global_lock", "account_lock", "log_lock", "balance_load", "balance_store",
+    "wal_lock", "wal_sync", "transfer", "deposit", "withdraw", "view_balance"
+};
+
+// One thread's measurements for one probe. Only the owning thread writes
+// them, so updates are plain relaxed loads and stores; the dump reads them
+// concurrently.
+typedef struct {
+    _Atomic uint64_t events;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t counts[LATENCY_BUCKETS];
+} ProbeStats;
+
+// Every running instrumented thread's measurements. A thread's are merged
+// into probe_totals and freed when it exits (see probe_thread_exit()).
+typedef struct ProbeThread {
+    ProbeStats stats[PROBE_COUNT];
+    struct ProbeThread *next;
+} ProbeThread;
+
+// probe_threads and probe_totals, guarded by probe_lock
+pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+ProbeThread *probe_threads = NULL;
+ProbeStats probe_totals[PROBE_COUNT];
+static pthread_key_t probe_thread_key;
+static pthread_once_t probe_thread_key_once = PTHREAD_ONCE_INIT;
+static __thread ProbeThread *probe_thread = NULL;
+
+// Function to add one to a counter only this thread writes
+static inline void probe_increment(_Atomic uint64_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Function to add one set of probe measurements into totals
+static void probe_stats_add(ProbeStats *totals, ProbeStats *stats) {
+    for(int probe = 0; probe < PROBE_COUNT; probe++) {
+        atomic_fetch_add_explicit(&totals[probe].events, atomic_load_explicit(&stats[probe].events, memory_order_relaxed), memory_order_relaxed);
+        atomic_fetch_add_explicit(&totals[probe].contended, atomic_load_explicit(&stats[probe].contended, memory_order_relaxed), memory_order_relaxed);
+        for(int i = 0; i < LATENCY_BUCKETS; i++) {
+            atomic_fetch_add_explicit(&totals[probe].counts[i], atomic_load_explicit(&stats[probe].counts[i], memory_order_relaxed), memory_order_relaxed);
+        }
+    }
+}
+
+// Function run as an instrumented thread exits: keeps its measurements in
+// probe_totals and frees them, so short-lived threads do not pile up
+static void probe_thread_exit(void *arg) {
+    ProbeThread *thread = arg;
+    pthread_mutex_lock(&probe_lock);
+    probe_stats_add(probe_totals, thread->stats);
+    ProbeThread **link = &probe_threads;
+    while(*link != thread) {
+        link = &(*link)->next;
+    }
+    *link = thread->next;
+    pthread_mutex_unlock(&probe_lock);
+    probe_thread = NULL;
+    free(thread);
+}
+
+// Function to create the key whose destructor runs probe_thread_exit()
+static void probe_thread_key_create() {
+    pthread_key_create(&probe_thread_key, probe_thread_exit);
+}
+
+// Function to get this thread's measurements, registering them on first use
+static ProbeThread* probe_thread_stats() {
+    if(probe_thread == NULL) {
+        ProbeThread *thread = calloc(1, sizeof(ProbeThread));
+        if(thread == NULL) {
+            return NULL;
+        }
+        pthread_once(&probe_thread_key_once, probe_thread_key_create);
+        pthread_mutex_lock(&probe_lock);
+        thread->next = probe_threads;
+        probe_threads = thread;
+        pthread_mutex_unlock(&probe_lock);
+        pthread_setspecific(probe_thread_key, thread);
+        probe_thread = thread;
+    }
+    return probe_thread;
+}
+
+// Function to record one event, timed or not
+static void probe_record(Probe probe, int contended, int timed, uint64_t nanoseconds) {
+    ProbeThread *thread = probe_thread_stats();
+    if(thread == NULL) {
+        return;
+    }
+    ProbeStats *stats = &thread->stats[probe];
+    probe_increment(&stats->events);
+    if(contended) {
+        probe_increment(&stats->contended);
+    }
+    if(timed) {
+        probe_increment(&stats->counts[latency_bucket(nanoseconds)]);
+    }
+}
+
+// Function to print every probe, summed over all threads. Goes to stderr,
+// which the workload benchmark leaves alone while it silences stdout.
+void instrumentation_dump() {
+    fprintf(stderr, "Instrumentation:\n");
+    fprintf(stderr, "  %-14s %12s %12s %10s %10s %10s\n", "probe", "events", "contended", "p50 us", "p99 us", "p999 us");
+    // The exited threads' totals plus every running thread's measurements
+    ProbeStats sums[PROBE_COUNT];
+    memset(sums, 0, sizeof(sums));
+    pthread_mutex_lock(&probe_lock);
+    probe_stats_add(sums, probe_totals);
+    for(ProbeThread *thread = probe_threads; thread != NULL; thread = thread->next) {
+        probe_stats_add(sums, thread->stats);
+    }
+    pthread_mutex_unlock(&probe_lock);
+    for(int probe = 0; probe < PROBE_COUNT; probe++) {
+        LatencyHistogram merged = {{0}, 0};
+        uint64_t events = atomic_load_explicit(&sums[probe].events, memory_order_relaxed);
+        uint64_t contended = atomic_load_explicit(&sums[probe].contended, memory_order_relaxed);
+        for(int i = 0; i < LATENCY_BUCKETS; i++) {
+            uint64_t count = atomic_load_explicit(&sums[probe].counts[i], memory_order_relaxed);
+            merged.counts[i] += count;
+            merged.total += count;
+        }
+        if(events == 0) {
+            continue;
+        }
+        fprintf(stderr, "  %-14s %12llu %12llu %10.1f %10.1f %10.1f\n", probe_names[probe],
+                (unsigned long long)events, (unsigned long long)contended,
+                latency_percentile(&merged, 0.50) / 1e3, latency_percentile(&merged, 0.99) / 1e3,
+                latency_percentile(&merged, 0.999) / 1e3);
+    }
+}
+
+// Seconds between periodic dumps; 0 dumps only on SIGUSR1 and at exit
+int stats_interval = 0;
+
+// Thread function that dumps the instrumentation on SIGUSR1 and, when
+// stats_interval is set, on a timer. SIGUSR1 is blocked in every thread
+// (see instrumentation_start()), so it always arrives here.
+static void* instrumentation_thread(void *arg) {
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    for(;;) {
+        struct timespec timeout = {stats_interval, 0};
+        int signal = stats_interval > 0 ? sigtimedwait(&signals, NULL, &timeout) : sigwaitinfo(&signals, NULL);
+        if(signal == SIGUSR1 || (signal < 0 && errno == EAGAIN)) {
+            instrumentation_dump();
+        }
+    }
+    return NULL;
+}
+
+// Function to start the dump thread. Must run before any other thread is
+// created, so they all inherit the blocked SIGUSR1.
+int instrumentation_start() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, instrumentation_thread, NULL) != 0) {
+        printf("Error starting the instrumentation thread.\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+#endif
+
+// Function to read the clock for a timed probe (0 when not instrumented)
+static inline uint64_t probe_begin() {
+#ifdef BS_INSTRUMENT
+    return monotonic_ns();
+#else
+    return 0;
+#endif
+}
+
+// Function to record a timed probe started with probe_begin()
+static inline void probe_end(Probe probe, uint64_t start) {
+#ifdef BS_INSTRUMENT
+    probe_record(probe, 0, 1, monotonic_ns() - start);
+#else
+    (void)probe;
+    (void)start;
+#endif
+}
+
+// Function to lock a mutex, counting the acquisition and timing the wait
+// if it was contended when instrumented
+static inline void probed_lock(pthread_mutex_t *mutex, Probe probe) {
+#ifdef BS_INSTRUMENT
+    if(pthread_mutex_trylock(mutex) == 0) {
+        probe_record(probe, 0, 0, 0);
+        return;
+    }
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(mutex);
+    probe_record(probe, 1, 1, monotonic_ns() - start);
+#else
+    (void)probe;
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+// Function to get the file path for an account
+void get_account_filepath(const char *account_id, char *filepath) {
+    sprintf(filepath, "%s/%s.txt", ACCOUNTS_DIR, account_id);
+}
+
+// Function to map an account number to its segment and offset
+static int account_segment_of(int n, size_t *offset) {
+    size_t block = (size_t)n / ACCOUNT_SEGMENT_BASE + 1;
+    int segment = 63 - __builtin_clzll(block);
+    *offset = (size_t)n - ACCOUNT_SEGMENT_BASE * (((size_t)1 << segment) - 1);
+    return segment;
+}
+
+// Function to find an account by number
+static Account* account_at(int n) {
+    size_t offset;
+    int segment = account_segment_of(n, &offset);
+    return &account_segments[segment][offset];
+}
+
+// Function to find the cold part of an account
+static AccountInfo* account_info(const Account *account) {
+    size_t offset;
+    int segment = account_segment_of(account->number, &offset);
+    return &account_info_segments[segment][offset];
+}
+
+// Function to get an account's ID
+static const char* account_name(const Account *account) {
+    return account_info(account)->account_id;
+}
+
+// Function to reserve storage for the next account (caller holds global_lock)
+static Account* account_storage_next() {
+    int n = atomic_load_explicit(&account_count, memory_order_relaxed);
+    size_t offset;
+    int segment = account_segment_of(n, &offset);
+    if(segment >= ACCOUNT_SEGMENT_COUNT) {
+        return NULL;
+    }
+    if(account_segments[segment] == NULL) {
+        size_t count = (size_t)ACCOUNT_SEGMENT_BASE << segment;
+        Account *accounts = aligned_alloc(CACHE_LINE_SIZE, count * sizeof(Account));
+        AccountInfo *infos = calloc(count, sizeof(AccountInfo));
+        if(accounts == NULL || infos == NULL) {
+            free(accounts);
+            free(infos);
+            return NULL;
+        }
+        memset(accounts, 0, count * sizeof(Account));
+        account_info_segments[segment] = infos;
+        account_segments[segment] = accounts;
+    }
+    Account *account = account_at(n);
+    account->number = n;
+    return account;
+}
+
+// Function to hash an account ID (FNV-1a)
+static uint64_t hash_account_id(const char *account_id) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(const unsigned char *p = (const unsigned char*)account_id; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Function to allocate an empty index table
+static AccountIndex* account_index_alloc(size_t slot_count) {
+    AccountIndex *index = calloc(1, sizeof(AccountIndex) + slot_count * sizeof(_Atomic(Account*)));
+    if(index == NULL) {
+        return NULL;
+    }
+    index->mask = slot_count - 1;
+    for(size_t i = 0; i < slot_count; i++) {
+        atomic_init(&index->slots[i], NULL);
+    }
+    return index;
+}
+
+// Function to place an account into an index table (caller holds global_lock)
+static void account_index_place(AccountIndex *index, Account *account) {
+    size_t slot = hash_account_id(account_name(account)) & index->mask;
+    while(atomic_load_explicit(&index->slots[slot], memory_order_relaxed) != NULL) {
+        slot = (slot + 1) & index->mask;
+    }
+    atomic_store_explicit(&index->slots[slot], account, memory_order_release);
+}
+
+// Function to look up an account without taking global_lock
+static Account* find_account(const char *account_id) {
+    AccountIndex *index = atomic_load_explicit(&account_index, memory_order_acquire);
+    if(index == NULL) {
+        return NULL;
+    }
+    size_t slot = hash_account_id(account_id) & index->mask;
+    for(;;) {
+        Account *account = atomic_load_explicit(&index->slots[slot], memory_order_acquire);
+        if(account == NULL) {
+            return NULL;
+        }
+        if(strcmp(account_name(account), account_id) == 0) {
+            return account;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+}
+
+// Function to add an account to the index, growing it when half full (caller holds global_lock)
+static int account_index_insert(Account *account) {
+    AccountIndex *index = atomic_load_explicit(&account_index, memory_order_relaxed);
+    if(index == NULL || (size_t)(account_count + 1) * 2 > index->mask + 1) {
+        size_t slot_count = index == NULL ? ACCOUNT_INDEX_INITIAL_SLOTS : (index->mask + 1) * 2;
+        AccountIndex *grown = account_index_alloc(slot_count);
+        if(grown == NULL) {
+            return -1;
+        }
+        for(int i = 0; i < account_count; i++) {
+            account_index_place(grown, account_at(i));
+        }
+        grown->retired = index;
+        atomic_store_explicit(&account_index, grown, memory_order_release);
+        index = grown;
+    }
+    account_index_place(index, account);
+    return 0;
+}
+
+// Function to free the index and every table it replaced
+static void account_index_destroy() {
+    AccountIndex *index = atomic_exchange(&account_index, NULL);
+    while(index != NULL) {
+        AccountIndex *retired = index->retired;
+        free(index);
+        index = retired;
+    }
+}
+
+// Defined with the transaction log below
+void log_account_name(const Account *account);
+void report_result(const OperationResult *result);
+
+// Function to retrieve or add an account entry, refusing to add one once
+// limit entries exist (0 for no limit)
+static Account* add_account(const char *account_id, int limit) {
+    Account *account = find_account(account_id);
+    if(account != NULL) {
+        return account;
+    }
+    probed_lock(&global_lock, PROBE_GLOBAL_LOCK);
+    // Another thread may have created it while we waited for the lock
+    account = find_account(account_id);
+    if(account != NULL) {
+        pthread_mutex_unlock(&global_lock);
+        return account;
+    }
+    if(limit > 0 && account_count >= limit) {
+        pthread_mutex_unlock(&global_lock);
+        return NULL;
+    }
+    // If account does not exist, create it
+    account = account_storage_next();
+    if(account == NULL) {
+        pthread_mutex_unlock(&global_lock);
+        return NULL;
+    }
+    strcpy(account_info(account)->account_id, account_id);
+    atomic_init(&account_info(account)->store_slot, -1);
+    pthread_mutex_init(&account->lock, NULL);
+    if(account_index_insert(account) != 0) {
+        pthread_mutex_destroy(&account->lock);
+        pthread_mutex_unlock(&global_lock);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&account_count, 1, memory_order_release);
+    log_account_name(account);
+    pthread_mutex_unlock(&global_lock);
+    return account;
+}
+
+// Function to retrieve or create an account entry, for recovery and the
+// in-memory benchmarks. Operations look accounts up with find_account(), so
+// IDs that were never created cannot grow the store.
+Account* get_account(const char *account_id) {
+    return add_account(account_id, 0);
+}
+
+// Function to look up an account and return its handle
+AccountHandle account_handle(const char *account_id) {
+    Account *account = find_account(account_id);
+    return account != NULL ? (AccountHandle)account->number : INVALID_ACCOUNT_HANDLE;
+}
+
+// Function to resolve a handle; returns NULL for handles never handed out
+Account* account_from_handle(AccountHandle handle) {
+    if(handle >= (AccountHandle)atomic_load_explicit(&account_count, memory_order_acquire)) {
+        return NULL;
+    }
+    return account_at((int)handle);
+}
+
+// Function to read the balance of an account
+int read_balance(const char *account_id, Money *balance) {
+    char filepath[100];
+    get_account_filepath(account_id, filepath);
+    FILE *file = fopen(filepath, "r");
+    if(file == NULL) {
+        report_result(&(OperationResult){.event = RESULT_ACCOUNT_NOT_FOUND, .account_id = account_id});
+        return -1;
+    }
+    char text[32];
+    if(fgets(text, sizeof(text), file) == NULL || money_parse(text, balance) != 0) {
+        report_result(&(OperationResult){.event = RESULT_BALANCE_CORRUPT, .account_id = account_id});
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Function to write the balance to an account file atomically
+int write_balance_atomic(const char *account_id, Money new_balance) {
+    char filepath[100];
+    char temp_filepath[150];
+    get_account_filepath(account_id, filepath);
+    sprintf(temp_filepath, "%s.tmp", filepath);
+    
+    FILE *temp_file = fopen(temp_filepath, "w");
+    if(temp_file == NULL) {
+        printf("Error opening temporary file for account %s.\n", account_id);
+        return -1;
+    }
+    fprintf(temp_file, "%" PRId64 "\n", new_balance);
+    fclose(temp_file);
+    
+    // Replace the original file with the temporary file
+    if(rename(temp_filepath, filepath) != 0) {
+        printf("Error replacing file for account %s.\n", account_id);
+        unlink(temp_filepath);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to flush the accounts directory (new names and renamed files) to disk
+static int sync_accounts_dir() {
+    int fd = open(ACCOUNTS_DIR, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) {
+        return -1;
+    }
+    int status = syncfs(fd);
+    close(fd);
+    return status;
+}
+
+// Function to load a balance from its account file
+static int file_store_load(Account *account, Money *balance) {
+    return read_balance(account_name(account), balance);
+}
+
+// Function to store a balance in its account file
+static int file_store_store(Account *account, Money balance) {
+    return write_balance_atomic(account_name(account), balance);
+}
+
+// Defined with the io_uring helpers below
+static int io_ring_open(IoRing *ring, unsigned entries);
+static void io_ring_close(IoRing *ring);
+static int file_store_batch_ring(Account *accounts[], const Money balances[], int count);
+
+// Function to prepare the file store; under --wal-io=uring it sets up the
+// ring flushed balances are written through
+static int file_store_open() {
+    if(wal_io_mode == WAL_IO_URING && io_ring_open(&balance_ring, BALANCE_FLUSH_BATCH) != 0) {
+        printf("io_uring is not available for the account files.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to close the file store's ring, if it has one
+static void file_store_close() {
+    pthread_mutex_lock(&balance_ring_lock);
+    if(balance_ring.fd >= 0) {
+        io_ring_close(&balance_ring);
+    }
+    pthread_mutex_unlock(&balance_ring_lock);
+}
+
+// Function to store several balances, one account file each
+static int file_store_batch(Account *accounts[], const Money balances[], int count) {
+    if(balance_ring.fd >= 0) {
+        int stored = file_store_batch_ring(accounts, balances, count);
+        if(stored >= 0) {
+            return stored;
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        if(write_balance_atomic(account_name(accounts[i]), balances[i]) != 0) {
+            return i;
+        }
+    }
+    return count;
+}
+
+// Function to tell whether an account file exists
+static int file_store_exists(Account *account) {
+    char filepath[100];
+    get_account_filepath(account_name(account), filepath);
+    return access(filepath, F_OK) == 0;
+}
+
+// Function to visit the account files of one part, chosen by the hash of
+// the account ID; every part reads the whole directory but registers only
+// its own accounts
+static int file_store_iterate(int part, int parts, Account* (*visit)(const char *account_id)) {
+    DIR *dir = opendir(ACCOUNTS_DIR);
+    if(dir == NULL) {
+        return -1;
+    }
+    int status = 0;
+    struct dirent *dirent;
+    while(status == 0 && (dirent = readdir(dir)) != NULL) {
+        char account_id[50];
+        size_t length = strlen(dirent->d_name);
+        if(length <= 4 || length - 4 >= sizeof(account_id) || strcmp(dirent->d_name + length - 4, ".txt") != 0 ||
+           strcmp(dirent->d_name, CENTRAL_LOG_FILE) == 0) {
+            continue;
+        }
+        memcpy(account_id, dirent->d_name, length - 4);
+        account_id[length - 4] = '\0';
+        if(parts > 1 && (int)(hash_account_id(account_id) % (uint64_t)parts) != part) {
+            continue;
+        }
+        if(visit(account_id) == NULL) {
+            status = -1;
+        }
+    }
+    closedir(dir);
+    return status;
+}
+
+// Function to open the memory-mapped balance store, creating it if needed.
+// Slots stay where they are for good; the mapping reserves room for
+// BALANCE_STORE_MAX_SLOTS up front so it never moves while the file grows.
+static int mmap_store_open() {
+    char filepath[100];
+    sprintf(filepath, "%s/%s", ACCOUNTS_DIR, BALANCE_STORE_FILE);
+    int fd = open(filepath, O_RDWR | O_CREAT, 0600);
+    if(fd < 0) {
+        printf("Error opening balance store %s.\n", filepath);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, (off_t)(BALANCE_STORE_INITIAL_SLOTS * sizeof(BalanceSlot))) != 0)) {
+        printf("Error sizing balance store %s.\n", filepath);
+        close(fd);
+        return -1;
+    }
+    off_t size = st.st_size ? st.st_size : (off_t)(BALANCE_STORE_INITIAL_SLOTS * sizeof(BalanceSlot));
+    BalanceSlot *slots = mmap(NULL, (size_t)BALANCE_STORE_MAX_SLOTS * sizeof(BalanceSlot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(slots == MAP_FAILED) {
+        printf("Error mapping balance store %s.\n", filepath);
+        close(fd);
+        return -1;
+    }
+    BalanceStoreHeader *header = (BalanceStoreHeader*)slots;
+    if(st.st_size == 0) {
+        header->magic = BALANCE_STORE_MAGIC;
+        header->used_slots = 0;
+    } else if(header->magic != BALANCE_STORE_MAGIC || size % sizeof(BalanceSlot) != 0 ||
+              (off_t)(header->used_slots + 1) * (off_t)sizeof(BalanceSlot) > size) {
+        printf("Balance store %s is corrupt.\n", filepath);
+        munmap(slots, (size_t)BALANCE_STORE_MAX_SLOTS * sizeof(BalanceSlot));
+        close(fd);
+        return -1;
+    }
+    balance_store_map.fd = fd;
+    balance_store_map.slots = slots;
+    balance_store_map.capacity = (uint32_t)(size / sizeof(BalanceSlot)) - 1;
+    return 0;
+}
+
+// Function to find an account's slot in the mapped store, assigning the next
+// free one on its first write; NULL if it has none and create is 0
+static BalanceSlot* balance_store_slot(Account *account, int create) {
+    AccountInfo *info = account_info(account);
+    int slot = atomic_load_explicit(&info->store_slot, memory_order_acquire);
+    if(slot >= 0) {
+        return &balance_store_map.slots[slot + 1];
+    }
+    if(!create) {
+        return NULL;
+    }
+    pthread_mutex_lock(&balance_store_map.lock);
+    BalanceStoreHeader *header = (BalanceStoreHeader*)balance_store_map.slots;
+    if(header->used_slots == balance_store_map.capacity) {
+        uint32_t capacity = balance_store_map.capacity * 2 + 1;
+        if(capacity + 1 > BALANCE_STORE_MAX_SLOTS ||
+           ftruncate(balance_store_map.fd, (off_t)(capacity + 1) * sizeof(BalanceSlot)) != 0) {
+            pthread_mutex_unlock(&balance_store_map.lock);
+            printf("Error growing the balance store.\n");
+            return NULL;
+        }
+        balance_store_map.capacity = capacity;
+    }
+    slot = (int)header->used_slots;
+    BalanceSlot *entry = &balance_store_map.slots[slot + 1];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->account_id, info->account_id);
+    header->used_slots++;
+    atomic_store_explicit(&info->store_slot, slot, memory_order_release);
+    pthread_mutex_unlock(&balance_store_map.lock);
+    return entry;
+}
+
+// Function to load a balance from its slot
+static int mmap_store_load(Account *account, Money *balance) {
+    BalanceSlot *slot = balance_store_slot(account, 0);
+    if(slot == NULL) {
+        report_result(&(OperationResult){.event = RESULT_ACCOUNT_NOT_FOUND, .account_id = account_name(account)});
+        return -1;
+    }
+    *balance = slot->balance;
+    return 0;
+}
+
+// Function to store a balance in its slot
+static int mmap_store_store(Account *account, Money balance) {
+    BalanceSlot *slot = balance_store_slot(account, 1);
+    if(slot == NULL) {
+        return -1;
+    }
+    slot->balance = balance;
+    return 0;
+}
+
+// Function to store several balances in their slots
+static int mmap_store_batch(Account *accounts[], const Money balances[], int count) {
+    for(int i = 0; i < count; i++) {
+        if(mmap_store_store(accounts[i], balances[i]) != 0) {
+            return i;
+        }
+    }
+    return count;
+}
+
+// Function to tell whether an account has a slot
+static int mmap_store_exists(Account *account) {
+    return balance_store_slot(account, 0) != NULL;
+}
+
+// Function to flush the mapped slots to disk
+static int mmap_store_sync() {
+    pthread_mutex_lock(&balance_store_map.lock);
+    size_t length = (size_t)(balance_store_map.capacity + 1) * sizeof(BalanceSlot);
+    int status = msync(balance_store_map.slots, length, MS_SYNC);
+    pthread_mutex_unlock(&balance_store_map.lock);
+    return status;
+}
+
+// Function to visit one part's range of used slots, binding each account to its slot
+static int mmap_store_iterate(int part, int parts, Account* (*visit)(const char *account_id)) {
+    BalanceStoreHeader *header = (BalanceStoreHeader*)balance_store_map.slots;
+    uint32_t end = (uint32_t)((uint64_t)header->used_slots * (uint64_t)(part + 1) / (uint64_t)parts);
+    for(uint32_t i = (uint32_t)((uint64_t)header->used_slots * (uint64_t)part / (uint64_t)parts); i < end; i++) {
+        BalanceSlot *slot = &balance_store_map.slots[i + 1];
+        slot->account_id[sizeof(slot->account_id) - 1] = '\0';
+        Account *account = visit(slot->account_id);
+        if(account == NULL) {
+            printf("Error loading account %s from the balance store.\n", slot->account_id);
+            return -1;
+        }
+        atomic_store_explicit(&account_info(account)->store_slot, (int)i, memory_order_release);
+    }
+    return 0;
+}
+
+// Function to sync and unmap the balance store
+static void mmap_store_close() {
+    if(balance_store_map.slots == NULL) {
+        return;
+    }
+    mmap_store_sync();
+    munmap(balance_store_map.slots, (size_t)BALANCE_STORE_MAX_SLOTS * sizeof(BalanceSlot));
+    close(balance_store_map.fd);
+    balance_store_map.slots = NULL;
+    balance_store_map.fd = -1;
+}
+
+// Function to report that an account has no stored balance; the in-memory
+// backend keeps nothing beyond the resident balances
+static int memory_store_load(Account *account, Money *balance) {
+    (void)balance;
+    report_result(&(OperationResult){.event = RESULT_ACCOUNT_NOT_FOUND, .account_id = account_name(account)});
+    return -1;
+}
+
+// Function to accept a balance without storing it anywhere
+static int memory_store_store(Account *account, Money balance) {
+    (void)account;
+    (void)balance;
+    return 0;
+}
+
+// Function to accept several balances without storing them anywhere
+static int memory_store_batch(Account *accounts[], const Money balances[], int count) {
+    (void)accounts;
+    (void)balances;
+    return count;
+}
+
+// Function for backend operations that have nothing to do
+static int memory_store_none() {
+    return 0;
+}
+
+// Function to close a backend that holds nothing open
+static void store_close_none() {
+}
+
+// Function for the in-memory backend, which never has stored balances
+static int memory_store_exists(Account *account) {
+    (void)account;
+    return 0;
+}
+
+// Function to visit the in-memory backend's stored accounts (there are none)
+static int memory_store_iterate(int part, int parts, Account* (*visit)(const char *account_id)) {
+    (void)part;
+    (void)parts;
+    (void)visit;
+    return 0;
+}
+
+// One accounts/<id>.txt file per account
+static const BalanceStore file_balance_store = {
+    "files", file_store_open, file_store_load, file_store_store, file_store_batch,
+    file_store_exists, sync_accounts_dir, file_store_iterate, file_store_close
+};
+
+// Fixed-size slots in one memory-mapped file
+static const BalanceStore mmap_balance_store = {
+    "mmap", mmap_store_open, mmap_store_load, mmap_store_store, mmap_store_batch,
+    mmap_store_exists, mmap_store_sync, mmap_store_iterate, mmap_store_close
+};
+
+// Nothing kept between runs; for benchmarking the engine without storage costs
+static const BalanceStore memory_balance_store = {
+    "memory", memory_store_none, memory_store_load, memory_store_store, memory_store_batch,
+    memory_store_exists, memory_store_none, memory_store_iterate, store_close_none
+};
+
+// Backends selectable with --balance-store
+static const BalanceStore *const balance_stores[] = {&file_balance_store, &mmap_balance_store, &memory_balance_store};
+
+// The backend balances are loaded from and stored to
+const BalanceStore *balance_store = &file_balance_store;
+
+// Set once startup recovery has made every stored balance resident; from
+// then on an account that is not resident does not exist
+int stored_balances_resident = 0;
+
+// Function to register one stored account (startup only)
+static Account* register_stored_account(const char *account_id) {
+    return get_account(account_id);
+}
+
+// One startup recovery thread: the part of the store it lists, then the
+// range of accounts it loads
+typedef struct {
+    pthread_t thread;
+    int part;
+    int parts;
+    int status;
+    int first;
+    int end;
+} RecoveryScan;
+
+// Function to register the stored accounts of one part of the store
+static void* recovery_list(void *arg) {
+    RecoveryScan *scan = arg;
+    scan->status = balance_store->iterate(scan->part, scan->parts, register_stored_account);
+    return NULL;
+}
+
+// Function to make the stored balances of one range of accounts resident
+static void* recovery_scan(void *arg) {
+    RecoveryScan *scan = arg;
+    for(int i = scan->first; i < scan->end; i++) {
+        Account *account = account_at(i);
+        Money balance;
+        uint64_t start = probe_begin();
+        int status = balance_store->load(account, &balance);
+        probe_end(PROBE_BALANCE_LOAD, start);
+        if(status == 0) {
+            atomic_store_explicit(&account->balance, balance, memory_order_relaxed);
+            atomic_store_explicit(&account->balance_loaded, 1, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+// Function to run one recovery step on every scan, the first on this thread
+// once the others are running
+static void recovery_run(RecoveryScan scans[], int thread_count, void* (*step)(void *)) {
+    int started = 1;
+    for(; started < thread_count; started++) {
+        if(pthread_create(&scans[started].thread, NULL, step, &scans[started]) != 0) {
+            break;
+        }
+    }
+    step(&scans[0]);
+    // Scans whose thread could not be started are run here as well
+    for(int i = started; i < thread_count; i++) {
+        step(&scans[i]);
+    }
+    for(int i = 1; i < started; i++) {
+        pthread_join(scans[i].thread, NULL);
+    }
+}
+
+// Function to open the selected balance store and recover every account it
+// holds, one thread per core: each thread lists and indexes its part of the
+// stored accounts, then the balances are loaded, one range of accounts per
+// thread. Afterwards the resident balances are authoritative, so lookups
+// of unknown accounts no longer touch the store. Runs before WAL recovery,
+// with no other thread touching the accounts.
+int balance_store_open() {
+    Timestamp start = timestamp_now();
+    if(balance_store->open() != 0) {
+        return -1;
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = worker_count > 0 ? worker_count : (cores > 0 ? (int)cores : 1);
+    RecoveryScan scans[thread_count];
+    for(int i = 0; i < thread_count; i++) {
+        scans[i].part = i;
+        scans[i].parts = thread_count;
+    }
+    recovery_run(scans, thread_count, recovery_list);
+    for(int i = 0; i < thread_count; i++) {
+        if(scans[i].status != 0) {
+            return -1;
+        }
+    }
+    int count = atomic_load(&account_count);
+    int loaders = (count + RECOVERY_ACCOUNTS_PER_THREAD - 1) / RECOVERY_ACCOUNTS_PER_THREAD;
+    if(loaders > thread_count) {
+        loaders = thread_count;
+    } else if(loaders < 1) {
+        loaders = 1;
+    }
+    for(int i = 0; i < loaders; i++) {
+        scans[i].first = (int)((long)count * i / loaders);
+        scans[i].end = (int)((long)count * (i + 1) / loaders);
+    }
+    recovery_run(scans, loaders, recovery_scan);
+    stored_balances_resident = 1;
+    printf("Recovered %d accounts from the %s balance store in %.3f s using %d threads.\n",
+           count, balance_store->name, (double)(timestamp_now() - start) / 1e6, thread_count);
+    return 0;
+}
+
+// Function to make an account's balance resident (caller holds account->lock)
+int load_balance(Account *account) {
+    if(atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+        return 0;
+    }
+    if(stored_balances_resident) {
+        report_result(&(OperationResult){.event = RESULT_ACCOUNT_NOT_FOUND, .account_id = account_name(account)});
+        return -1;
+    }
+    Money balance;
+    uint64_t start = probe_begin();
+    int status = balance_store->load(account, &balance);
+    probe_end(PROBE_BALANCE_LOAD, start);
+    if(status != 0) {
+        return -1;
+    }
+    atomic_store_explicit(&account->balance, balance, memory_order_relaxed);
+    atomic_store_explicit(&account->balance_loaded, 1, memory_order_release);
+    return 0;
+}
+
+// Function to make an account's balance resident, taking account->lock only
+// for the first load
+int ensure_balance_loaded(Account *account) {
+    if(atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+        return 0;
+    }
+    probed_lock(&account->lock, PROBE_ACCOUNT_LOCK);
+    int status = load_balance(account);
+    pthread_mutex_unlock(&account->lock);
+    return status;
+}
+
+// Function to start a write to an account's balance; concurrent versioned
+// reads retry until it ends
+static inline void balance_write_begin(Account *account) {
+    atomic_fetch_add(&account->version, 1);
+}
+
+// Function to end a write started with balance_write_begin()
+static inline void balance_write_end(Account *account) {
+    atomic_fetch_add(&account->version, (UINT64_C(1) << BALANCE_VERSION_SHIFT) - 1);
+}
+
+// Function to read a resident balance without locking. The read is retried
+// while a write is in progress or if one finished meanwhile, so it never sees
+// a delta that is later undone or half of a create.
+static Money read_balance_versioned(Account *account) {
+    for(int spins = 0;; spins++) {
+        uint64_t before = atomic_load_explicit(&account->version, memory_order_acquire);
+        if((before & BALANCE_WRITERS_MASK) == 0) {
+            Money balance = atomic_load_explicit(&account->balance, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if(atomic_load_explicit(&account->version, memory_order_relaxed) == before) {
+                return balance;
+            }
+        }
+        if(spins >= BALANCE_READ_SPINS) {
+            sched_yield();
+        }
+    }
+}
+
+// Function to queue an account for the balance flusher. Must follow the
+// balance update it covers: the flusher clears the flag before reading the
+// balance, so an update it might miss always re-queues the account.
+static void mark_balance_dirty(Account *account) {
+    if(atomic_exchange(&account->dirty, 1)) {
+        return;
+    }
+    AccountInfo *info = account_info(account);
+    info->next_dirty = atomic_load_explicit(&dirty_accounts, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&dirty_accounts, &info->next_dirty, account,
+                                                 memory_order_release, memory_order_relaxed)) {
+    }
+}
+
+// Function to write the balances of a list of dirty accounts, taken off
+// dirty_accounts, back to the balance store in batches of BALANCE_FLUSH_BATCH
+static int flush_balances(Account *account) {
+    int status = 0;
+    Account *batch[BALANCE_FLUSH_BATCH];
+    Money balances[BALANCE_FLUSH_BATCH];
+    int count = 0;
+    while(account != NULL || count > 0) {
+        if(account != NULL && count < BALANCE_FLUSH_BATCH) {
+            // Read the link first: once the flag is cleared the account may be re-queued
+            Account *next = account_info(account)->next_dirty;
+            atomic_store(&account->dirty, 0);
+            batch[count] = account;
+            balances[count] = read_balance_versioned(account);
+            count++;
+            account = next;
+            continue;
+        }
+        uint64_t start = probe_begin();
+        int stored = balance_store->store_batch(batch, balances, count);
+        probe_end(PROBE_BALANCE_STORE, start);
+        for(int i = stored; i < count; i++) {
+            // Keep the account queued so the next flush retries it
+            mark_balance_dirty(batch[i]);
+            status = -1;
+        }
+        count = 0;
+    }
+    return status;
+}
+
+// Function to write every dirty balance back to the balance store
+static int flush_dirty_balances() {
+    return flush_balances(atomic_exchange_explicit(&dirty_accounts, NULL, memory_order_acquire));
+}
+
+// Table for crc32(), filled on first use
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+// Function to fill the CRC-32 lookup table
+static void crc32_build_table() {
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc32_table[i] = c;
+    }
+}
+
+// Function to extend a CRC-32 (IEEE) over a buffer
+static uint32_t crc32(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32_table_once, crc32_build_table);
+    const unsigned char *p = data;
+    crc = ~crc;
+    while(length--) {
+        crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Function to write a whole buffer to a file descriptor
+static int write_fully(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while(length > 0) {
+        ssize_t written = write(fd, p, length);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// Function to get the file path of the WAL segment whose first record is start_lsn
+static void get_wal_segment_path(uint64_t start_lsn, char *filepath) {
+    sprintf(filepath, "%s/" WAL_SEGMENT_PREFIX "%016llx.log", ACCOUNTS_DIR, (unsigned long long)start_lsn);
+}
+
+// Function to open a fresh WAL segment and make it current (caller holds wal.lock)
+static int wal_open_segment(uint64_t start_lsn) {
+    char filepath[100];
+    get_wal_segment_path(start_lsn, filepath);
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if(fd < 0) {
+        printf("Error opening WAL segment %s.\n", filepath);
+        return -1;
+    }
+    wal.fd = fd;
+    wal.segment_start = start_lsn;
+    wal.segment_bytes = 0;
+    wal.ring_offset = 0;
+    return 0;
+}
+
+// Function to unmap and close an io_uring
+static void io_ring_close(IoRing *ring) {
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if(ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if(ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Function to set up an io_uring with room for entries submissions, through
+// the raw system calls; returns -1 if the kernel does not offer one
+static int io_ring_open(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        return -1;
+    }
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single_map && ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        io_ring_close(ring);
+        return -1;
+    }
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (_Atomic unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return 0;
+}
+
+// Function to queue one request on the ring without submitting it yet and
+// return its entry for the caller to fill in. The caller keeps track of how
+// many are queued; at most ring->entries may be outstanding.
+static struct io_uring_sqe* io_ring_queue(IoRing *ring, uint8_t opcode, int fd, uint64_t user_data) {
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    return sqe;
+}
+
+// Function to submit whatever the kernel has not taken yet and reap count
+// completions, storing each result at results[user_data]. Returns -1 if the
+// ring itself fails.
+static int io_ring_complete(IoRing *ring, int count, int results[]) {
+    int reaped = 0;
+    for(;;) {
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        while(head != atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            reaped++;
+            head++;
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+        if(reaped >= count) {
+            return 0;
+        }
+        unsigned unsubmitted = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) -
+                               atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if(syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+           errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Function to write length bytes at offset (-1 for the file position, which
+// O_APPEND keeps at the end) through the ring, and with sync set to sync the
+// file's data as a linked fdatasync. A short write cancels the linked sync,
+// so the rest is resubmitted with a new one. Returns 0 once written.
+static int io_ring_write(IoRing *ring, int fd, const char *data, size_t length, off_t offset, int sync) {
+    while(length > 0) {
+        struct io_uring_sqe *write_sqe = io_ring_queue(ring, IORING_OP_WRITE, fd, 0);
+        write_sqe->flags = sync ? IOSQE_IO_LINK : 0;
+        write_sqe->addr = (uint64_t)(uintptr_t)data;
+        write_sqe->len = length > (1u << 30) ? (1u << 30) : (unsigned)length;
+        write_sqe->off = (uint64_t)offset;
+        if(sync) {
+            io_ring_queue(ring, IORING_OP_FSYNC, fd, 1)->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+        int results[2] = {0, 0};
+        if(io_ring_complete(ring, sync ? 2 : 1, results) != 0 || results[0] <= 0) {
+            return -1;
+        }
+        data += results[0];
+        length -= (size_t)results[0];
+        if(offset >= 0) {
+            offset += results[0];
+        }
+        if(length == 0 && sync && results[1] < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to store several balances, one account file each, through
+// balance_ring: the temporary files of up to a ring's worth of accounts are
+// written with one submission, then renamed in order. Returns how many were
+// stored before a failure, or -1 if the ring is not open.
+static int file_store_batch_ring(Account *accounts[], const Money balances[], int count) {
+    pthread_mutex_lock(&balance_ring_lock);
+    if(balance_ring.fd < 0) {
+        pthread_mutex_unlock(&balance_ring_lock);
+        return -1;
+    }
+    int stored = 0;
+    int failed = 0;
+    while(!failed && stored < count) {
+        int chunk = count - stored < (int)balance_ring.entries ? count - stored : (int)balance_ring.entries;
+        int fds[chunk];
+        int lengths[chunk];
+        int results[chunk];
+        char texts[chunk][24];
+        char filepath[100];
+        char temp_filepath[150];
+        int queued = 0;
+        for(; queued < chunk; queued++) {
+            const char *account_id = account_name(accounts[stored + queued]);
+            get_account_filepath(account_id, filepath);
+            sprintf(temp_filepath, "%s.tmp", filepath);
+            fds[queued] = open(temp_filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if(fds[queued] < 0) {
+                printf("Error opening temporary file for account %s.\n", account_id);
+                failed = 1;
+                break;
+            }
+            lengths[queued] = sprintf(texts[queued], "%" PRId64 "\n", balances[stored + queued]);
+            struct io_uring_sqe *sqe = io_ring_queue(&balance_ring, IORING_OP_WRITE, fds[queued], (uint64_t)queued);
+            sqe->addr = (uint64_t)(uintptr_t)texts[queued];
+            sqe->len = (unsigned)lengths[queued];
+        }
+        if(queued > 0 && io_ring_complete(&balance_ring, queued, results) != 0) {
+            // Completions may still be outstanding, so later batches go without the ring
+            printf("Error writing account files through io_uring.\n");
+            io_ring_close(&balance_ring);
+            failed = 1;
+            for(int i = 0; i < queued; i++) {
+                results[i] = -1;
+            }
+        }
+        int first = stored;
+        for(int i = 0; i < queued; i++) {
+            const char *account_id = account_name(accounts[first + i]);
+            get_account_filepath(account_id, filepath);
+            sprintf(temp_filepath, "%s.tmp", filepath);
+            close(fds[i]);
+            if(stored < first + i) {
+                // An earlier account was not stored; only a prefix may be
+                unlink(temp_filepath);
+            } else if(results[i] != lengths[i]) {
+                printf("Error writing temporary file for account %s.\n", account_id);
+                unlink(temp_filepath);
+                failed = 1;
+            } else if(rename(temp_filepath, filepath) != 0) {
+                printf("Error replacing file for account %s.\n", account_id);
+                unlink(temp_filepath);
+                failed = 1;
+            } else {
+                stored++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&balance_ring_lock);
+    return stored;
+}
+
+// Function to give each record in records its LSN and checksum, in order,
+// and return the last LSN (caller holds wal.lock)
+static uint64_t wal_number_records(char *records, size_t length) {
+    for(size_t offset = 0; offset < length;) {
+        WalRecordHeader *header = (WalRecordHeader*)(records + offset);
+        size_t record_length = sizeof(WalRecordHeader) + (size_t)header->entry_count * sizeof(WalEntry);
+        header->lsn = wal.next_lsn++;
+        header->checksum = 0;
+        header->checksum = crc32(0, header, record_length);
+        offset += record_length;
+    }
+    return wal.next_lsn - 1;
+}
+
+// Function to stage records for the ring thread and assign their LSNs,
+// storing the last in *lsn (caller holds wal.lock). Waits while they do not
+// fit next to the records already staged and the ring thread has not taken
+// them yet.
+static int wal_stage_records(char *records, size_t length, uint64_t *lsn) {
+    while(!wal.ring_failed && wal.staged_bytes > 0 &&
+          wal.staged_bytes + length > wal.staging_capacity[wal.filling]) {
+        pthread_cond_wait(&wal.ring_room, &wal.lock);
+    }
+    if(wal.ring_failed) {
+        return -1;
+    }
+    if(length > wal.staging_capacity[wal.filling]) {
+        char *grown = realloc(wal.staging[wal.filling], length);
+        if(grown == NULL) {
+            return -1;
+        }
+        wal.staging[wal.filling] = grown;
+        wal.staging_capacity[wal.filling] = length;
+    }
+    *lsn = wal_number_records(records, length);
+    memcpy(wal.staging[wal.filling] + wal.staged_bytes, records, length);
+    wal.staged_bytes += length;
+    wal.segment_bytes += (off_t)length;
+    if(!wal.ring_busy) {
+        pthread_cond_signal(&wal.ring_wakeup);
+    }
+    return 0;
+}
+
+// Thread function that makes staged WAL records durable under
+// --wal-io=uring: it takes the filled buffer, writes and syncs it through
+// the ring while appenders fill the other one, then wakes whoever waits for
+// those LSNs. Nothing is written under wal.lock or any account lock.
+static void* wal_ring_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wal.lock);
+    for(;;) {
+        while(wal.staged_bytes == 0 && !wal.ring_stop) {
+            pthread_cond_wait(&wal.ring_wakeup, &wal.lock);
+        }
+        if(wal.staged_bytes == 0) {
+            break;
+        }
+        const char *batch = wal.staging[wal.filling];
+        size_t length = wal.staged_bytes;
+        uint64_t last_lsn = wal.next_lsn - 1;
+        off_t offset = wal.ring_offset;
+        int fd = wal.fd;
+        int failed = wal.ring_failed;
+        wal.filling ^= 1;
+        wal.staged_bytes = 0;
+        wal.ring_offset += (off_t)length;
+        wal.ring_busy = 1;
+        pthread_cond_broadcast(&wal.ring_room);
+        pthread_mutex_unlock(&wal.lock);
+
+        int status = -1;
+        if(!failed) {
+            uint64_t sync_start = probe_begin();
+            status = io_ring_write(&wal.ring, fd, batch, length, offset, 1);
+            probe_end(PROBE_WAL_SYNC, sync_start);
+        }
+
+        pthread_mutex_lock(&wal.lock);
+        wal.ring_busy = 0;
+        if(status == 0) {
+            wal.synced_lsn = last_lsn;
+        } else if(!wal.ring_failed) {
+            // Cut off the torn batch; later records are never acknowledged
+            printf("Error writing the write-ahead log.\n");
+            wal.ring_failed = 1;
+            if(ftruncate(fd, offset) != 0) {
+                printf("Error truncating the write-ahead log.\n");
+            }
+        }
+        pthread_cond_broadcast(&wal.synced);
+        pthread_cond_broadcast(&wal.ring_room);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return NULL;
+}
+
+// Function to set up the ring, its staging buffers and the ring thread
+static int wal_ring_start() {
+    for(int i = 0; i < 2; i++) {
+        wal.staging[i] = malloc(WAL_RING_BUFFER_BYTES);
+        wal.staging_capacity[i] = WAL_RING_BUFFER_BYTES;
+        if(wal.staging[i] == NULL) {
+            printf("Error allocating the write-ahead log staging buffers.\n");
+            return -1;
+        }
+    }
+    wal.filling = 0;
+    wal.staged_bytes = 0;
+    wal.ring_busy = 0;
+    wal.ring_failed = 0;
+    wal.ring_stop = 0;
+    if(io_ring_open(&wal.ring, 4) != 0) {
+        printf("io_uring is not available for the write-ahead log.\n");
+        return -1;
+    }
+    if(pthread_create(&wal.ring_thread, NULL, wal_ring_thread, NULL) != 0) {
+        printf("Error starting the write-ahead log ring thread.\n");
+        io_ring_close(&wal.ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to let the ring thread write out what is staged and stop it
+static void wal_ring_stop() {
+    if(wal.ring.fd >= 0) {
+        pthread_mutex_lock(&wal.lock);
+        wal.ring_stop = 1;
+        pthread_cond_signal(&wal.ring_wakeup);
+        pthread_mutex_unlock(&wal.lock);
+        pthread_join(wal.ring_thread, NULL);
+        io_ring_close(&wal.ring);
+    }
+    for(int i = 0; i < 2; i++) {
+        free(wal.staging[i]);
+        wal.staging[i] = NULL;
+        wal.staging_capacity[i] = 0;
+    }
+}
+
+// Function to append a shard's buffered records to the WAL in one write
+// (or one staging copy under --wal-io=uring), numbering them in order, and
+// empty the buffer. If the write fails it is cut off, as in wal_append(),
+// and the records are lost; their updates stand, as under periodic
+// durability a record may always be lost before it is synced.
+static int wal_append_buffered(WalBuffer *buffer) {
+    if(buffer->used == 0) {
+        return 0;
+    }
+    probed_lock(&wal.lock, PROBE_WAL_LOCK);
+    int status;
+    if(wal_io_mode == WAL_IO_URING) {
+        uint64_t lsn;
+        status = wal_stage_records(buffer->data, buffer->used, &lsn);
+    } else {
+        uint64_t first_lsn = wal.next_lsn;
+        wal_number_records(buffer->data, buffer->used);
+        status = write_fully(wal.fd, buffer->data, buffer->used);
+        if(status == 0) {
+            wal.segment_bytes += (off_t)buffer->used;
+        } else {
+            wal.next_lsn = first_lsn;
+            printf("Error appending to the write-ahead log.\n");
+            if(ftruncate(wal.fd, wal.segment_bytes) != 0) {
+                printf("Error truncating the write-ahead log.\n");
+            }
+        }
+    }
+    pthread_mutex_unlock(&wal.lock);
+    buffer->used = 0;
+    return status == 0 ? 0 : -1;
+}
+
+// Function to append one record to the WAL. All entries of the record become
+// durable together, so a transfer's debit and credit can never be split by a
+// crash. Under write-through the record is synced before returning; otherwise
+// wal_sync() (group commit) or the flusher (periodic) makes it durable. With
+// --wal-io=uring it is only staged, and await_commit() waits for the ring.
+// On a shard under periodic durability it only goes into the shard's WAL
+// buffer, and *lsn is 0.
+int wal_append(const WalEntry *entries, int entry_count, uint64_t *lsn) {
+    size_t length = sizeof(WalRecordHeader) + (size_t)entry_count * sizeof(WalEntry);
+    char stack_buffer[sizeof(WalRecordHeader) + 2 * sizeof(WalEntry)];
+    char *buffer = length <= sizeof(stack_buffer) ? stack_buffer : malloc(length);
+    if(buffer == NULL) {
+        return -1;
+    }
+    WalRecordHeader *header = (WalRecordHeader*)buffer;
+    memset(header, 0, sizeof(*header));
+    header->magic = WAL_RECORD_MAGIC;
+    header->entry_count = (uint32_t)entry_count;
+    memcpy(buffer + sizeof(WalRecordHeader), entries, (size_t)entry_count * sizeof(WalEntry));
+    
+    if(shard_wal_buffer != NULL && length <= shard_wal_buffer->capacity) {
+        // Buffered for the shard's next batch; nothing waits for it
+        int status = 0;
+        if(shard_wal_buffer->used + length > shard_wal_buffer->capacity) {
+            status = wal_append_buffered(shard_wal_buffer);
+        }
+        if(status == 0) {
+            memcpy(shard_wal_buffer->data + shard_wal_buffer->used, buffer, length);
+            shard_wal_buffer->used += length;
+            *lsn = 0;
+        }
+        if(buffer != stack_buffer) {
+            free(buffer);
+        }
+        return status;
+    }
+    probed_lock(&wal.lock, PROBE_WAL_LOCK);
+    if(wal_io_mode == WAL_IO_URING) {
+        int status = wal_stage_records(buffer, length, lsn);
+        pthread_mutex_unlock(&wal.lock);
+        if(buffer != stack_buffer) {
+            free(buffer);
+        }
+        return status;
+    }
+    header->lsn = wal.next_lsn;
+    header->checksum = crc32(0, buffer, length);
+    int status = write_fully(wal.fd, buffer, length);
+    if(status == 0 && durability_policy == DURABILITY_WRITE_THROUGH) {
+        uint64_t sync_start = probe_begin();
+        status = fdatasync(wal.fd);
+        probe_end(PROBE_WAL_SYNC, sync_start);
+    }
+    if(status == 0) {
+        *lsn = wal.next_lsn++;
+        wal.segment_bytes += (off_t)length;
+        if(durability_policy == DURABILITY_WRITE_THROUGH) {
+            wal.synced_lsn = *lsn;
+        }
+    } else {
+        // Cut off a torn record so replay does not stop short of later ones
+        printf("Error appending to the write-ahead log.\n");
+        if(ftruncate(wal.fd, wal.segment_bytes) != 0) {
+            printf("Error truncating the write-ahead log.\n");
+        }
+    }
+    pthread_mutex_unlock(&wal.lock);
+    
+    if(buffer != stack_buffer) {
+        free(buffer);
+    }
+    return status == 0 ? 0 : -1;
+}
+
+// Function to wait until the WAL is durable up to lsn. The first waiter to
+// find no sync in progress syncs on behalf of everyone behind it; with
+// --wal-io=uring the ring thread syncs every batch and waiters only wait.
+int wal_sync(uint64_t lsn) {
+    int status = 0;
+    pthread_mutex_lock(&wal.lock);
+    if(wal_io_mode == WAL_IO_URING) {
+        while(wal.synced_lsn < lsn && !wal.ring_failed) {
+            pthread_cond_wait(&wal.synced, &wal.lock);
+        }
+        status = wal.synced_lsn >= lsn ? 0 : -1;
+        pthread_mutex_unlock(&wal.lock);
+        return status;
+    }
+    while(wal.synced_lsn < lsn) {
+        if(wal.syncing) {
+            pthread_cond_wait(&wal.synced, &wal.lock);
+            continue;
+        }
+        wal.syncing = 1;
+        uint64_t target = wal.next_lsn - 1;
+        int fd = wal.fd;
+        pthread_mutex_unlock(&wal.lock);
+        uint64_t sync_start = probe_begin();
+        status = fdatasync(fd);
+        probe_end(PROBE_WAL_SYNC, sync_start);
+        pthread_mutex_lock(&wal.lock);
+        wal.syncing = 0;
+        if(status == 0 && wal.synced_lsn < target) {
+            wal.synced_lsn = target;
+        }
+        pthread_cond_broadcast(&wal.synced);
+        if(status != 0) {
+            printf("Error syncing the write-ahead log.\n");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return status == 0 ? 0 : -1;
+}
+
+// Function to write a checkpoint snapshot of every account the WAL has touched.
+// Only called while no commit can run (during a cut, or single-threaded
+// startup/shutdown).
+static int write_checkpoint_snapshot(uint64_t lsn) {
+    char filepath[100];
+    char temp_filepath[150];
+    sprintf(filepath, "%s/%s", ACCOUNTS_DIR, CHECKPOINT_FILE);
+    sprintf(temp_filepath, "%s.tmp", filepath);
+    
+    FILE *file = fopen(temp_filepath, "wb");
+    if(file == NULL) {
+        printf("Error opening checkpoint file.\n");
+        return -1;
+    }
+    CheckpointHeader header = {CHECKPOINT_MAGIC, 0, lsn, 0};
+    int count = atomic_load(&account_count);
+    for(int i = 0; i < count; i++) {
+        header.entry_count += account_info(account_at(i))->wal_touched;
+    }
+    uint32_t crc = crc32(0, &header, sizeof(header));
+    fwrite(&header, sizeof(header), 1, file);
+    for(int i = 0; i < count; i++) {
+        Account *account = account_at(i);
+        AccountInfo *info = account_info(account);
+        if(!info->wal_touched) {
+            continue;
+        }
+        CheckpointEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        strcpy(entry.account_id, info->account_id);
+        entry.balance = account->balance;
+        crc = crc32(crc, &entry, sizeof(entry));
+        fwrite(&entry, sizeof(entry), 1, file);
+    }
+    fwrite(&crc, sizeof(crc), 1, file);
+    int status = (fflush(file) == 0 && fsync(fileno(file)) == 0) ? 0 : -1;
+    fclose(file);
+    if(status != 0 || rename(temp_filepath, filepath) != 0) {
+        printf("Error writing checkpoint file.\n");
+        unlink(temp_filepath);
+        return -1;
+    }
+    return sync_accounts_dir();
+}
+
+// Function to list WAL segments in replay order; returns the count or -1
+static int list_wal_segments(uint64_t **starts) {
+    DIR *dir = opendir(ACCOUNTS_DIR);
+    if(dir == NULL) {
+        return -1;
+    }
+    int count = 0, capacity = 0;
+    *starts = NULL;
+    struct dirent *dirent;
+    while((dirent = readdir(dir)) != NULL) {
+        unsigned long long start;
+        char suffix[8];
+        if(sscanf(dirent->d_name, WAL_SEGMENT_PREFIX "%16llx%7s", &start, suffix) != 2 || strcmp(suffix, ".log") != 0) {
+            continue;
+        }
+        if(count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            uint64_t *grown = realloc(*starts, capacity * sizeof(uint64_t));
+            if(grown == NULL) {
+                break;
+            }
+            *starts = grown;
+        }
+        (*starts)[count++] = start;
+    }
+    closedir(dir);
+    // Insertion sort; there are only a handful of segments between checkpoints
+    for(int i = 1; i < count; i++) {
+        uint64_t start = (*starts)[i];
+        int j = i;
+        for(; j > 0 && (*starts)[j-1] > start; j--) {
+            (*starts)[j] = (*starts)[j-1];
+        }
+        (*starts)[j] = start;
+    }
+    return count;
+}
+
+// Function to delete WAL segments that start before lsn
+static void remove_wal_segments_before(uint64_t lsn) {
+    uint64_t *starts;
+    int count = list_wal_segments(&starts);
+    for(int i = 0; i < count; i++) {
+        if(starts[i] < lsn) {
+            char filepath[100];
+            get_wal_segment_path(starts[i], filepath);
+            unlink(filepath);
+        }
+    }
+    free(starts);
+}
+
+// Defined with the sharded engine below
+static void shards_quiesce(struct WorkerPool *pool);
+static void shards_resume(struct WorkerPool *pool);
+
+// Function to pick a cut: stop the shards between operations, if the
+// sharded engine is running, then take checkpoint_lock for writing, so no
+// update is half applied until cut_end()
+static void cut_begin() {
+    pthread_mutex_lock(&cut_lock);
+    if(sharded_engine != NULL) {
+        shards_quiesce(sharded_engine);
+    }
+    pthread_rwlock_wrlock(&checkpoint_lock);
+}
+
+// Function to let updates run again after cut_begin()
+static void cut_end() {
+    pthread_rwlock_unlock(&checkpoint_lock);
+    if(sharded_engine != NULL) {
+        shards_resume(sharded_engine);
+    }
+    pthread_mutex_unlock(&cut_lock);
+}
+
+// Function to hold off cuts while an update runs. Shards skip the lock, as
+// a cut only ever stops them between operations.
+static inline void cut_hold() {
+    if(!on_shard_thread) {
+        pthread_rwlock_rdlock(&checkpoint_lock);
+    }
+}
+
+// Function to allow cuts again after cut_hold()
+static inline void cut_release() {
+    if(!on_shard_thread) {
+        pthread_rwlock_unlock(&checkpoint_lock);
+    }
+}
+
+// Function to checkpoint the WAL: switch to a new segment at a quiet point,
+// snapshot the touched balances as of that point, drop the segments the
+// snapshot covers, then write the balances dirty at that point back to their
+// account files. Only those are in the snapshot; an account first changed
+// after it must keep its stored balance until the next checkpoint, or
+// recovery would replay the change on top of it.
+int wal_checkpoint() {
+    cut_begin();
+    pthread_mutex_lock(&wal.lock);
+    uint64_t lsn = wal.next_lsn - 1;
+    int status;
+    if(wal_io_mode == WAL_IO_URING) {
+        // No append can run; let the ring thread write out what is staged
+        while(wal.synced_lsn < lsn && !wal.ring_failed) {
+            pthread_cond_wait(&wal.synced, &wal.lock);
+        }
+        status = wal.ring_failed ? -1 : 0;
+    } else {
+        while(wal.syncing) {
+            pthread_cond_wait(&wal.synced, &wal.lock);
+        }
+        status = fdatasync(wal.fd);
+    }
+    if(status == 0) {
+        wal.synced_lsn = lsn;
+        close(wal.fd);
+        status = wal_open_segment(lsn + 1);
+    }
+    pthread_mutex_unlock(&wal.lock);
+    if(status == 0) {
+        status = write_checkpoint_snapshot(lsn);
+    }
+    Account *dirty = NULL;
+    if(status == 0) {
+        dirty = atomic_exchange_explicit(&dirty_accounts, NULL, memory_order_acquire);
+    }
+    cut_end();
+    if(status != 0) {
+        printf("WAL checkpoint failed.\n");
+        return -1;
+    }
+    remove_wal_segments_before(lsn + 1);
+    flush_balances(dirty);
+    return 0;
+}
+
+// Function to apply one recovered WAL record to the resident balances
+static void wal_replay_record(const WalEntry *entries, uint32_t entry_count) {
+    for(uint32_t i = 0; i < entry_count; i++) {
+        Account *account = get_account(entries[i].account_id);
+        if(account == NULL) {
+            continue;
+        }
+        if(!account->balance_loaded) {
+            // Accounts missing from the snapshot start from their stored
+            // balance, or from zero when the WAL holds their creation
+            if(stored_balances_resident || !balance_store->exists(account) || load_balance(account) != 0) {
+                account->balance = 0;
+                account->balance_loaded = 1;
+            }
+        }
+        account->balance += entries[i].delta;
+        account_info(account)->wal_touched = 1;
+        mark_balance_dirty(account);
+    }
+}
+
+// Function to fold the resident balances (current up to lsn) into the account
+// files and remove the snapshot and WAL segments. The full snapshot is written
+// first, so a crash while rewriting the account files is recovered from it
+// instead of replaying the WAL on top of already updated files.
+static int wal_fold(uint64_t lsn) {
+    if(write_checkpoint_snapshot(lsn) != 0 || flush_dirty_balances() != 0 || balance_store->sync() != 0) {
+        printf("Error folding the write-ahead log into the account files.\n");
+        return -1;
+    }
+    remove_wal_segments_before(UINT64_MAX);
+    char filepath[100];
+    sprintf(filepath, "%s/%s", ACCOUNTS_DIR, CHECKPOINT_FILE);
+    unlink(filepath);
+    return 0;
+}
+
+// Function to rebuild balances from the checkpoint snapshot and WAL segments
+// left by a previous run, fold them into the account files and remove them.
+// Runs single-threaded before any operation starts.
+int wal_recover() {
+    char filepath[100];
+    uint64_t snapshot_lsn = 0;
+    uint64_t last_lsn = 0;
+    long records = 0;
+    int have_snapshot = 0;
+    
+    sprintf(filepath, "%s/%s", ACCOUNTS_DIR, CHECKPOINT_FILE);
+    FILE *file = fopen(filepath, "rb");
+    if(file != NULL) {
+        CheckpointHeader header;
+        if(fread(&header, sizeof(header), 1, file) == 1 && header.magic == CHECKPOINT_MAGIC) {
+            uint32_t crc = crc32(0, &header, sizeof(header));
+            CheckpointEntry *entries = malloc((header.entry_count + 1) * sizeof(CheckpointEntry));
+            uint32_t stored_crc;
+            if(entries != NULL &&
+               fread(entries, sizeof(CheckpointEntry), header.entry_count, file) == header.entry_count &&
+               fread(&stored_crc, sizeof(stored_crc), 1, file) == 1 &&
+               crc32(crc, entries, header.entry_count * sizeof(CheckpointEntry)) == stored_crc) {
+                for(uint32_t i = 0; i < header.entry_count; i++) {
+                    Account *account = get_account(entries[i].account_id);
+                    if(account != NULL) {
+                        account->balance = entries[i].balance;
+                        account->balance_loaded = 1;
+                        account_info(account)->wal_touched = 1;
+                        mark_balance_dirty(account);
+                    }
+                }
+                snapshot_lsn = last_lsn = header.lsn;
+                have_snapshot = 1;
+            } else {
+                printf("Checkpoint file is corrupt; ignoring it.\n");
+            }
+            free(entries);
+        }
+        fclose(file);
+    }
+    
+    uint64_t *starts;
+    int segment_count = list_wal_segments(&starts);
+    for(int s = 0; s < segment_count; s++) {
+        get_wal_segment_path(starts[s], filepath);
+        file = fopen(filepath, "rb");
+        if(file == NULL) {
+            continue;
+        }
+        WalRecordHeader header;
+        while(fread(&header, sizeof(header), 1, file) == 1) {
+            if(header.magic != WAL_RECORD_MAGIC || header.entry_count == 0 || header.entry_count > WAL_MAX_RECORD_ENTRIES) {
+                break;
+            }
+            size_t length = sizeof(header) + header.entry_count * sizeof(WalEntry);
+            char *buffer = malloc(length);
+            if(buffer == NULL) {
+                break;
+            }
+            memcpy(buffer, &header, sizeof(header));
+            uint32_t stored_crc = header.checksum;
+            ((WalRecordHeader*)buffer)->checksum = 0;
+            if(fread(buffer + sizeof(header), sizeof(WalEntry), header.entry_count, file) != header.entry_count ||
+               crc32(0, buffer, length) != stored_crc) {
+                // Torn tail from a crash mid-append: nothing after it was acknowledged
+                free(buffer);
+                break;
+            }
+            if(header.lsn > snapshot_lsn) {
+                wal_replay_record((const WalEntry*)(buffer + sizeof(header)), header.entry_count);
+                records++;
+            }
+            if(header.lsn > last_lsn) {
+                last_lsn = header.lsn;
+            }
+            free(buffer);
+        }
+        fclose(file);
+    }
+    free(starts);
+    
+    if(!have_snapshot && segment_count <= 0) {
+        return 0;
+    }
+    if(wal_fold(last_lsn) != 0) {
+        return -1;
+    }
+    printf("Recovered %ld write-ahead log records.\n", records);
+    return 0;
+}
+
+// Function to start logging balance updates to a new WAL
+int wal_open() {
+    if(!wal_enabled) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal.lock);
+    wal.next_lsn = 1;
+    wal.synced_lsn = 0;
+    int status = wal_open_segment(1);
+    pthread_mutex_unlock(&wal.lock);
+    if(status == 0 && wal_io_mode == WAL_IO_URING) {
+        status = wal_ring_start();
+    }
+    return status;
+}
+
+// Function to shut the WAL down cleanly, leaving only the account files behind
+void wal_close() {
+    if(!wal_enabled || wal.fd < 0) {
+        return;
+    }
+    if(wal_io_mode == WAL_IO_URING) {
+        wal_ring_stop();
+    }
+    fdatasync(wal.fd);
+    close(wal.fd);
+    wal.fd = -1;
+    wal_fold(wal.next_lsn - 1);
+}
+
+// Function to tell whether single-account updates must hold account->lock.
+// Only the legacy per-file write-through path needs it, to keep concurrent
+// rewrites of one account file in order.
+static int updates_need_account_lock() {
+    return !wal_enabled && durability_policy == DURABILITY_WRITE_THROUGH;
+}
+
+// Function to tell whether another update is between applying its delta to
+// an account and committing or undoing it (caller is writing the account)
+static inline int balance_has_other_writers(Account *account) {
+    return (atomic_load(&account->version) & BALANCE_WRITERS_MASK) > 1;
+}
+
+// Function to add delta to a resident balance, as part of update_balances()
+// (between balance_write_begin() and balance_write_end()). The delta stays
+// pending in AccountInfo until update_balances() settles it, since the
+// update may still be undone: a debit must not spend credits that are
+// pending, and a credit must leave room to undo pending debits. Debits use
+// a CAS loop so the balance never goes below the pending credits; credits
+// are a single fetch-add, taken back if it went past MONEY_MAX (atomics
+// wrap, and a debit racing with that window only sees a balance too low to
+// debit). Returns the new balance in *new_balance, or
+// BALANCE_INSUFFICIENT_FUNDS or BALANCE_OVERFLOW.
+static int apply_balance_delta(Account *account, Money delta, Money *new_balance) {
+    AccountInfo *info = account_info(account);
+    if(delta >= 0) {
+        atomic_fetch_add(&info->pending_credit, delta);
+        Money balance = atomic_fetch_add(&account->balance, delta);
+        Money headroom;
+        if(money_add(balance, delta, new_balance) != 0 ||
+           (balance_has_other_writers(account) && money_add(*new_balance, atomic_load(&info->pending_debit), &headroom) != 0)) {
+            atomic_fetch_sub(&account->balance, delta);
+            atomic_fetch_sub(&info->pending_credit, delta);
+            *new_balance = balance;
+            return BALANCE_OVERFLOW;
+        }
+        return 0;
+    }
+    atomic_fetch_sub(&info->pending_debit, delta);
+    Money balance = atomic_load(&account->balance);
+    Money debited, spendable;
+    do {
+        Money pending = balance_has_other_writers(account) ? atomic_load(&info->pending_credit) : 0;
+        if(money_add(balance, delta, &debited) != 0 || __builtin_sub_overflow(debited, pending, &spendable) || spendable < 0) {
+            atomic_fetch_add(&info->pending_debit, delta);
+            *new_balance = balance;
+            return BALANCE_INSUFFICIENT_FUNDS;
+        }
+    } while(!atomic_compare_exchange_weak(&account->balance, &balance, debited));
+    *new_balance = debited;
+    return 0;
+}
+
+// Function to drop a delta applied by apply_balance_delta() from the
+// account's pending amounts, once it is committed or undone
+static inline void balance_settle(Account *account, Money delta) {
+    AccountInfo *info = account_info(account);
+    if(delta >= 0) {
+        atomic_fetch_sub(&info->pending_credit, delta);
+    } else {
+        atomic_fetch_add(&info->pending_debit, delta);
+    }
+}
+
+// Function to add a committed net change to the book total (caller is
+// inside cut_hold())
+static void book_total_add(Money delta) {
+    static _Atomic int next_stripe = 0;
+    static __thread int stripe = -1;
+    if(stripe < 0) {
+        stripe = atomic_fetch_add(&next_stripe, 1) % BOOK_TOTAL_STRIPES;
+    }
+    atomic_fetch_add_explicit(&book_total_stripes[stripe].value, (uint64_t)delta, memory_order_relaxed);
+}
+
+// Function to read the book total: exact during a cut, otherwise as of some
+// moment while it ran. Costs the same for any book size.
+Money book_total() {
+    uint64_t total = 0;
+    for(int i = 0; i < BOOK_TOTAL_STRIPES; i++) {
+        total += atomic_load_explicit(&book_total_stripes[i].value, memory_order_relaxed);
+    }
+    return (Money)total;
+}
+
+// Function to start the book total from the recovered balances. Runs
+// single-threaded after recovery, before any operation starts.
+void book_total_open() {
+    uint64_t total = 0;
+    int count = atomic_load(&account_count);
+    for(int i = 0; i < count; i++) {
+        Account *account = account_at(i);
+        if(atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+            total += (uint64_t)atomic_load(&account->balance);
+        }
+    }
+    for(int i = 0; i < BOOK_TOTAL_STRIPES; i++) {
+        atomic_store(&book_total_stripes[i].value, 0);
+    }
+    atomic_store(&book_total_stripes[0].value, total);
+}
+
+// Function to queue a changed account for the next central log report
+// (caller is inside cut_hold()). Only the first change since
+// the last report stores, so the shared AccountInfo line stays clean.
+static void mark_report_dirty(Account *account) {
+    AccountInfo *info = account_info(account);
+    if(atomic_load_explicit(&info->report_dirty, memory_order_relaxed) || atomic_exchange(&info->report_dirty, 1)) {
+        return;
+    }
+    info->next_report_dirty = atomic_load_explicit(&report_dirty_accounts, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&report_dirty_accounts, &info->next_report_dirty, account,
+                                                 memory_order_release, memory_order_relaxed)) {
+    }
+}
+
+// Function to take every account changed since the last report and clear
+// their marks (caller is in a cut, so the set is as of that cut). Returns the list, linked through next_report_dirty.
+static Account* take_report_dirty() {
+    Account *changed = atomic_exchange(&report_dirty_accounts, NULL);
+    for(Account *account = changed; account != NULL; account = account_info(account)->next_report_dirty) {
+        atomic_store_explicit(&account_info(account)->report_dirty, 0, memory_order_relaxed);
+    }
+    return changed;
+}
+
+// Function to record an account's balance as of the snapshot's cut, before
+// anything changes it. Callers are inside cut_hold() (which keeps the
+// snapshot alive) or own the snapshot. An update after the cut always
+// preserves first, so a balance read here is still as of the cut whenever the
+// compare-and-swap that stores it succeeds. Readers pass versioned to wait
+// out writes in progress (see read_balance_versioned()); writers must not,
+// as they may be inside a write to the account themselves.
+static void snapshot_preserve(BalanceSnapshot *snapshot, Account *account, int versioned) {
+    if(account->number >= snapshot->count) {
+        return;
+    }
+    _Atomic int64_t *slot = &snapshot->balances[account->number];
+    int64_t expected = SNAPSHOT_UNCAPTURED;
+    if(atomic_load_explicit(slot, memory_order_acquire) != expected) {
+        return;
+    }
+    int64_t balance = SNAPSHOT_MISSING;
+    if(atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+        balance = versioned ? read_balance_versioned(account) : atomic_load(&account->balance);
+    }
+    atomic_compare_exchange_strong(slot, &expected, balance);
+}
+
+// Function to start a snapshot of every balance for a full report. Holds a
+// cut only long enough to publish it; returns NULL
+// if out of memory.
+static BalanceSnapshot* snapshot_begin() {
+    cut_begin();
+    int count = atomic_load(&account_count);
+    BalanceSnapshot *snapshot = malloc(sizeof(BalanceSnapshot) + (size_t)count * sizeof(_Atomic int64_t));
+    if(snapshot != NULL) {
+        snapshot->count = count;
+        snapshot->total = book_total();
+        // The report covers every account as of the cut; later changes mark them again
+        take_report_dirty();
+        for(int i = 0; i < count; i++) {
+            atomic_init(&snapshot->balances[i], SNAPSHOT_UNCAPTURED);
+        }
+        atomic_store_explicit(&active_snapshot, snapshot, memory_order_release);
+    }
+    cut_end();
+    return snapshot;
+}
+
+// Function to retire a snapshot once every slot has been captured
+static void snapshot_end(BalanceSnapshot *snapshot) {
+    cut_begin();
+    atomic_store_explicit(&active_snapshot, NULL, memory_order_release);
+    cut_end();
+    free(snapshot);
+}
+
+// Function to apply deltas to resident balances (which must be loaded) and
+// persist them according to the durability policy. A debit that would
+// overdraw its account undoes the whole update and returns
+// BALANCE_INSUFFICIENT_FUNDS, a credit past MONEY_MAX returns
+// BALANCE_OVERFLOW, and a persistence failure undoes it and returns -1.
+// With the WAL all deltas go into one record; without it each file is
+// rewritten (write-through, with account locks held by the caller, see
+// updates_need_account_lock()) or queued for the flusher. On success the
+// resulting balances are stored in new_balances (if not NULL) and *ticket
+// must be passed to await_commit() once any locks are released.
+int update_balances(Account *accounts[], const Money deltas[], int count, Money new_balances[], uint64_t *ticket) {
+    Money stack_balances[2];
+    Money *balances = count <= 2 ? stack_balances : malloc(count * sizeof(Money));
+    if(balances == NULL) {
+        return -1;
+    }
+    *ticket = 0;
+    cut_hold();
+    BalanceSnapshot *snapshot = atomic_load_explicit(&active_snapshot, memory_order_acquire);
+    int status = 0;
+    int applied = 0;
+    for(; applied < count; applied++) {
+        if(snapshot != NULL) {
+            snapshot_preserve(snapshot, accounts[applied], 0);
+        }
+        balance_write_begin(accounts[applied]);
+        status = apply_balance_delta(accounts[applied], deltas[applied], &balances[applied]);
+        if(status != 0) {
+            balance_write_end(accounts[applied]);
+            break;
+        }
+    }
+    if(status == 0) {
+        if(wal_enabled) {
+            WalEntry stack_entries[2];
+            WalEntry *entries = count <= 2 ? stack_entries : malloc(count * sizeof(WalEntry));
+            if(entries == NULL) {
+                status = -1;
+            } else {
+                memset(entries, 0, count * sizeof(WalEntry));
+                for(int i = 0; i < count; i++) {
+                    strcpy(entries[i].account_id, account_name(accounts[i]));
+                    entries[i].delta = deltas[i];
+                }
+                status = wal_append(entries, count, ticket);
+                if(entries != stack_entries) {
+                    free(entries);
+                }
+            }
+        } else if(durability_policy == DURABILITY_WRITE_THROUGH) {
+            uint64_t start = probe_begin();
+            int stored = balance_store->store_batch(accounts, balances, count);
+            probe_end(PROBE_BALANCE_STORE, start);
+            if(stored < count) {
+                // Rollback in case of failure
+                for(int j = 0; j < stored; j++) {
+                    balance_store->store(accounts[j], balances[j] - deltas[j]);
+                }
+                status = -1;
+            }
+        }
+    }
+    if(status != 0) {
+        // Undo the deltas applied so far. No other update can have spent a
+        // credit taken back here, or be stopped by a debit given back here,
+        // since both were still pending (see apply_balance_delta()).
+        for(int i = 0; i < applied; i++) {
+            atomic_fetch_sub(&accounts[i]->balance, deltas[i]);
+            balance_settle(accounts[i], deltas[i]);
+            balance_write_end(accounts[i]);
+        }
+    } else {
+        Money net = 0;
+        for(int i = 0; i < count; i++) {
+            // Only the first change stores, so the shared AccountInfo line stays clean
+            AccountInfo *info = account_info(accounts[i]);
+            if(wal_enabled && !atomic_load_explicit(&info->wal_touched, memory_order_relaxed)) {
+                atomic_store_explicit(&info->wal_touched, 1, memory_order_relaxed);
+            }
+            if(wal_enabled || durability_policy != DURABILITY_WRITE_THROUGH) {
+                mark_balance_dirty(accounts[i]);
+            }
+            if(new_balances != NULL) {
+                new_balances[i] = balances[i];
+            }
+            mark_report_dirty(accounts[i]);
+            net = (Money)((uint64_t)net + (uint64_t)deltas[i]);
+            balance_settle(accounts[i], deltas[i]);
+            balance_write_end(accounts[i]);
+        }
+        if(net != 0) {
+            book_total_add(net);
+        }
+        if(!wal_enabled && durability_policy != DURABILITY_WRITE_THROUGH) {
+            *ticket = atomic_load(&balance_flush_started) + 1;
+        }
+    }
+    cut_release();
+    if((status == BALANCE_INSUFFICIENT_FUNDS || status == BALANCE_OVERFLOW) && new_balances != NULL) {
+        // Report the balance that was too low or too high
+        new_balances[applied] = balances[applied];
+    }
+    if(balances != stack_balances) {
+        free(balances);
+    }
+    return status;
+}
+
+// A batch kernel: adds deltas[i] to balances[i] in order while the result
+// stays within 0..MONEY_MAX and returns how many it added (count if all)
+typedef struct {
+    const char *name;
+    size_t (*apply)(Money balances[], const Money deltas[], size_t count);
+} MoneyBatchKernel;
+
+// Function to add deltas from first on, one at a time, up to the first one
+// that would leave its balance below zero or past MONEY_MAX
+static size_t money_batch_apply_from(Money balances[], const Money deltas[], size_t first, size_t count) {
+    for(size_t i = first; i < count; i++) {
+        Money sum;
+        if(money_add(balances[i], deltas[i], &sum) != 0 || sum < 0) {
+            return i;
+        }
+        balances[i] = sum;
+    }
+    return count;
+}
+
+// Function to run the batch kernel without vector instructions
+static size_t money_batch_apply_scalar(Money balances[], const Money deltas[], size_t count) {
+    return money_batch_apply_from(balances, deltas, 0, count);
+}
+
+// The vector kernels add a block of balances at once. A lane is bad if the
+// add overflowed (both operands' signs differ from the sum's) or the sum is
+// negative, so the sign bits of ((b ^ s) & (d ^ s)) | s flag the whole block;
+// a flagged block is finished one delta at a time to find the bad one.
+#if defined(__x86_64__)
+// Function to run the batch kernel four deltas at a time with AVX2
+__attribute__((target("avx2")))
+static size_t money_batch_apply_avx2(Money balances[], const Money deltas[], size_t count) {
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(balances + i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(deltas + i));
+        __m256i s = _mm256_add_epi64(b, d);
+        __m256i bad = _mm256_or_si256(_mm256_and_si256(_mm256_xor_si256(b, s), _mm256_xor_si256(d, s)), s);
+        if(_mm256_movemask_pd(_mm256_castsi256_pd(bad)) != 0) {
+            return money_batch_apply_from(balances, deltas, i, count);
+        }
+        _mm256_storeu_si256((__m256i*)(balances + i), s);
+    }
+    return money_batch_apply_from(balances, deltas, i, count);
+}
+#elif defined(__aarch64__)
+// Function to run the batch kernel two deltas at a time with NEON
+static size_t money_batch_apply_neon(Money balances[], const Money deltas[], size_t count) {
+    size_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        int64x2_t b = vld1q_s64(balances + i);
+        int64x2_t d = vld1q_s64(deltas + i);
+        int64x2_t s = vaddq_s64(b, d);
+        int64x2_t bad = vorrq_s64(vandq_s64(veorq_s64(b, s), veorq_s64(d, s)), s);
+        if((vgetq_lane_s64(bad, 0) | vgetq_lane_s64(bad, 1)) < 0) {
+            return money_batch_apply_from(balances, deltas, i, count);
+        }
+        vst1q_s64(balances + i, s);
+    }
+    return money_batch_apply_from(balances, deltas, i, count);
+}
+#endif
+
+// Function to pick the fastest batch kernel this CPU can run
+static MoneyBatchKernel money_batch_kernel() {
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("avx2")) {
+        return (MoneyBatchKernel){"avx2", money_batch_apply_avx2};
+    }
+#elif defined(__aarch64__)
+    return (MoneyBatchKernel){"neon", money_batch_apply_neon};
+#endif
+    return (MoneyBatchKernel){"scalar", money_batch_apply_scalar};
+}
+
+// Function to apply a run of deltas (interest, fees) to a contiguous array
+// of balances as one unit: either every balance stays within 0..MONEY_MAX
+// and all deltas are added, or none is. Returns 0, or
+// BALANCE_INSUFFICIENT_FUNDS or BALANCE_OVERFLOW for the first delta that
+// fails, whose index is stored in *failed if that is not NULL.
+int money_apply_batch(Money balances[], const Money deltas[], size_t count, size_t *failed) {
+    size_t applied = money_batch_kernel().apply(balances, deltas, count);
+    if(applied == count) {
+        return 0;
+    }
+    // Take back what was added before the failing delta
+    for(size_t i = 0; i < applied; i++) {
+        balances[i] -= deltas[i];
+    }
+    if(failed != NULL) {
+        *failed = applied;
+    }
+    return deltas[applied] >= 0 ? BALANCE_OVERFLOW : BALANCE_INSUFFICIENT_FUNDS;
+}
+
+// Thread function that runs deferred durability work: flushing dirty
+// balances, or with the WAL syncing it (periodic) and checkpointing it
+// once the current segment grows past wal_checkpoint_bytes
+static void* balance_flusher(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&balance_flush_lock);
+    while(!balance_flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)flush_interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        // Group commit flushes as soon as someone waits; periodic flushes on the timer
+        while(!balance_flusher_stop && balance_flush_wanted <= balance_flush_completed &&
+              pthread_cond_timedwait(&balance_flush_request, &balance_flush_lock, &deadline) == 0) {
+        }
+        uint64_t generation = atomic_fetch_add(&balance_flush_started, 1) + 1;
+        pthread_mutex_unlock(&balance_flush_lock);
+        int status;
+        if(wal_enabled) {
+            pthread_mutex_lock(&wal.lock);
+            uint64_t lsn = wal.next_lsn - 1;
+            off_t segment_bytes = wal.segment_bytes;
+            pthread_mutex_unlock(&wal.lock);
+            status = wal_sync(lsn);
+            if(status == 0 && segment_bytes >= wal_checkpoint_bytes) {
+                status = wal_checkpoint();
+            }
+        } else {
+            status = flush_dirty_balances();
+        }
+        pthread_mutex_lock(&balance_flush_lock);
+        if(status != 0) {
+            balance_flush_failed = generation;
+        }
+        balance_flush_completed = generation;
+        pthread_cond_broadcast(&balance_flush_done);
+    }
+    pthread_mutex_unlock(&balance_flush_lock);
+    return NULL;
+}
+
+// Function to wait until the flush named by ticket has finished
+int await_balance_flush(uint64_t ticket) {
+    pthread_mutex_lock(&balance_flush_lock);
+    if(balance_flush_wanted < ticket) {
+        balance_flush_wanted = ticket;
+        pthread_cond_signal(&balance_flush_request);
+    }
+    while(balance_flush_completed < ticket) {
+        pthread_cond_wait(&balance_flush_done, &balance_flush_lock);
+    }
+    int status = balance_flush_failed >= ticket ? -1 : 0;
+    pthread_mutex_unlock(&balance_flush_lock);
+    return status;
+}
+
+// Function to wait until a commit is as durable as the policy promises
+int await_commit(uint64_t ticket) {
+    if(ticket == 0) {
+        return 0;
+    }
+    if(wal_enabled && wal_io_mode == WAL_IO_URING) {
+        // Write-through and group commit both acknowledge once the ring has synced the record
+        return durability_policy == DURABILITY_PERIODIC ? 0 : wal_sync(ticket);
+    }
+    if(durability_policy != DURABILITY_GROUP_COMMIT) {
+        return 0;
+    }
+    return wal_enabled ? wal_sync(ticket) : await_balance_flush(ticket);
+}
+
+// Function to start the flusher thread when the durability settings need one
+int start_balance_flusher() {
+    if(durability_policy == DURABILITY_WRITE_THROUGH && !wal_enabled) {
+        return 0;
+    }
+    balance_flusher_stop = 0;
+    if(pthread_create(&balance_flusher_thread, NULL, balance_flusher, NULL) != 0) {
+        printf("Error starting balance flusher.\n");
+        return -1;
+    }
+    balance_flusher_running = 1;
+    return 0;
+}
+
+// Function to stop the flusher thread and write back whatever is still dirty
+void stop_balance_flusher() {
+    if(balance_flusher_running) {
+        pthread_mutex_lock(&balance_flush_lock);
+        balance_flusher_stop = 1;
+        pthread_cond_signal(&balance_flush_request);
+        pthread_mutex_unlock(&balance_flush_lock);
+        pthread_join(balance_flusher_thread, NULL);
+        balance_flusher_running = 0;
+    }
+    if(!wal_enabled) {
+        flush_dirty_balances();
+    }
+}
+
+// Function to move a full or expired log file aside and start a new one
+// (caller holds writer->io_lock)
+static int log_writer_rotate(LogWriter *writer) {
+    char timestamp[20];
+    char rotated_path[160];
+    struct tm t;
+    time_t now = time(NULL);
+    localtime_r(&now, &t);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", &t);
+    sprintf(rotated_path, "%s.%s-%d", writer->path, timestamp, ++writer->rotations);
+    
+    // Appends through the old descriptor land in the renamed file until the swap below
+    if(rename(writer->path, rotated_path) != 0) {
+        printf("Error rotating log file %s.\n", writer->path);
+        return -1;
+    }
+    int fd = open(writer->path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if(fd < 0) {
+        printf("Error opening log file %s.\n", writer->path);
+        return -1;
+    }
+    close(writer->fd);
+    writer->fd = fd;
+    writer->size = 0;
+    writer->opened_at = now;
+    return 0;
+}
+
+// Function to write data to the log file, rotating it first when it has
+// outgrown its size or age limit (caller holds writer->io_lock)
+static int log_writer_write(LogWriter *writer, const char *data, size_t length) {
+    if(writer->size > 0 &&
+       ((writer->rotate_bytes > 0 && writer->size + (off_t)length > writer->rotate_bytes) ||
+        (writer->rotate_seconds > 0 && time(NULL) - writer->opened_at >= writer->rotate_seconds))) {
+        log_writer_rotate(writer);
+    }
+    int status;
+    if(writer->ring.fd >= 0) {
+        status = io_ring_write(&writer->ring, writer->fd, data, length, -1, writer->fsync);
+    } else {
+        status = write_fully(writer->fd, data, length);
+        if(status == 0 && writer->fsync) {
+            status = fdatasync(writer->fd);
+        }
+    }
+    if(status != 0) {
+        printf("Error writing log file %s.\n", writer->path);
+        return -1;
+    }
+    writer->size += (off_t)length;
+    return 0;
+}
+
+// Thread function that drains a buffered log writer in batches: it waits for
+// batch_records records or max_wait_us after the first one, whichever comes
+// first, swaps buffers and writes the full one while callers keep appending
+static void* log_writer_thread(void *arg) {
+    LogWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for(;;) {
+        while(!writer->stop && writer->pending_records == 0) {
+            pthread_cond_wait(&writer->request, &writer->lock);
+        }
+        if(writer->pending_records == 0) {
+            break;
+        }
+        while(!writer->stop && writer->pending_records < writer->batch_records &&
+              pthread_cond_timedwait(&writer->request, &writer->lock, &writer->batch_deadline) == 0) {
+        }
+        char *batch = writer->active;
+        size_t length = writer->active_used;
+        uint64_t batch_end = writer->appended;
+        writer->active = writer->standby;
+        writer->standby = batch;
+        writer->active_used = 0;
+        writer->pending_records = 0;
+        pthread_cond_broadcast(&writer->space);
+        pthread_mutex_unlock(&writer->lock);
+        
+        pthread_mutex_lock(&writer->io_lock);
+        log_writer_write(writer, batch, length);
+        pthread_mutex_unlock(&writer->io_lock);
+        
+        pthread_mutex_lock(&writer->lock);
+        writer->durable = batch_end;
+        pthread_cond_broadcast(&writer->done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Function to start a log writer on an open descriptor, which it then owns
+// until log_writer_close(); in the buffered modes a writer thread owns the
+// I/O. path names it for rotation and messages.
+static int log_writer_attach(LogWriter *writer, int fd, const char *path, LogMode mode) {
+    snprintf(writer->path, sizeof(writer->path), "%s", path);
+    writer->fd = fd;
+    struct stat st;
+    writer->size = fstat(writer->fd, &st) == 0 ? st.st_size : 0;
+    writer->opened_at = time(NULL);
+    writer->mode = mode;
+    writer->active_used = 0;
+    writer->pending_records = 0;
+    writer->appended = writer->durable = 0;
+    writer->stop = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_mutex_init(&writer->io_lock, NULL);
+    pthread_cond_init(&writer->request, NULL);
+    pthread_cond_init(&writer->space, NULL);
+    pthread_cond_init(&writer->done, NULL);
+    writer->ring.fd = -1;
+    if(mode == LOG_DIRECT) {
+        return 0;
+    }
+    if(wal_io_mode == WAL_IO_URING && io_ring_open(&writer->ring, 2) != 0) {
+        printf("io_uring is not available for log file %s.\n", path);
+        close(writer->fd);
+        writer->fd = -1;
+        return -1;
+    }
+    writer->active = malloc(LOG_BUFFER_BYTES);
+    writer->standby = malloc(LOG_BUFFER_BYTES);
+    if(writer->active == NULL || writer->standby == NULL ||
+       pthread_create(&writer->thread, NULL, log_writer_thread, writer) != 0) {
+        printf("Error starting log writer for %s.\n", path);
+        if(writer->ring.fd >= 0) {
+            io_ring_close(&writer->ring);
+        }
+        free(writer->active);
+        free(writer->standby);
+        close(writer->fd);
+        writer->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to open a log writer on path. The file stays open until
+// log_writer_close().
+int log_writer_open(LogWriter *writer, const char *path, int truncate, LogMode mode) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0600);
+    if(fd < 0) {
+        printf("Error opening log file %s.\n", path);
+        return -1;
+    }
+    return log_writer_attach(writer, fd, path, mode);
+}
+
+// Function to append one record. Direct mode writes it immediately; buffered
+// mode queues it; group-commit mode queues it and, when wait is set, returns
+// once its batch is written (and synced, with fsync set). Blocks while the
+// buffer is full.
+static int log_writer_enqueue(LogWriter *writer, const char *data, size_t length, int wait) {
+    if(writer->mode == LOG_DIRECT) {
+        probed_lock(&writer->io_lock, PROBE_LOG_LOCK);
+        int status = log_writer_write(writer, data, length);
+        pthread_mutex_unlock(&writer->io_lock);
+        return status;
+    }
+    if(length > LOG_BUFFER_BYTES) {
+        return -1;
+    }
+    probed_lock(&writer->lock, PROBE_LOG_LOCK);
+    while(writer->active_used + length > LOG_BUFFER_BYTES) {
+        pthread_cond_wait(&writer->space, &writer->lock);
+    }
+    if(writer->pending_records == 0) {
+        clock_gettime(CLOCK_REALTIME, &writer->batch_deadline);
+        writer->batch_deadline.tv_nsec += (long)writer->max_wait_us * 1000L;
+        writer->batch_deadline.tv_sec += writer->batch_deadline.tv_nsec / 1000000000L;
+        writer->batch_deadline.tv_nsec %= 1000000000L;
+    }
+    memcpy(writer->active + writer->active_used, data, length);
+    writer->active_used += length;
+    uint64_t sequence = ++writer->appended;
+    if(++writer->pending_records == 1 || writer->pending_records >= writer->batch_records) {
+        pthread_cond_signal(&writer->request);
+    }
+    if(writer->mode == LOG_GROUP_COMMIT && wait) {
+        while(writer->durable < sequence) {
+            pthread_cond_wait(&writer->done, &writer->lock);
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+// Function to append one record, waiting for it under group commit
+int log_writer_append(LogWriter *writer, const char *data, size_t length) {
+    return log_writer_enqueue(writer, data, length, 1);
+}
+
+// Function to format and append one record
+int log_writer_printf(LogWriter *writer, const char *format, ...) {
+    char record[LOG_RECORD_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record, sizeof(record), format, args);
+    va_end(args);
+    if(length < 0) {
+        return -1;
+    }
+    if(length >= (int)sizeof(record)) {
+        length = sizeof(record) - 1;
+        record[length - 1] = '\n';
+    }
+    return log_writer_append(writer, record, (size_t)length);
+}
+
+// Function to drain a log writer and close its file
+void log_writer_close(LogWriter *writer) {
+    if(writer->fd < 0) {
+        return;
+    }
+    if(writer->mode != LOG_DIRECT) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stop = 1;
+        pthread_cond_signal(&writer->request);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+        free(writer->active);
+        free(writer->standby);
+        if(writer->ring.fd >= 0) {
+            io_ring_close(&writer->ring);
+        }
+    }
+    close(writer->fd);
+    writer->fd = -1;
+    pthread_mutex_destroy(&writer->lock);
+    pthread_mutex_destroy(&writer->io_lock);
+    pthread_cond_destroy(&writer->request);
+    pthread_cond_destroy(&writer->space);
+    pthread_cond_destroy(&writer->done);
+}
+
+// Function to open the asynchronous console writer. Results are then queued
+// as whole lines and printed in batches by its thread, so operations never
+// take the stdio lock; other output keeps going straight through stdio.
+int console_open() {
+    if(console_mode != CONSOLE_ASYNC) {
+        return 0;
+    }
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if(fd < 0) {
+        printf("Error opening the console writer.\n");
+        return -1;
+    }
+    console.batch_records = DEFAULT_LOG_BATCH_RECORDS;
+    console.max_wait_us = DEFAULT_LOG_MAX_WAIT_US;
+    return log_writer_attach(&console, fd, "console", LOG_BUFFERED);
+}
+
+// Function to print everything still queued for the console and stop its writer
+void console_close() {
+    log_writer_close(&console);
+}
+
+// Function to write one formatted line to the console
+static void console_write(const char *text, size_t length) {
+    if(console.fd >= 0) {
+        log_writer_enqueue(&console, text, length, 0);
+    } else {
+        fwrite(text, 1, length, stdout);
+    }
+}
+
+// Function to print narration that belongs with the operation results, in
+// order with them and silenced along with them
+void console_printf(const char *format, ...) {
+    if(console_mode == CONSOLE_OFF) {
+        return;
+    }
+    char text[LOG_RECORD_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if(length < 0) {
+        return;
+    }
+    console_write(text, length < (int)sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+// Function to render a result as the message the console has always shown
+static int format_result(const OperationResult *r, char *text, size_t size) {
+    switch(r->event) {
+    case RESULT_ACCOUNT_CREATED:
+        return snprintf(text, size, "Account %s created with initial balance %" PRId64 ".\n", r->account_id, r->amount);
+    case RESULT_ACCOUNT_EXISTS:
+        return snprintf(text, size, "Account %s already exists.\n", r->account_id);
+    case RESULT_CREATE_ERROR:
+        return snprintf(text, size, "Error creating account %s.\n", r->account_id);
+    case RESULT_ACCOUNT_LIMIT:
+        return snprintf(text, size, "Cannot create account %s: the limit of %d accounts is reached.\n",
+                        r->account_id, max_accounts);
+    case RESULT_CREATE_FAILED:
+        return snprintf(text, size, "Failed to create account %s.\n", r->account_id);
+    case RESULT_ACCOUNT_NOT_FOUND:
+        return snprintf(text, size, "Account %s does not exist.\n", r->account_id);
+    case RESULT_BALANCE_CORRUPT:
+        return snprintf(text, size, "Invalid balance format for account %s.\n", r->account_id);
+    case RESULT_READ_FAILED:
+        return snprintf(text, size, "Error reading balance for account %s.\n", r->account_id);
+    case RESULT_INVALID_AMOUNT:
+        return snprintf(text, size, "Invalid amount %" PRId64 " for account %s: amounts must be positive.\n", r->amount, r->account_id);
+    case RESULT_TRANSFERRED:
+        return snprintf(text, size, "Transferred %" PRId64 " from %s to %s.\n", r->amount, r->account_id, r->target_id);
+    case RESULT_TRANSFER_INSUFFICIENT:
+        return snprintf(text, size, "Transfer failed: Insufficient funds in account %s. Current balance: %" PRId64 "\n",
+                        r->account_id, r->balance);
+    case RESULT_TRANSFER_OVERFLOW:
+        return snprintf(text, size, "Transfer from %s to %s failed: Balance of account %s would exceed the limit.\n",
+                        r->account_id, r->target_id, r->target_id);
+    case RESULT_BATCH_INSUFFICIENT:
+        return snprintf(text, size, "Transfer failed: Insufficient funds in account %s.\n", r->account_id);
+    case RESULT_TRANSFER_FAILED:
+        return snprintf(text, size, "Transfer from %s to %s failed.\n", r->account_id, r->target_id);
+    case RESULT_TRANSFER_ROLLED_BACK:
+        return snprintf(text, size, "Transfer from %s to %s failed and has been rolled back.\n",
+                        r->account_id, r->target_id);
+    case RESULT_TRANSFER_TO_SELF:
+        return snprintf(text, size, "Cannot transfer to the same account.\n");
+    case RESULT_TRANSFER_READ_FAILED:
+        return snprintf(text, size, "Error reading account balances.\n");
+    case RESULT_TRANSFER_MISSING:
+        if(r->account_id == NULL) {
+            return snprintf(text, size, "One or both account handles (%u or %u) do not exist.\n",
+                            r->handle, r->target_handle);
+        }
+        return snprintf(text, size, "One or both accounts (%s or %s) do not exist.\n", r->account_id, r->target_id);
+    case RESULT_DEPOSITED:
+        return snprintf(text, size, "Deposited %" PRId64 " to account %s. New balance: %" PRId64 "\n", r->amount, r->account_id,
+                        r->balance);
+    case RESULT_DEPOSIT_FAILED:
+        return snprintf(text, size, "Failed to deposit %" PRId64 " to account %s.\n", r->amount, r->account_id);
+    case RESULT_DEPOSIT_OVERFLOW:
+        return snprintf(text, size, "Deposit failed: Depositing %" PRId64 " would take account %s past the balance limit.\n",
+                        r->amount, r->account_id);
+    case RESULT_DEPOSIT_MISSING:
+        if(r->account_id == NULL) {
+            return snprintf(text, size, "Deposit failed: Account handle %u does not exist.\n", r->handle);
+        }
+        return snprintf(text, size, "Deposit failed: Account %s does not exist.\n", r->account_id);
+    case RESULT_WITHDRAWN:
+        return snprintf(text, size, "Withdrew %" PRId64 " from account %s. New balance: %" PRId64 "\n", r->amount, r->account_id,
+                        r->balance);
+    case RESULT_WITHDRAW_INSUFFICIENT:
+        return snprintf(text, size, "Withdrawal failed: Insufficient funds in account %s. Current balance: %" PRId64 "\n",
+                        r->account_id, r->balance);
+    case RESULT_WITHDRAW_FAILED:
+        return snprintf(text, size, "Failed to withdraw %" PRId64 " from account %s.\n", r->amount, r->account_id);
+    case RESULT_WITHDRAW_MISSING:
+        if(r->account_id == NULL) {
+            return snprintf(text, size, "Withdrawal failed: Account handle %u does not exist.\n", r->handle);
+        }
+        return snprintf(text, size, "Withdrawal failed: Account %s does not exist.\n", r->account_id);
+    case RESULT_BALANCE:
+        return snprintf(text, size, "Account %s Balance: %" PRId64 "\n", r->account_id, r->balance);
+    case RESULT_VIEW_MISSING:
+        if(r->account_id == NULL) {
+            return snprintf(text, size, "View balance failed: Account handle %u does not exist.\n", r->handle);
+        }
+        return snprintf(text, size, "View balance failed: Account %s does not exist.\n", r->account_id);
+    }
+    return -1;
+}
+
+// Function to report an operation's outcome. The line is rendered here, in
+// the calling thread, so the result may point at caller-owned strings; only
+// the finished text reaches the console writer.
+void report_result(const OperationResult *result) {
+    if(console_mode == CONSOLE_OFF) {
+        return;
+    }
+    char text[LOG_RECORD_MAX];
+    int length = format_result(result, text, sizeof(text));
+    if(length < 0) {
+        return;
+    }
+    console_write(text, length < (int)sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+// Function to bind an account's number to its ID in the binary log. Called
+// when the account is created (or the log opened), so the binding always
+// precedes any record that uses the number. Does not wait for the batch:
+// the first record that does wait covers it.
+void log_account_name(const Account *account) {
+    if(log_format != LOG_FORMAT_BINARY || transaction_log.fd < 0) {
+        return;
+    }
+    const AccountInfo *info = account_info(account);
+    BinaryLogRecord records[1 + (sizeof(info->account_id) + sizeof(BinaryLogRecord) - 1) / sizeof(BinaryLogRecord)];
+    memset(records, 0, sizeof(records));
+    size_t length = strlen(info->account_id);
+    records[0].timestamp = timestamp_now();
+    records[0].account = (uint32_t)account->number;
+    records[0].amount = (int64_t)length;
+    records[0].opcode = LOG_OP_ACCOUNT_NAME;
+    memcpy(&records[1], info->account_id, length);
+    size_t blocks = (length + sizeof(BinaryLogRecord) - 1) / sizeof(BinaryLogRecord);
+    log_writer_enqueue(&transaction_log, (const char*)records, (1 + blocks) * sizeof(BinaryLogRecord), 0);
+}
+
+// Function to start a binary log session: a marker record, then the names
+// of every account that already exists
+static void log_session_start() {
+    if(log_format != LOG_FORMAT_BINARY) {
+        return;
+    }
+    BinaryLogRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp_now();
+    record.reserved = TXLOG_MAGIC;
+    record.amount = TXLOG_VERSION;
+    record.opcode = LOG_OP_SESSION;
+    log_writer_enqueue(&transaction_log, (const char*)&record, sizeof(record), 0);
+    pthread_mutex_lock(&global_lock);
+    for(int i = 0; i < account_count; i++) {
+        log_account_name(account_at(i));
+    }
+    pthread_mutex_unlock(&global_lock);
+}
+
+// Function to write one transaction log record for an account known by
+// ID and, in the binary format, by number (UINT32_MAX if it has none)
+static void log_transaction_record(LogOp op, const char *user_id, uint32_t number, Money amount, LogDetail detail, LogStatus status) {
+    if(transaction_log.fd < 0) {
+        printf("Error opening transaction log file.\n");
+        return;
+    }
+    Timestamp now = timestamp_now();
+    if(log_format == LOG_FORMAT_BINARY) {
+        BinaryLogRecord record;
+        memset(&record, 0, sizeof(record));
+        record.timestamp = now;
+        record.account = number;
+        record.amount = amount;
+        record.opcode = (uint16_t)op;
+        record.status = (uint8_t)status;
+        record.detail = (uint8_t)detail;
+        log_writer_append(&transaction_log, (const char*)&record, sizeof(record));
+        return;
+    }
+    char timestamp[TIMESTAMP_TEXT_SIZE];
+    format_timestamp(now, timestamp);
+    log_writer_printf(&transaction_log, "%s | %s | %s | %s | %s\n", timestamp, log_op_names[op], user_id,
+                      log_detail_names[detail], log_status_names[status]);
+}
+
+// Function to log transactions atomically
+void log_transaction_atomic(LogOp op, const char *user_id, Money amount, LogDetail detail, LogStatus status) {
+    uint32_t number = UINT32_MAX;
+    if(log_format == LOG_FORMAT_BINARY) {
+        Account *account = find_account(user_id);
+        if(account != NULL) {
+            number = (uint32_t)account->number;
+        }
+    }
+    log_transaction_record(op, user_id, number, amount, detail, status);
+}
+
+// Function to log a transaction for an already resolved account
+void log_account_transaction(LogOp op, const Account *account, Money amount, LogDetail detail, LogStatus status) {
+    log_transaction_record(op, account_name(account), (uint32_t)account->number, amount, detail, status);
+}
+
+// One transfer within a transfer_batch() call
+typedef struct {
+    const char *from_account_id;
+    const char *to_account_id;
+    Money amount;
+} TransferRequest;
+
+// Function to create a new account; returns its handle, or
+// INVALID_ACCOUNT_HANDLE if it could not be created
+AccountHandle create_account(const char *account_id, Money initial_balance) {
+    Account *account = add_account(account_id, max_accounts);
+    if(account == NULL) {
+        int limited = max_accounts > 0 && atomic_load(&account_count) >= max_accounts;
+        report_result(&(OperationResult){.event = limited ? RESULT_ACCOUNT_LIMIT : RESULT_CREATE_ERROR, .account_id = account_id});
+        log_transaction_atomic(LOG_OP_CREATE_ACCOUNT, account_id, initial_balance, LOG_DETAIL_INITIAL_BALANCE, LOG_STATUS_FAILED);
+        return INVALID_ACCOUNT_HANDLE;
+    }
+    
+    probed_lock(&account->lock, PROBE_ACCOUNT_LOCK);
+    
+    // Check if account is already resident or already stored
+    int exists = account->balance_loaded || (!stored_balances_resident && balance_store->exists(account));
+    if(exists) {
+        report_result(&(OperationResult){.event = RESULT_ACCOUNT_EXISTS, .account_id = account_id});
+        pthread_mutex_unlock(&account->lock);
+        log_account_transaction(LOG_OP_CREATE_ACCOUNT, account, initial_balance, LOG_DETAIL_INITIAL_BALANCE, LOG_STATUS_FAILED);
+        return INVALID_ACCOUNT_HANDLE;
+    }
+    
+    // Store initial balance; a snapshot in progress must still see the account as missing
+    cut_hold();
+    BalanceSnapshot *snapshot = atomic_load_explicit(&active_snapshot, memory_order_acquire);
+    if(snapshot != NULL) {
+        snapshot_preserve(snapshot, account, 0);
+    }
+    // Versioned reads wait until the initial balance is in
+    balance_write_begin(account);
+    atomic_store(&account->balance, 0);
+    atomic_store_explicit(&account->balance_loaded, 1, memory_order_release);
+    cut_release();
+    uint64_t ticket;
+    int status = update_balances(&account, &initial_balance, 1, NULL, &ticket);
+    if(status != 0) {
+        atomic_store(&account->balance_loaded, 0);
+    }
+    balance_write_end(account);
+    pthread_mutex_unlock(&account->lock);
+    if(status == 0) {
+        status = await_commit(ticket);
+    }
+    if(status == 0) {
+        report_result(&(OperationResult){.event = RESULT_ACCOUNT_CREATED, .account_id = account_id, .amount = initial_balance});
+        log_account_transaction(LOG_OP_CREATE_ACCOUNT, account, initial_balance, LOG_DETAIL_INITIAL_BALANCE, LOG_STATUS_SUCCESS);
+        return (AccountHandle)account->number;
+    }
+    report_result(&(OperationResult){.event = RESULT_CREATE_FAILED, .account_id = account_id});
+    log_account_transaction(LOG_OP_CREATE_ACCOUNT, account, initial_balance, LOG_DETAIL_INITIAL_BALANCE, LOG_STATUS_FAILED);
+    return INVALID_ACCOUNT_HANDLE;
+}
+
+// transfer_accounts() flags
+#define TRANSFER_LOCK_ACCOUNTS 1    // Hold both account locks around the update
+#define TRANSFER_LOG_RECEIPT 2      // Log the credit too, not only the debit
+
+// Function to wait for a transfer's update to commit and report the outcome.
+// Returns 0 once the transfer is committed.
+static int transfer_finish(Account *from_account, Account *to_account, Money amount, int flags,
+                           int status, uint64_t ticket, Money from_balance) {
+    const char *from_account_id = account_name(from_account);
+    const char *to_account_id = account_name(to_account);
+    if(status == BALANCE_INSUFFICIENT_FUNDS) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_INSUFFICIENT, .account_id = from_account_id, .balance = from_balance});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_INSUFFICIENT_FUNDS, LOG_STATUS_FAILED);
+        return status;
+    }
+    if(status == BALANCE_OVERFLOW) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_OVERFLOW, .account_id = from_account_id, .target_id = to_account_id});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_BALANCE_LIMIT, LOG_STATUS_FAILED);
+        return status;
+    }
+    if(status == 0) {
+        status = await_commit(ticket);
+    }
+    if(status == 0) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFERRED, .account_id = from_account_id, .target_id = to_account_id,
+                                           .amount = amount});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_TRANSFER_SUCCESSFUL, LOG_STATUS_SUCCESS);
+        if(flags & TRANSFER_LOG_RECEIPT) {
+            log_account_transaction(LOG_OP_TRANSFER, to_account, amount, LOG_DETAIL_TRANSFER_RECEIVED, LOG_STATUS_SUCCESS);
+        }
+    } else {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_ROLLED_BACK, .account_id = from_account_id, .target_id = to_account_id});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_TRANSFER_ROLLED_BACK, LOG_STATUS_FAILED);
+        log_account_transaction(LOG_OP_TRANSFER, to_account, amount, LOG_DETAIL_TRANSFER_ROLLED_BACK, LOG_STATUS_FAILED);
+    }
+    return status;
+}
+
+// Function to transfer funds atomically between two resolved accounts.
+// Without TRANSFER_LOCK_ACCOUNTS the caller must be the only thread that
+// debits from_account (see the sharded engine); the credit needs no lock.
+// Returns 0 once the transfer is committed.
+static int transfer_accounts(Account *from_account, Account *to_account, Money amount, int flags) {
+    if(amount <= 0) {
+        report_result(&(OperationResult){.event = RESULT_INVALID_AMOUNT, .account_id = account_name(from_account), .amount = amount});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_INVALID_AMOUNT, LOG_STATUS_FAILED);
+        return -1;
+    }
+    if(from_account == to_account) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_TO_SELF});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_TRANSFER_TO_SELF, LOG_STATUS_FAILED);
+        return -1;
+    }
+    
+    // Order accounts to prevent deadlock
+    Account *first_account, *second_account;
+    if(from_account->number < to_account->number) {
+        first_account = from_account;
+        second_account = to_account;
+    } else {
+        first_account = to_account;
+        second_account = from_account;
+    }
+    
+    // Lock both accounts in order
+    int locked = flags & TRANSFER_LOCK_ACCOUNTS;
+    int loaded;
+    if(locked) {
+        probed_lock(&first_account->lock, PROBE_ACCOUNT_LOCK);
+        probed_lock(&second_account->lock, PROBE_ACCOUNT_LOCK);
+        loaded = load_balance(from_account) == 0 && load_balance(to_account) == 0;
+    } else {
+        loaded = ensure_balance_loaded(from_account) == 0 && ensure_balance_loaded(to_account) == 0;
+    }
+    
+    if(!loaded) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_READ_FAILED});
+        log_account_transaction(LOG_OP_TRANSFER, from_account, amount, LOG_DETAIL_READING_BALANCES_FAILED, LOG_STATUS_FAILED);
+        if(locked) {
+            pthread_mutex_unlock(&second_account->lock);
+            pthread_mutex_unlock(&first_account->lock);
+        }
+        return -1;
+    }
+    
+    // Debit and credit as one update
+    Account *changed[2] = {from_account, to_account};
+    Money deltas[2] = {-amount, amount};
+    Money new_balances[2];
+    uint64_t ticket;
+    int status = update_balances(changed, deltas, 2, new_balances, &ticket);
+    
+    if(locked) {
+        pthread_mutex_unlock(&second_account->lock);
+        pthread_mutex_unlock(&first_account->lock);
+    }
+    
+    return transfer_finish(from_account, to_account, amount, flags, status, ticket, new_balances[0]);
+}
+
+// Function to transfer funds atomically
+void transfer(const char *from_account_id, const char *to_account_id, Money amount) {
+    if(strcmp(from_account_id, to_account_id) == 0) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_TO_SELF});
+        log_transaction_atomic(LOG_OP_TRANSFER, from_account_id, amount, LOG_DETAIL_TRANSFER_TO_SELF, LOG_STATUS_FAILED);
+        return;
+    }
+    
+    Account *from_account = find_account(from_account_id);
+    Account *to_account = find_account(to_account_id);
+    
+    if(from_account == NULL || to_account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_MISSING, .account_id = from_account_id, .target_id = to_account_id});
+        log_transaction_atomic(LOG_OP_TRANSFER, from_account_id, amount, LOG_DETAIL_ACCOUNTS_MISSING, LOG_STATUS_FAILED);
+        return;
+    }
+    uint64_t start = probe_begin();
+    transfer_accounts(from_account, to_account, amount, TRANSFER_LOCK_ACCOUNTS | TRANSFER_LOG_RECEIPT);
+    probe_end(PROBE_TRANSFER, start);
+}
+
+// Function to transfer funds atomically between two account handles
+void transfer_handle(AccountHandle from, AccountHandle to, Money amount) {
+    Account *from_account = account_from_handle(from);
+    Account *to_account = account_from_handle(to);
+    if(from_account == NULL || to_account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_TRANSFER_MISSING, .handle = from, .target_handle = to});
+        return;
+    }
+    uint64_t start = probe_begin();
+    transfer_accounts(from_account, to_account, amount, TRANSFER_LOCK_ACCOUNTS | TRANSFER_LOG_RECEIPT);
+    probe_end(PROBE_TRANSFER, start);
+}
+
+// Function to order accounts by their storage number, the lock order shared
+// by transfer() and transfer_batch()
+static int compare_account_numbers(const void *a, const void *b) {
+    const Account *left = *(Account* const*)a;
+    const Account *right = *(Account* const*)b;
+    return (left->number > right->number) - (left->number < right->number);
+}
+
+// Function to find an account's position in a number-sorted array
+static int find_locked_account(Account **locked, int count, const Account *account) {
+    int low = 0, high = count - 1;
+    while(low <= high) {
+        int middle = (low + high) / 2;
+        if(locked[middle]->number < account->number) {
+            low = middle + 1;
+        } else if(locked[middle]->number > account->number) {
+            high = middle - 1;
+        } else {
+            return middle;
+        }
+    }
+    return -1;
+}
+
+// Function to apply many transfers as one unit. Every distinct account is
+// locked once, in storage-number order, so concurrent batches and single
+// transfers cannot deadlock. Transfers are checked in the given order
+// against running balances; one that would overdraw its source fails on
+// its own while the rest go ahead, as does one that would take its target
+// past MONEY_MAX. The net change per account is then committed as a single
+// update (one WAL record, one sync). results[i] receives 0,
+// BALANCE_INSUFFICIENT_FUNDS, BALANCE_OVERFLOW or -1 for transfers[i]. Returns
+// the number of transfers applied, or -1 if the batch could not be set up.
+// A transfer of a non-positive amount is refused with -1.
+int transfer_batch(const TransferRequest transfers[], int count, int results[]) {
+    Account **from_accounts = malloc(count * sizeof(Account*));
+    Account **to_accounts = malloc(count * sizeof(Account*));
+    Account **locked = malloc(2 * count * sizeof(Account*));
+    Account **changed_accounts = malloc(2 * count * sizeof(Account*));
+    Money *start_balances = malloc(2 * count * sizeof(Money));
+    Money *running = malloc(2 * count * sizeof(Money));
+    Money *deltas = malloc(2 * count * sizeof(Money));
+    if(from_accounts == NULL || to_accounts == NULL || locked == NULL || changed_accounts == NULL ||
+       start_balances == NULL || running == NULL || deltas == NULL) {
+        printf("Error allocating transfer batch.\n");
+        free(from_accounts);
+        free(to_accounts);
+        free(locked);
+        free(changed_accounts);
+        free(start_balances);
+        free(running);
+        free(deltas);
+        return -1;
+    }
+    
+    // Resolve every account and collect the distinct ones
+    int locked_count = 0;
+    for(int i = 0; i < count; i++) {
+        results[i] = 0;
+        from_accounts[i] = to_accounts[i] = NULL;
+        if(transfers[i].amount <= 0 || strcmp(transfers[i].from_account_id, transfers[i].to_account_id) == 0) {
+            results[i] = -1;
+            continue;
+        }
+        from_accounts[i] = find_account(transfers[i].from_account_id);
+        to_accounts[i] = find_account(transfers[i].to_account_id);
+        if(from_accounts[i] == NULL || to_accounts[i] == NULL) {
+            results[i] = -1;
+            continue;
+        }
+        locked[locked_count++] = from_accounts[i];
+        locked[locked_count++] = to_accounts[i];
+    }
+    qsort(locked, locked_count, sizeof(Account*), compare_account_numbers);
+    int distinct = 0;
+    for(int i = 0; i < locked_count; i++) {
+        if(distinct == 0 || locked[distinct-1] != locked[i]) {
+            locked[distinct++] = locked[i];
+        }
+    }
+    locked_count = distinct;
+    
+    // Lock every account once, in order
+    for(int i = 0; i < locked_count; i++) {
+        probed_lock(&locked[i]->lock, PROBE_ACCOUNT_LOCK);
+    }
+    for(int i = 0; i < count; i++) {
+        if(results[i] == 0 && (load_balance(from_accounts[i]) != 0 || load_balance(to_accounts[i]) != 0)) {
+            results[i] = -1;
+        }
+    }
+    
+    // Plan against running balances, then commit the net deltas. Deposits and
+    // withdrawals do not take the account locks, so a concurrent withdrawal can
+    // still make a net debit fail (or a deposit a net credit overflow); plan
+    // again from fresh balances if it does.
+    int status;
+    uint64_t ticket = 0;
+    for(;;) {
+        for(int i = 0; i < locked_count; i++) {
+            start_balances[i] = running[i] = atomic_load(&locked[i]->balance);
+        }
+        for(int i = 0; i < count; i++) {
+            if(results[i] == -1) {
+                continue;
+            }
+            int from = find_locked_account(locked, locked_count, from_accounts[i]);
+            int to = find_locked_account(locked, locked_count, to_accounts[i]);
+            if(running[from] < transfers[i].amount) {
+                results[i] = BALANCE_INSUFFICIENT_FUNDS;
+                continue;
+            }
+            Money credited;
+            if(money_add(running[to], transfers[i].amount, &credited) != 0) {
+                results[i] = BALANCE_OVERFLOW;
+                continue;
+            }
+            running[from] -= transfers[i].amount;
+            running[to] = credited;
+            results[i] = 0;
+        }
+        // Every debit was checked against the running balance above, so no
+        // account can end up overdrawn
+        int changed_count = 0;
+        Money net = 0;
+        for(int i = 0; i < locked_count; i++) {
+            if(running[i] != start_balances[i]) {
+                changed_accounts[changed_count] = locked[i];
+                deltas[changed_count] = running[i] - start_balances[i];
+                net = (Money)((uint64_t)net + (uint64_t)deltas[changed_count]);
+                changed_count++;
+            }
+        }
+        // Transfers only move money, so the net deltas must cancel out
+        if(net != 0) {
+            printf("Transfer batch does not conserve money; refusing it.\n");
+            status = -1;
+            break;
+        }
+        status = changed_count == 0 ? 0 : update_balances(changed_accounts, deltas, changed_count, NULL, &ticket);
+        if(status != BALANCE_INSUFFICIENT_FUNDS && status != BALANCE_OVERFLOW) {
+            break;
+        }
+    }
+    
+    for(int i = locked_count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&locked[i]->lock);
+    }
+    if(status == 0) {
+        status = await_commit(ticket);
+    }
+    
+    int applied = 0;
+    for(int i = 0; i < count; i++) {
+        const TransferRequest *request = &transfers[i];
+        if(results[i] == 0 && status != 0) {
+            results[i] = -1;
+        }
+        if(results[i] == 0) {
+            applied++;
+            report_result(&(OperationResult){.event = RESULT_TRANSFERRED, .account_id = request->from_account_id,
+                                               .target_id = request->to_account_id, .amount = request->amount});
+            log_transaction_atomic(LOG_OP_TRANSFER, request->from_account_id, request->amount, LOG_DETAIL_TRANSFER_SUCCESSFUL, LOG_STATUS_SUCCESS);
+            log_transaction_atomic(LOG_OP_TRANSFER, request->to_account_id, request->amount, LOG_DETAIL_TRANSFER_RECEIVED, LOG_STATUS_SUCCESS);
+        } else if(results[i] == BALANCE_INSUFFICIENT_FUNDS) {
+            report_result(&(OperationResult){.event = RESULT_BATCH_INSUFFICIENT, .account_id = request->from_account_id});
+            log_transaction_atomic(LOG_OP_TRANSFER, request->from_account_id, request->amount, LOG_DETAIL_INSUFFICIENT_FUNDS, LOG_STATUS_FAILED);
+        } else if(results[i] == BALANCE_OVERFLOW) {
+            report_result(&(OperationResult){.event = RESULT_TRANSFER_OVERFLOW, .account_id = request->from_account_id,
+                                               .target_id = request->to_account_id});
+            log_transaction_atomic(LOG_OP_TRANSFER, request->from_account_id, request->amount, LOG_DETAIL_BALANCE_LIMIT, LOG_STATUS_FAILED);
+        } else if(request->amount <= 0) {
+            report_result(&(OperationResult){.event = RESULT_INVALID_AMOUNT, .account_id = request->from_account_id,
+                                               .amount = request->amount});
+            log_transaction_atomic(LOG_OP_TRANSFER, request->from_account_id, request->amount, LOG_DETAIL_INVALID_AMOUNT, LOG_STATUS_FAILED);
+        } else if(from_accounts[i] == NULL) {
+            report_result(&(OperationResult){.event = RESULT_TRANSFER_FAILED, .account_id = request->from_account_id,
+                                               .target_id = request->to_account_id});
+            log_transaction_atomic(LOG_OP_TRANSFER, request->from_account_id, request->amount,
+                                   strcmp(request->from_account_id, request->to_account_id) == 0 ? LOG_DETAIL_TRANSFER_TO_SELF : LOG_DETAIL_ACCOUNTS_MISSING,
+                                   LOG_STATUS_FAILED);
+        } else {
+            report_result(&(OperationResult){.event = RESULT_TRANSFER_ROLLED_BACK, .account_id = request->from_account_id,
+                                               .target_id = request->to_account_id});
+            log_transaction_atomic(LOG_OP_TRANSFER, request->from_account_id, request->amount, LOG_DETAIL_TRANSFER_ROLLED_BACK, LOG_STATUS_FAILED);
+        }
+    }
+    
+    free(from_accounts);
+    free(to_accounts);
+    free(locked);
+    free(changed_accounts);
+    free(start_balances);
+    free(running);
+    free(deltas);
+    return applied;
+}
+
+// Function to deposit funds into a resolved account. The balance is updated
+// with an atomic add; account->lock is only taken for the first load (and
+// in the legacy write-through file mode). Returns 0 once committed, with
+// the new balance in *balance_out if that is not NULL, or BALANCE_OVERFLOW.
+static int deposit_account(Account *account, Money amount, Money *balance_out) {
+    const char *account_id = account_name(account);
+    if(amount <= 0) {
+        report_result(&(OperationResult){.event = RESULT_INVALID_AMOUNT, .account_id = account_id, .amount = amount});
+        log_account_transaction(LOG_OP_DEPOSIT, account, amount, LOG_DETAIL_INVALID_AMOUNT, LOG_STATUS_FAILED);
+        return -1;
+    }
+    if(ensure_balance_loaded(account) != 0) {
+        report_result(&(OperationResult){.event = RESULT_READ_FAILED, .account_id = account_id});
+        log_account_transaction(LOG_OP_DEPOSIT, account, amount, LOG_DETAIL_READING_BALANCE_FAILED, LOG_STATUS_FAILED);
+        return -1;
+    }
+    
+    int locked = updates_need_account_lock();
+    if(locked) {
+        probed_lock(&account->lock, PROBE_ACCOUNT_LOCK);
+    }
+    Money new_balance;
+    uint64_t ticket;
+    int status = update_balances(&account, &amount, 1, &new_balance, &ticket);
+    if(locked) {
+        pthread_mutex_unlock(&account->lock);
+    }
+    if(status == BALANCE_OVERFLOW) {
+        report_result(&(OperationResult){.event = RESULT_DEPOSIT_OVERFLOW, .account_id = account_id, .amount = amount});
+        log_account_transaction(LOG_OP_DEPOSIT, account, amount, LOG_DETAIL_BALANCE_LIMIT, LOG_STATUS_FAILED);
+        return status;
+    }
+    if(status == 0) {
+        status = await_commit(ticket);
+    }
+    if(status == 0) {
+        report_result(&(OperationResult){.event = RESULT_DEPOSITED, .account_id = account_id, .amount = amount, .balance = new_balance});
+        log_account_transaction(LOG_OP_DEPOSIT, account, amount, LOG_DETAIL_DEPOSIT_SUCCESSFUL, LOG_STATUS_SUCCESS);
+        if(balance_out != NULL) {
+            *balance_out = new_balance;
+        }
+    } else {
+        report_result(&(OperationResult){.event = RESULT_DEPOSIT_FAILED, .account_id = account_id, .amount = amount});
+        log_account_transaction(LOG_OP_DEPOSIT, account, amount, LOG_DETAIL_DEPOSIT_FAILED, LOG_STATUS_FAILED);
+    }
+    return status;
+}
+
+// Function to deposit funds into an account
+void deposit(const char *account_id, Money amount) {
+    Account *account = find_account(account_id);
+    if(account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_DEPOSIT_MISSING, .account_id = account_id});
+        log_transaction_atomic(LOG_OP_DEPOSIT, account_id, amount, LOG_DETAIL_ACCOUNT_MISSING, LOG_STATUS_FAILED);
+        return;
+    }
+    uint64_t start = probe_begin();
+    deposit_account(account, amount, NULL);
+    probe_end(PROBE_DEPOSIT, start);
+}
+
+// Function to deposit funds into an account by handle
+void deposit_handle(AccountHandle handle, Money amount) {
+    Account *account = account_from_handle(handle);
+    if(account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_DEPOSIT_MISSING, .handle = handle});
+        return;
+    }
+    uint64_t start = probe_begin();
+    deposit_account(account, amount, NULL);
+    probe_end(PROBE_DEPOSIT, start);
+}
+
+// Function to withdraw funds from a resolved account. The balance is updated
+// with a CAS loop that refuses to overdraw; account->lock is only taken as
+// in deposit_account(). Returns 0 once committed, with the new balance in
+// *balance_out if that is not NULL, or BALANCE_INSUFFICIENT_FUNDS.
+static int withdraw_account(Account *account, Money amount, Money *balance_out) {
+    const char *account_id = account_name(account);
+    if(amount <= 0) {
+        report_result(&(OperationResult){.event = RESULT_INVALID_AMOUNT, .account_id = account_id, .amount = amount});
+        log_account_transaction(LOG_OP_WITHDRAW, account, amount, LOG_DETAIL_INVALID_AMOUNT, LOG_STATUS_FAILED);
+        return -1;
+    }
+    if(ensure_balance_loaded(account) != 0) {
+        report_result(&(OperationResult){.event = RESULT_READ_FAILED, .account_id = account_id});
+        log_account_transaction(LOG_OP_WITHDRAW, account, amount, LOG_DETAIL_READING_BALANCE_FAILED, LOG_STATUS_FAILED);
+        return -1;
+    }
+    
+    int locked = updates_need_account_lock();
+    if(locked) {
+        probed_lock(&account->lock, PROBE_ACCOUNT_LOCK);
+    }
+    Money delta = -amount;
+    Money new_balance;
+    uint64_t ticket;
+    int status = update_balances(&account, &delta, 1, &new_balance, &ticket);
+    if(locked) {
+        pthread_mutex_unlock(&account->lock);
+    }
+    if(status == BALANCE_INSUFFICIENT_FUNDS) {
+        report_result(&(OperationResult){.event = RESULT_WITHDRAW_INSUFFICIENT, .account_id = account_id, .balance = new_balance});
+        log_account_transaction(LOG_OP_WITHDRAW, account, amount, LOG_DETAIL_INSUFFICIENT_FUNDS, LOG_STATUS_FAILED);
+        return status;
+    }
+    if(status == 0) {
+        status = await_commit(ticket);
+    }
+    if(status == 0) {
+        report_result(&(OperationResult){.event = RESULT_WITHDRAWN, .account_id = account_id, .amount = amount, .balance = new_balance});
+        log_account_transaction(LOG_OP_WITHDRAW, account, amount, LOG_DETAIL_WITHDRAWAL_SUCCESSFUL, LOG_STATUS_SUCCESS);
+        if(balance_out != NULL) {
+            *balance_out = new_balance;
+        }
+    } else {
+        report_result(&(OperationResult){.event = RESULT_WITHDRAW_FAILED, .account_id = account_id, .amount = amount});
+        log_account_transaction(LOG_OP_WITHDRAW, account, amount, LOG_DETAIL_WITHDRAWAL_FAILED, LOG_STATUS_FAILED);
+    }
+    return status;
+}
+
+// Function to withdraw funds from an account
+void withdraw(const char *account_id, Money amount) {
+    Account *account = find_account(account_id);
+    if(account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_WITHDRAW_MISSING, .account_id = account_id});
+        log_transaction_atomic(LOG_OP_WITHDRAW, account_id, amount, LOG_DETAIL_ACCOUNT_MISSING, LOG_STATUS_FAILED);
+        return;
+    }
+    uint64_t start = probe_begin();
+    withdraw_account(account, amount, NULL);
+    probe_end(PROBE_WITHDRAW, start);
+}
+
+// Function to withdraw funds from an account by handle
+void withdraw_handle(AccountHandle handle, Money amount) {
+    Account *account = account_from_handle(handle);
+    if(account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_WITHDRAW_MISSING, .handle = handle});
+        return;
+    }
+    uint64_t start = probe_begin();
+    withdraw_account(account, amount, NULL);
+    probe_end(PROBE_WITHDRAW, start);
+}
+
+// Function to view the balance of a resolved account. Only the first load
+// takes account->lock; the read itself never blocks writers and only waits
+// out an update in progress on this account (see read_balance_versioned()).
+// Returns 0 with the balance in *balance_out if that is not NULL.
+static int view_account_balance(Account *account, Money *balance_out) {
+    const char *account_id = account_name(account);
+    if(ensure_balance_loaded(account) != 0) {
+        report_result(&(OperationResult){.event = RESULT_READ_FAILED, .account_id = account_id});
+        log_account_transaction(LOG_OP_VIEW_BALANCE, account, 0, LOG_DETAIL_READING_BALANCE_FAILED, LOG_STATUS_FAILED);
+        return -1;
+    }
+    Money balance = read_balance_versioned(account);
+    
+    report_result(&(OperationResult){.event = RESULT_BALANCE, .account_id = account_id, .balance = balance});
+    log_account_transaction(LOG_OP_VIEW_BALANCE, account, balance, LOG_DETAIL_BALANCE_VIEWED, LOG_STATUS_SUCCESS);
+    if(balance_out != NULL) {
+        *balance_out = balance;
+    }
+    return 0;
+}
+
+// Function to view the balance of an account
+void view_balance(const char *account_id) {
+    Account *account = find_account(account_id);
+    if(account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_VIEW_MISSING, .account_id = account_id});
+        log_transaction_atomic(LOG_OP_VIEW_BALANCE, account_id, 0, LOG_DETAIL_ACCOUNT_MISSING, LOG_STATUS_FAILED);
+        return;
+    }
+    uint64_t start = probe_begin();
+    view_account_balance(account, NULL);
+    probe_end(PROBE_VIEW_BALANCE, start);
+}
+
+// Function to view the balance of an account by handle
+void view_balance_handle(AccountHandle handle) {
+    Account *account = account_from_handle(handle);
+    if(account == NULL) {
+        report_result(&(OperationResult){.event = RESULT_VIEW_MISSING, .handle = handle});
+        return;
+    }
+    uint64_t start = probe_begin();
+    view_account_balance(account, NULL);
+    probe_end(PROBE_VIEW_BALANCE, start);
+}
+
+// Minimum accounts per central log scan thread; smaller books use fewer threads
+#define SNAPSHOT_ACCOUNTS_PER_THREAD 4096
+
+// One central log scan thread, its range of accounts and the report lines it formats
+typedef struct {
+    pthread_t thread;
+    BalanceSnapshot *snapshot;
+    int first;
+    int end;
+    char *text;
+    size_t length;
+    size_t capacity;
+    uint64_t total;             // Sum of the balances formatted, wrapping like the book total
+    int status;
+} SnapshotScan;
+
+// Function to capture and format the balances of one range of accounts
+static void* snapshot_scan(void *arg) {
+    SnapshotScan *scan = arg;
+    for(int i = scan->first; i < scan->end; i++) {
+        Account *account = account_at(i);
+        _Atomic int64_t *slot = &scan->snapshot->balances[i];
+        if(atomic_load_explicit(slot, memory_order_acquire) == SNAPSHOT_UNCAPTURED &&
+           !atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+            // Loading does not change the balance, so an unloaded account is
+            // still as of the cut; one that cannot be loaded is left out
+            probed_lock(&account->lock, PROBE_ACCOUNT_LOCK);
+            load_balance(account);
+            pthread_mutex_unlock(&account->lock);
+        }
+        snapshot_preserve(scan->snapshot, account, 1);
+        int64_t balance = atomic_load_explicit(slot, memory_order_acquire);
+        if(balance == SNAPSHOT_MISSING) {
+            account_info(account)->reported_balance = 0;
+            continue;
+        }
+        account_info(account)->reported_balance = balance;
+        scan->total += (uint64_t)balance;
+        const char *account_id = account_name(account);
+        size_t needed = scan->length + strlen(account_id) + 64;
+        if(needed > scan->capacity) {
+            size_t capacity = scan->capacity ? scan->capacity : 4096;
+            while(capacity < needed) {
+                capacity *= 2;
+            }
+            char *grown = realloc(scan->text, capacity);
+            if(grown == NULL) {
+                scan->status = -1;
+                return NULL;
+            }
+            scan->text = grown;
+            scan->capacity = capacity;
+        }
+        scan->length += sprintf(scan->text + scan->length, "Account: %s, Balance: %" PRId64 "\n", account_id, balance);
+    }
+    return NULL;
+}
+
+// Line separating the sections of the central log
+#define CENTRAL_LOG_RULE "--------------------------------------------------\n"
+
+// One changed account in an incremental report and its balance at the cut
+typedef struct {
+    Account *account;
+    Money balance;
+} ReportEntry;
+
+// Function to order report entries by account storage number
+static int compare_report_entries(const void *a, const void *b) {
+    const ReportEntry *left = a;
+    const ReportEntry *right = b;
+    return compare_account_numbers(&left->account, &right->account);
+}
+
+// Whether this run has written a central log yet, and the book total it
+// last reported; later reports only add what changed since (reporter only)
+int central_log_reported = 0;
+Money central_log_total = 0;
+
+// Function to check a report's total against the book total at its cut
+static void central_log_check(Money reported, Money total) {
+    if(reported != total) {
+        printf("Conservation check failed: the central log totals %" PRId64 " but the book holds %" PRId64 ".\n",
+               reported, total);
+    }
+}
+
+// Function to write a full report of every account. The report is a
+// consistent point-in-time view: accounts keep their balance as of the cut
+// in a copy-on-write snapshot (see snapshot_preserve()), so writers and
+// account creation carry on while the accounts are scanned in parallel.
+// The balances scanned must add up to the book total at the cut.
+static int central_log_full(LogWriter *log_file) {
+    log_writer_printf(log_file, "Central Log - Account Balances\n");
+    log_writer_printf(log_file, CENTRAL_LOG_RULE);
+    
+    BalanceSnapshot *snapshot = snapshot_begin();
+    if(snapshot == NULL) {
+        return -1;
+    }
+    
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = worker_count > 0 ? worker_count : (cores > 0 ? (int)cores : 1);
+    int wanted = (snapshot->count + SNAPSHOT_ACCOUNTS_PER_THREAD - 1) / SNAPSHOT_ACCOUNTS_PER_THREAD;
+    if(thread_count > wanted) {
+        thread_count = wanted > 0 ? wanted : 1;
+    }
+    SnapshotScan *scans = calloc(thread_count, sizeof(SnapshotScan));
+    int status = scans != NULL ? 0 : -1;
+    int started = 0;
+    for(; status == 0 && started < thread_count; started++) {
+        SnapshotScan *scan = &scans[started];
+        scan->snapshot = snapshot;
+        scan->first = (int)((long)snapshot->count * started / thread_count);
+        scan->end = (int)((long)snapshot->count * (started + 1) / thread_count);
+        // The first range is scanned on this thread once the others are running
+        if(started > 0 && pthread_create(&scan->thread, NULL, snapshot_scan, scan) != 0) {
+            status = -1;
+            break;
+        }
+    }
+    if(status == 0) {
+        snapshot_scan(&scans[0]);
+    }
+    for(int i = 1; i < started; i++) {
+        pthread_join(scans[i].thread, NULL);
+    }
+    Money total = snapshot->total;
+    snapshot_end(snapshot);
+    
+    uint64_t reported = 0;
+    for(int i = 0; i < started && status == 0; i++) {
+        status = scans[i].status;
+        reported += scans[i].total;
+        if(status == 0 && scans[i].length > 0) {
+            status = log_writer_append(log_file, scans[i].text, scans[i].length);
+        }
+    }
+    for(int i = 0; scans != NULL && i < thread_count; i++) {
+        free(scans[i].text);
+    }
+    free(scans);
+    if(status != 0) {
+        return -1;
+    }
+    central_log_check((Money)reported, total);
+    central_log_total = total;
+    log_writer_printf(log_file, CENTRAL_LOG_RULE);
+    return log_writer_printf(log_file, "Total: %" PRId64 "\n", total);
+}
+
+// Function to append an incremental report: only the accounts changed since
+// the previous report, as of one cut, and the book total. Its cost follows
+// the number of changed accounts, not the size of the book. The previous
+// total plus each account's change since its last reported balance must
+// give the new total. Stores the number of accounts reported in *changed.
+static int central_log_delta(LogWriter *log_file, int *changed) {
+    // Updates hold off cuts, so none is half applied here
+    cut_begin();
+    Account *dirty = take_report_dirty();
+    Money total = book_total();
+    int count = 0;
+    for(Account *account = dirty; account != NULL; account = account_info(account)->next_report_dirty) {
+        count++;
+    }
+    ReportEntry *entries = malloc((count > 0 ? count : 1) * sizeof(ReportEntry));
+    if(entries != NULL) {
+        int i = 0;
+        for(Account *account = dirty; account != NULL; account = account_info(account)->next_report_dirty) {
+            entries[i].account = account;
+            entries[i].balance = atomic_load(&account->balance);
+            i++;
+        }
+    }
+    cut_end();
+    if(entries == NULL) {
+        return -1;
+    }
+    qsort(entries, count, sizeof(ReportEntry), compare_report_entries);
+    
+    size_t capacity = (size_t)count * 100 + 256;
+    char *text = malloc(capacity);
+    if(text == NULL) {
+        free(entries);
+        return -1;
+    }
+    size_t length = (size_t)sprintf(text, "\nChanges since the previous report: %d accounts\n" CENTRAL_LOG_RULE, count);
+    uint64_t reported = (uint64_t)central_log_total;
+    for(int i = 0; i < count; i++) {
+        AccountInfo *info = account_info(entries[i].account);
+        reported += (uint64_t)entries[i].balance - (uint64_t)info->reported_balance;
+        info->reported_balance = entries[i].balance;
+        length += (size_t)sprintf(text + length, "Account: %s, Balance: %" PRId64 "\n", info->account_id,
+                                  entries[i].balance);
+    }
+    length += (size_t)sprintf(text + length, CENTRAL_LOG_RULE "Total: %" PRId64 "\n", total);
+    int status = log_writer_append(log_file, text, length);
+    free(text);
+    free(entries);
+    central_log_check((Money)reported, total);
+    central_log_total = total;
+    *changed = count;
+    return status;
+}
+
+// Function to generate the central log of account balances. The first
+// report of a run lists every account; later ones are appended and list
+// only the accounts changed since, so reading the file in order leaves
+// each account at its latest balance. Each report ends with the book total.
+void generate_central_log() {
+    char central_log_path[100];
+    sprintf(central_log_path, "%s/%s", ACCOUNTS_DIR, CENTRAL_LOG_FILE);
+    
+    // One report at a time; each needs the snapshot slot and the change set to itself
+    static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&report_lock);
+    int incremental = central_log_reported;
+    LogWriter log_file = {0};
+    if(log_writer_open(&log_file, central_log_path, !incremental, LOG_DIRECT) != 0) {
+        pthread_mutex_unlock(&report_lock);
+        printf("Error creating central log.\n");
+        return;
+    }
+    int changed = 0;
+    int status = incremental ? central_log_delta(&log_file, &changed) : central_log_full(&log_file);
+    // A failed report may have lost changes; the next one starts over in full
+    central_log_reported = status == 0;
+    pthread_mutex_unlock(&report_lock);
+    log_writer_close(&log_file);
+    if(status != 0) {
+        printf("Error writing central log.\n");
+        return;
+    }
+    if(incremental) {
+        printf("Central log updated at: %s (%d accounts changed)\n", central_log_path, changed);
+    } else {
+        printf("Central log created at: %s\n", central_log_path);
+    }
+}
+
+// Records per RecordPool segment, and the most segments a pool grows to
+#define RECORD_POOL_SEGMENT_RECORDS 1024
+#define RECORD_POOL_SEGMENTS 1024
+
+// Bookkeeping in front of every pooled record
+typedef struct {
+    uint32_t index;             // Position in the pool, fixed for the run
+    _Atomic uint32_t next_free; // Index + 1 of the next free record, 0 for none
+    uint64_t padding;           // Keeps the record 16-byte aligned
+} RecordHeader;
+
+// Lock-free freelist of fixed-size records, for objects that are created
+// on one thread and released on another (operations, and log records in
+// future). Storage grows a segment at a time and is never returned, so in
+// steady state allocating and freeing are a compare-and-swap each on the
+// list head. The head packs a version tag above the top record's index,
+// which keeps a pop that raced with a pop and push of the same record
+// from succeeding (ABA). Records start on their own cache line.
+typedef struct {
+    size_t record_size;
+    size_t slot_size;
+    _Atomic uint64_t head;      // Tag above 32 bits, top free index + 1 below; 0 when empty
+    char *segments[RECORD_POOL_SEGMENTS];
+    int segment_count;
+    pthread_mutex_t grow_lock;
+} RecordPool;
+
+#define RECORD_POOL_INITIALIZER(size) {.record_size = (size), .grow_lock = PTHREAD_MUTEX_INITIALIZER}
+
+// Function to find the header of a pooled record by its index
+static RecordHeader* record_header(RecordPool *pool, uint32_t index) {
+    char *segment = pool->segments[index / RECORD_POOL_SEGMENT_RECORDS];
+    return (RecordHeader*)(segment + (size_t)(index % RECORD_POOL_SEGMENT_RECORDS) * pool->slot_size);
+}
+
+// Function to push a record onto the freelist
+static void record_pool_push(RecordPool *pool, RecordHeader *header) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&header->next_free, (uint32_t)head, memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | (header->index + 1);
+    } while(!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+                                                   memory_order_release, memory_order_relaxed));
+}
+
+// Function to pop a record off the freelist; NULL if it is empty
+static RecordHeader* record_pool_pop(RecordPool *pool) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    RecordHeader *header;
+    uint64_t next;
+    do {
+        if((uint32_t)head == 0) {
+            return NULL;
+        }
+        header = record_header(pool, (uint32_t)head - 1);
+        next = (((head >> 32) + 1) << 32) | atomic_load_explicit(&header->next_free, memory_order_relaxed);
+    } while(!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+                                                   memory_order_acquire, memory_order_acquire));
+    return header;
+}
+
+// Function to add a segment of free records; -1 if the pool is at its limit
+static int record_pool_grow(RecordPool *pool) {
+    pthread_mutex_lock(&pool->grow_lock);
+    if((uint32_t)atomic_load(&pool->head) != 0) {
+        // Another thread grew it, or records were freed, while we waited
+        pthread_mutex_unlock(&pool->grow_lock);
+        return 0;
+    }
+    if(pool->segment_count == RECORD_POOL_SEGMENTS) {
+        pthread_mutex_unlock(&pool->grow_lock);
+        return -1;
+    }
+    if(pool->slot_size == 0) {
+        size_t size = sizeof(RecordHeader) + pool->record_size;
+        pool->slot_size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    }
+    char *segment = aligned_alloc(CACHE_LINE_SIZE, pool->slot_size * RECORD_POOL_SEGMENT_RECORDS);
+    if(segment == NULL) {
+        pthread_mutex_unlock(&pool->grow_lock);
+        return -1;
+    }
+    int number = pool->segment_count++;
+    pool->segments[number] = segment;
+    for(uint32_t i = 0; i < RECORD_POOL_SEGMENT_RECORDS; i++) {
+        RecordHeader *header = (RecordHeader*)(segment + (size_t)i * pool->slot_size);
+        header->index = (uint32_t)number * RECORD_POOL_SEGMENT_RECORDS + i;
+        record_pool_push(pool, header);
+    }
+    pthread_mutex_unlock(&pool->grow_lock);
+    return 0;
+}
+
+// Function to take a record from the pool (contents undefined); NULL if out of memory
+static void* record_alloc(RecordPool *pool) {
+    for(;;) {
+        RecordHeader *header = record_pool_pop(pool);
+        if(header != NULL) {
+            return header + 1;
+        }
+        if(record_pool_grow(pool) != 0) {
+            return NULL;
+        }
+    }
+}
+
+// Function to give a record back to the pool; any thread may free it
+static void record_free(RecordPool *pool, void *record) {
+    record_pool_push(pool, (RecordHeader*)record - 1);
+}
+
+// Structure representing a user operation
+typedef struct UserOperation {
+    char user_id[50];
+    char operation[20];
+    char target_account[50];
+    Money amount;
+    // Outcome and completion state, set by the worker that ran the operation:
+    // status is 0 on success, BALANCE_INSUFFICIENT_FUNDS, BALANCE_OVERFLOW
+    // or -1, and balance is the account's resulting balance where the
+    // operation has one
+    int status;
+    Money balance;
+    _Atomic int done;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    // Sharded engine state: the resolved accounts (the submitter may set
+    // them instead of the IDs), the phase reached and the inbox link
+    Account *account;
+    Account *target;
+    int phase;
+    struct UserOperation *next;
+    // When set, called on completion instead of waking waiters; it then
+    // owns the operation. context and the reply fields belong to its owner.
+    void (*on_complete)(struct UserOperation *op);
+    void *context;
+    struct UserOperation *reply_next;
+    int ready;
+} UserOperation;
+
+// Phases of an operation in the sharded engine
+#define SHARD_PHASE_RUN 0           // Queued on the shard that owns op->account
+#define SHARD_PHASE_RECEIVE 1       // Cross-shard transfer committed, receipt pending
+#define SHARD_PHASE_PARK 2          // The shard's barrier: stop until the cut ends
+
+// One shard of the sharded engine: a thread that owns the accounts hashing
+// to it and drains an unbounded inbox. Submitters and other shards push
+// onto the inbox with a compare-and-swap; the owner takes it whole.
+// Under periodic durability the shard buffers its WAL records and holds
+// back the operations that wrote them until they are appended.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) UserOperation *_Atomic inbox;
+    sem_t wakeup;
+    pthread_t thread;
+    struct WorkerPool *pool;
+    WalBuffer wal_buffer;       // data is NULL when records go straight to the WAL
+    UserOperation *held;
+    UserOperation *held_tail;
+    UserOperation barrier;      // Pushed onto the inbox to stop the shard for a cut
+} Shard;
+
+// Fixed-size pool of worker threads fed by a bounded multi-producer,
+// multi-consumer ring. Each slot carries a sequence number that tells
+// producers and consumers whose turn it is (Vyukov's bounded queue), so
+// neither side takes a lock; the two semaphores count filled and free
+// slots, putting idle workers to sleep and blocking submitters while
+// the queue is full.
+// When started with pool_start_sharded() the ring and workers are unused:
+// operations go to shards instead, free_slots still bounds how many are in
+// flight, and pending counts them so the shards know when they may stop.
+typedef struct WorkerPool {
+    UserOperation **slots;
+    _Atomic size_t *sequence;
+    size_t mask;
+    _Atomic size_t enqueue_position;
+    _Atomic size_t dequeue_position;
+    sem_t filled;
+    sem_t free_slots;
+    pthread_t *workers;
+    int worker_count;
+    Shard *shards;
+    int shard_count;
+    // A cut stops every shard at its barrier (see shards_quiesce())
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_changed;
+    int parked;
+    uint64_t park_generation;
+    _Atomic long pending;
+    _Atomic int stopping;
+} WorkerPool;
+
+// Function to draw the next number from this thread's xorshift generator
+static uint64_t thread_random() {
+    static __thread uint64_t state = 0;
+    if(state == 0) {
+        // Seed from the clock and the thread's stack address; never zero
+        state = timestamp_now() ^ (uint64_t)(uintptr_t)&state ^ 0x9E3779B97F4A7C15ULL;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Function to simulate client think time after an operation, when enabled
+// with --inject-latency (off by default so benchmarks measure the engine)
+static void inject_latency() {
+    if(latency_max_us <= 0) {
+        return;
+    }
+    int span = latency_max_us - latency_min_us + 1;
+    usleep((useconds_t)(latency_min_us + (int)(thread_random() % (uint64_t)span)));
+}
+
+// Function to run an operation other than create on resolved accounts,
+// timed like the public calls. Returns its status, leaving any resulting
+// balance in op->balance.
+static int operation_apply(UserOperation *op, Account *account, Account *target, int transfer_flags) {
+    uint64_t start = probe_begin();
+    int status;
+    if(strcmp(op->operation, "transfer") == 0) {
+        status = transfer_accounts(account, target, op->amount, transfer_flags);
+        probe_end(PROBE_TRANSFER, start);
+    }
+    else if(strcmp(op->operation, "deposit") == 0) {
+        status = deposit_account(account, op->amount, &op->balance);
+        probe_end(PROBE_DEPOSIT, start);
+    }
+    else if(strcmp(op->operation, "withdraw") == 0) {
+        status = withdraw_account(account, op->amount, &op->balance);
+        probe_end(PROBE_WITHDRAW, start);
+    }
+    else if(strcmp(op->operation, "view_balance") == 0) {
+        status = view_account_balance(account, &op->balance);
+        probe_end(PROBE_VIEW_BALANCE, start);
+    }
+    else {
+        status = -1;
+    }
+    return status;
+}
+
+// Function to perform a user operation (run by the pool workers), leaving
+// its outcome in op->status and op->balance
+void user_operations(UserOperation *op) {
+    op->status = -1;
+    op->balance = 0;
+    int is_transfer = strcmp(op->operation, "transfer") == 0;
+    if(strcmp(op->operation, "create") == 0) {
+        if(create_account(op->user_id, op->amount) != INVALID_ACCOUNT_HANDLE) {
+            op->status = 0;
+            op->balance = op->amount;
+        }
+    }
+    else {
+        Account *account = op->account != NULL ? op->account : find_account(op->user_id);
+        Account *target = op->target != NULL || !is_transfer ? op->target : find_account(op->target_account);
+        if(account != NULL && (target != NULL || !is_transfer)) {
+            op->status = operation_apply(op, account, target, TRANSFER_LOCK_ACCOUNTS | TRANSFER_LOG_RECEIPT);
+        }
+        else if(is_transfer) {
+            // Could not be resolved; the public calls report the error
+            transfer(op->user_id, op->target_account, op->amount);
+        }
+        else if(strcmp(op->operation, "deposit") == 0) {
+            deposit(op->user_id, op->amount);
+        }
+        else if(strcmp(op->operation, "withdraw") == 0) {
+            withdraw(op->user_id, op->amount);
+        }
+        else if(strcmp(op->operation, "view_balance") == 0) {
+            view_balance(op->user_id);
+        }
+    }
+    inject_latency();
+}
+
+// Function to prepare an operation's completion state before submitting it
+void operation_init(UserOperation *op) {
+    atomic_init(&op->done, 0);
+    pthread_mutex_init(&op->done_lock, NULL);
+    pthread_cond_init(&op->done_cond, NULL);
+}
+
+// Function to mark an operation finished and wake whoever waits on it, or
+// hand it to its completion callback
+static void operation_complete(UserOperation *op) {
+    if(op->on_complete != NULL) {
+        op->on_complete(op);
+        return;
+    }
+    pthread_mutex_lock(&op->done_lock);
+    atomic_store_explicit(&op->done, 1, memory_order_release);
+    pthread_cond_broadcast(&op->done_cond);
+    pthread_mutex_unlock(&op->done_lock);
+}
+
+// Function to wait for a submitted operation; the caller may then free it
+void operation_wait(UserOperation *op) {
+    if(atomic_load_explicit(&op->done, memory_order_acquire)) {
+        return;
+    }
+    pthread_mutex_lock(&op->done_lock);
+    while(!atomic_load_explicit(&op->done, memory_order_acquire)) {
+        pthread_cond_wait(&op->done_cond, &op->done_lock);
+    }
+    pthread_mutex_unlock(&op->done_lock);
+}
+
+// Function to release an operation's completion state
+void operation_destroy(UserOperation *op) {
+    pthread_mutex_destroy(&op->done_lock);
+    pthread_cond_destroy(&op->done_cond);
+}
+
+// Records operations are allocated from
+static RecordPool operation_records = RECORD_POOL_INITIALIZER(sizeof(UserOperation));
+
+// Function to allocate a cleared operation without touching the heap in
+// steady state; NULL if out of memory
+UserOperation* operation_alloc() {
+    UserOperation *op = record_alloc(&operation_records);
+    if(op != NULL) {
+        memset(op, 0, sizeof(UserOperation));
+    }
+    return op;
+}
+
+// Function to release an operation from operation_alloc(), on any thread
+void operation_free(UserOperation *op) {
+    record_free(&operation_records, op);
+}
+
+// Function to put an operation into a free slot (one was reserved via free_slots)
+static void pool_enqueue(WorkerPool *pool, UserOperation *op) {
+    size_t position = atomic_load_explicit(&pool->enqueue_position, memory_order_relaxed);
+    for(;;) {
+        size_t sequence = atomic_load_explicit(&pool->sequence[position & pool->mask], memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&pool->enqueue_position, &position, position + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else {
+            position = atomic_load_explicit(&pool->enqueue_position, memory_order_relaxed);
+        }
+    }
+    pool->slots[position & pool->mask] = op;
+    atomic_store_explicit(&pool->sequence[position & pool->mask], position + 1, memory_order_release);
+    sem_post(&pool->filled);
+}
+
+// Function to take an operation from a filled slot (one was claimed via filled)
+static UserOperation* pool_dequeue(WorkerPool *pool) {
+    size_t position = atomic_load_explicit(&pool->dequeue_position, memory_order_relaxed);
+    for(;;) {
+        size_t sequence = atomic_load_explicit(&pool->sequence[position & pool->mask], memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&pool->dequeue_position, &position, position + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else {
+            position = atomic_load_explicit(&pool->dequeue_position, memory_order_relaxed);
+        }
+    }
+    UserOperation *op = pool->slots[position & pool->mask];
+    atomic_store_explicit(&pool->sequence[position & pool->mask], position + pool->mask + 1, memory_order_release);
+    sem_post(&pool->free_slots);
+    return op;
+}
+
+// Thread function run by each pool worker; a NULL operation tells it to exit
+static void* pool_worker(void *arg) {
+    WorkerPool *pool = arg;
+    for(;;) {
+        while(sem_wait(&pool->filled) != 0) {
+        }
+        UserOperation *op = pool_dequeue(pool);
+        if(op == NULL) {
+            break;
+        }
+        user_operations(op);
+        operation_complete(op);
+    }
+    return NULL;
+}
+
+// Function to start a pool of worker_count threads (0 means one per core)
+// over a queue holding queue_depth operations (rounded up to a power of two)
+int pool_start(WorkerPool *pool, int worker_count, int queue_depth) {
+    if(worker_count <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cores > 0 ? (int)cores : 1;
+    }
+    size_t capacity = 2;
+    while(capacity < (size_t)queue_depth) {
+        capacity *= 2;
+    }
+    pool->slots = calloc(capacity, sizeof(UserOperation*));
+    pool->sequence = malloc(capacity * sizeof(_Atomic size_t));
+    pool->workers = malloc(worker_count * sizeof(pthread_t));
+    if(pool->slots == NULL || pool->sequence == NULL || pool->workers == NULL) {
+        printf("Error allocating worker pool.\n");
+        return -1;
+    }
+    for(size_t i = 0; i < capacity; i++) {
+        atomic_init(&pool->sequence[i], i);
+    }
+    pool->mask = capacity - 1;
+    pool->shards = NULL;
+    pool->shard_count = 0;
+    atomic_init(&pool->enqueue_position, 0);
+    atomic_init(&pool->dequeue_position, 0);
+    sem_init(&pool->filled, 0, 0);
+    sem_init(&pool->free_slots, 0, (unsigned)capacity);
+    pool->worker_count = 0;
+    for(int i = 0; i < worker_count; i++) {
+        if(pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0) {
+            printf("Error starting worker thread.\n");
+            break;
+        }
+        pool->worker_count++;
+    }
+    return pool->worker_count > 0 ? 0 : -1;
+}
+
+// Function to pick the shard that owns an account. Handles are handed out
+// in creation order, so they are mixed first to spread neighbours.
+static int shard_of(const WorkerPool *pool, const Account *account) {
+    uint32_t mixed = (uint32_t)account->number * 2654435761u;
+    return (int)(((uint64_t)mixed * (uint32_t)pool->shard_count) >> 32);
+}
+
+// Function to push an operation onto a shard's inbox and wake its owner
+static void shard_push(Shard *shard, UserOperation *op) {
+    op->next = atomic_load_explicit(&shard->inbox, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&shard->inbox, &op->next, op,
+                                                 memory_order_release, memory_order_relaxed)) {
+    }
+    sem_post(&shard->wakeup);
+}
+
+// Function to finish an operation on a shard. The last one to finish once
+// the pool is stopping wakes every shard so they can exit.
+static void shard_complete(WorkerPool *pool, UserOperation *op) {
+    operation_complete(op);
+    sem_post(&pool->free_slots);
+    if(atomic_fetch_sub(&pool->pending, 1) == 1 && atomic_load(&pool->stopping)) {
+        for(int i = 0; i < pool->shard_count; i++) {
+            sem_post(&pool->shards[i].wakeup);
+        }
+    }
+}
+
+// Function to pass on an operation whose WAL record, if any, is appended: a
+// committed cross-shard transfer goes to the receiving shard, anything else
+// completes
+static void shard_release(WorkerPool *pool, UserOperation *op) {
+    if(op->phase == SHARD_PHASE_RECEIVE) {
+        shard_push(&pool->shards[shard_of(pool, op->target)], op);
+    } else {
+        shard_complete(pool, op);
+    }
+}
+
+// Function to pass on an operation once the shard's buffered WAL records
+// are appended (at once if the shard does not buffer them)
+static void shard_finish(Shard *shard, UserOperation *op) {
+    if(shard->wal_buffer.data == NULL) {
+        shard_release(shard->pool, op);
+        return;
+    }
+    op->next = NULL;
+    if(shard->held_tail != NULL) {
+        shard->held_tail->next = op;
+    } else {
+        shard->held = op;
+    }
+    shard->held_tail = op;
+}
+
+// Function to append the shard's buffered WAL records and pass on the
+// operations held back for them
+static void shard_flush(Shard *shard) {
+    wal_append_buffered(&shard->wal_buffer);
+    UserOperation *op = shard->held;
+    shard->held = shard->held_tail = NULL;
+    while(op != NULL) {
+        UserOperation *next = op->next;
+        shard_release(shard->pool, op);
+        op = next;
+    }
+}
+
+// Function to run one operation on the shard that owns its account. The
+// owner is the only thread that debits the account, so no account lock is
+// taken (except in the legacy write-through file mode, see
+// updates_need_account_lock()). A transfer to another shard's account is
+// committed here as one update, since a credit needs no ownership; the
+// operation is then handed to the receiving shard, which logs the receipt
+// in order with its own account's other records and completes it.
+static void shard_run(Shard *shard, UserOperation *op) {
+    WorkerPool *pool = shard->pool;
+    Account *account = op->account;
+    int lock = updates_need_account_lock() ? TRANSFER_LOCK_ACCOUNTS : 0;
+    if(op->phase == SHARD_PHASE_RECEIVE) {
+        log_account_transaction(LOG_OP_TRANSFER, op->target, op->amount, LOG_DETAIL_TRANSFER_RECEIVED, LOG_STATUS_SUCCESS);
+        shard_complete(pool, op);
+        return;
+    }
+    int is_transfer = strcmp(op->operation, "transfer") == 0;
+    if(account == NULL || (is_transfer && op->target == NULL) || strcmp(op->operation, "create") == 0) {
+        // Creation, or accounts that could not be resolved; the usual path
+        // creates or reports the error
+        user_operations(op);
+        shard_finish(shard, op);
+        return;
+    }
+    op->balance = 0;
+    if(is_transfer && shard_of(pool, op->target) != shard_of(pool, account)) {
+        op->status = operation_apply(op, account, op->target, lock);
+        if(op->status == 0) {
+            op->phase = SHARD_PHASE_RECEIVE;
+        }
+    } else {
+        op->status = operation_apply(op, account, op->target, lock | TRANSFER_LOG_RECEIPT);
+    }
+    shard_finish(shard, op);
+}
+
+// Function to stop a shard at its barrier until the cut has ended
+static void shard_park(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->park_lock);
+    uint64_t generation = pool->park_generation;
+    pool->parked++;
+    pthread_cond_broadcast(&pool->park_changed);
+    while(pool->park_generation == generation) {
+        pthread_cond_wait(&pool->park_changed, &pool->park_lock);
+    }
+    pool->parked--;
+    pthread_cond_broadcast(&pool->park_changed);
+    pthread_mutex_unlock(&pool->park_lock);
+}
+
+// Function to stop every shard between operations for a cut (caller holds
+// cut_lock): each finds its barrier in its inbox, appends its buffered WAL
+// records and parks
+static void shards_quiesce(WorkerPool *pool) {
+    for(int i = 0; i < pool->shard_count; i++) {
+        pool->shards[i].barrier.phase = SHARD_PHASE_PARK;
+        shard_push(&pool->shards[i], &pool->shards[i].barrier);
+    }
+    pthread_mutex_lock(&pool->park_lock);
+    while(pool->parked < pool->shard_count) {
+        pthread_cond_wait(&pool->park_changed, &pool->park_lock);
+    }
+    pthread_mutex_unlock(&pool->park_lock);
+}
+
+// Function to let the shards run again after shards_quiesce(). Waits until
+// every one has left its barrier, so the next cut can reuse them.
+static void shards_resume(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->park_lock);
+    pool->park_generation++;
+    pthread_cond_broadcast(&pool->park_changed);
+    while(pool->parked > 0) {
+        pthread_cond_wait(&pool->park_changed, &pool->park_lock);
+    }
+    pthread_mutex_unlock(&pool->park_lock);
+}
+
+// Thread function run by each shard: drains the inbox in arrival order
+// until the pool is stopping and no operation is left anywhere
+static void* shard_worker(void *arg) {
+    Shard *shard = arg;
+    WorkerPool *pool = shard->pool;
+    on_shard_thread = 1;
+    if(shard->wal_buffer.data != NULL) {
+        shard_wal_buffer = &shard->wal_buffer;
+    }
+    for(;;) {
+        while(sem_wait(&shard->wakeup) != 0) {
+        }
+        // The inbox is a stack; reverse it to run operations first come first served
+        UserOperation *op = atomic_exchange_explicit(&shard->inbox, NULL, memory_order_acquire);
+        UserOperation *ordered = NULL;
+        while(op != NULL) {
+            UserOperation *next = op->next;
+            op->next = ordered;
+            ordered = op;
+            op = next;
+        }
+        while(ordered != NULL) {
+            UserOperation *next = ordered->next;
+            if(ordered->phase == SHARD_PHASE_PARK) {
+                // Everything committed before the cut must be in the WAL at it
+                shard_flush(shard);
+                shard_park(pool);
+            } else {
+                shard_run(shard, ordered);
+            }
+            ordered = next;
+        }
+        shard_flush(shard);
+        if(atomic_load(&pool->stopping) && atomic_load(&pool->pending) == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Function to route a submitted operation (holding a free_slots credit) to
+// the shard that owns its account, resolving the account IDs if needed
+static void shard_submit(WorkerPool *pool, UserOperation *op) {
+    if(op->account == NULL) {
+        op->account = find_account(op->user_id);
+        op->target = strcmp(op->operation, "transfer") == 0 ? find_account(op->target_account) : NULL;
+    }
+    op->phase = SHARD_PHASE_RUN;
+    atomic_fetch_add(&pool->pending, 1);
+    shard_push(&pool->shards[op->account != NULL ? shard_of(pool, op->account) : 0], op);
+}
+
+// Function to let the shards finish every operation in flight and stop them
+static void shards_stop(WorkerPool *pool) {
+    // No cut may wait for a shard that has already exited
+    pthread_mutex_lock(&cut_lock);
+    atomic_store(&pool->stopping, 1);
+    for(int i = 0; i < pool->shard_count; i++) {
+        sem_post(&pool->shards[i].wakeup);
+    }
+    for(int i = 0; i < pool->shard_count; i++) {
+        pthread_join(pool->shards[i].thread, NULL);
+        sem_destroy(&pool->shards[i].wakeup);
+        free(pool->shards[i].wal_buffer.data);
+    }
+    if(sharded_engine == pool) {
+        sharded_engine = NULL;
+    }
+    pthread_mutex_unlock(&cut_lock);
+    pthread_mutex_destroy(&pool->park_lock);
+    pthread_cond_destroy(&pool->park_changed);
+    sem_destroy(&pool->free_slots);
+    free(pool->shards);
+    pool->shards = NULL;
+    pool->shard_count = 0;
+}
+
+// Function to start the pool as a sharded engine of shard_count threads
+// (0 means one per core), each pinned to its own core, with at most
+// queue_depth operations in flight
+int pool_start_sharded(WorkerPool *pool, int shard_count, int queue_depth) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores <= 0) {
+        cores = 1;
+    }
+    if(shard_count <= 0) {
+        shard_count = (int)cores;
+    }
+    memset(pool, 0, sizeof(WorkerPool));
+    pool->shards = aligned_alloc(CACHE_LINE_SIZE, shard_count * sizeof(Shard));
+    if(pool->shards == NULL) {
+        printf("Error allocating the sharded engine.\n");
+        return -1;
+    }
+    sem_init(&pool->free_slots, 0, (unsigned)queue_depth);
+    pthread_mutex_init(&pool->park_lock, NULL);
+    pthread_cond_init(&pool->park_changed, NULL);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->stopping, 0);
+    // Only periodic durability lets a shard acknowledge before its records reach the WAL file
+    int buffer_wal = wal_enabled && durability_policy == DURABILITY_PERIODIC;
+    for(int i = 0; i < shard_count; i++) {
+        Shard *shard = &pool->shards[i];
+        atomic_init(&shard->inbox, NULL);
+        sem_init(&shard->wakeup, 0, 0);
+        shard->pool = pool;
+        shard->wal_buffer = (WalBuffer){0};
+        shard->held = shard->held_tail = NULL;
+        memset(&shard->barrier, 0, sizeof(shard->barrier));
+        if(buffer_wal) {
+            shard->wal_buffer.data = malloc(SHARD_WAL_BUFFER_BYTES);
+            if(shard->wal_buffer.data == NULL) {
+                printf("Error allocating a shard's WAL buffer.\n");
+                sem_destroy(&shard->wakeup);
+                break;
+            }
+            shard->wal_buffer.capacity = SHARD_WAL_BUFFER_BYTES;
+        }
+        if(pthread_create(&shard->thread, NULL, shard_worker, shard) != 0) {
+            free(shard->wal_buffer.data);
+            printf("Error starting shard thread.\n");
+            sem_destroy(&shard->wakeup);
+            break;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus);
+        pool->shard_count++;
+    }
+    if(pool->shard_count < shard_count) {
+        // Accounts hash over every shard, so a partial engine cannot run
+        shards_stop(pool);
+        return -1;
+    }
+    pthread_mutex_lock(&cut_lock);
+    sharded_engine = pool;
+    pthread_mutex_unlock(&cut_lock);
+    return 0;
+}
+
+// Function to queue an operation, blocking while the queue is full. The
+// operation itself is the completion handle: operation_wait(op) returns
+// once a worker has run it.
+void pool_submit(WorkerPool *pool, UserOperation *op) {
+    operation_init(op);
+    while(sem_wait(&pool->free_slots) != 0) {
+    }
+    if(pool->shard_count > 0) {
+        shard_submit(pool, op);
+        return;
+    }
+    pool_enqueue(pool, op);
+}
+
+// Function to queue an operation without blocking; returns -1 if the queue is full
+int pool_try_submit(WorkerPool *pool, UserOperation *op) {
+    if(sem_trywait(&pool->free_slots) != 0) {
+        return -1;
+    }
+    operation_init(op);
+    if(pool->shard_count > 0) {
+        shard_submit(pool, op);
+        return 0;
+    }
+    pool_enqueue(pool, op);
+    return 0;
+}
+
+// Function to let the workers finish the queued operations and stop them
+void pool_stop(WorkerPool *pool) {
+    if(pool->shard_count > 0) {
+        shards_stop(pool);
+        return;
+    }
+    for(int i = 0; i < pool->worker_count; i++) {
+        while(sem_wait(&pool->free_slots) != 0) {
+        }
+        pool_enqueue(pool, NULL);
+    }
+    for(int i = 0; i < pool->worker_count; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    sem_destroy(&pool->filled);
+    sem_destroy(&pool->free_slots);
+    free(pool->slots);
+    free((void*)pool->sequence);
+    free(pool->workers);
+}
+
+// Bytes read from an operation stream at a time; also the longest line accepted
+#define INGEST_BUFFER_BYTES (64 * 1024)
+
+// Function to take the next whitespace-separated field of a line, ending it
+// in place; returns NULL at the end of the line
+static char* ingest_field(char **cursor) {
+    char *p = *cursor;
+    while(*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    if(*p == '\0') {
+        return NULL;
+    }
+    char *field = p;
+    while(*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r') {
+        p++;
+    }
+    if(*p != '\0') {
+        *p++ = '\0';
+    }
+    *cursor = p;
+    return field;
+}
+
+// Function to copy an account ID field into an operation; -1 if it is too long
+static int ingest_account_id(char *destination, const char *field) {
+    size_t length = field != NULL ? strlen(field) : 0;
+    if(length == 0 || length >= sizeof(((UserOperation*)0)->user_id)) {
+        return -1;
+    }
+    memcpy(destination, field, length + 1);
+    return 0;
+}
+
+// Function to parse one line of an operation stream into op. Lines are
+//   transfer FROM TO AMOUNT | deposit ID AMOUNT | withdraw ID AMOUNT |
+//   view_balance ID | create ID INITIAL_BALANCE
+// with blank lines and lines starting with '#' ignored. Returns 0 for an
+// operation, 1 for a line to ignore and -1 if the line is malformed.
+static int ingest_parse(char *line, UserOperation *op) {
+    char *cursor = line;
+    char *name = ingest_field(&cursor);
+    if(name == NULL || name[0] == '#') {
+        return 1;
+    }
+    int transfer = strcmp(name, "transfer") == 0;
+    int view = strcmp(name, "view_balance") == 0;
+    if(!transfer && !view && strcmp(name, "deposit") != 0 && strcmp(name, "withdraw") != 0 &&
+       strcmp(name, "create") != 0) {
+        return -1;
+    }
+    memset(op, 0, sizeof(UserOperation));
+    strcpy(op->operation, name);
+    if(ingest_account_id(op->user_id, ingest_field(&cursor)) != 0) {
+        return -1;
+    }
+    if(transfer && ingest_account_id(op->target_account, ingest_field(&cursor)) != 0) {
+        return -1;
+    }
+    if(!view) {
+        char *amount = ingest_field(&cursor);
+        if(amount == NULL) {
+            return -1;
+        }
+        if(money_parse(amount, &op->amount) != 0) {
+            return -1;
+        }
+    }
+    return ingest_field(&cursor) == NULL ? 0 : -1;
+}
+
+// Function to replay an operation stream (a file, or stdin for "-") through
+// the pool. Lines are parsed in place in one fixed buffer and the operations
+// go into a ring of queue_depth preallocated records, each reused once the
+// operation it last held has finished, so memory stays bounded whatever the
+// size of the input. Malformed lines are reported and skipped. Operations
+// run concurrently, as submitted by live clients; replays that depend on
+// the order of lines should use a single worker.
+int ingest_operations(WorkerPool *pool, const char *path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("Error opening operation stream %s.\n", path);
+        return -1;
+    }
+    size_t ring_size = (size_t)queue_depth;
+    char *buffer = malloc(INGEST_BUFFER_BYTES + 1);
+    UserOperation *ring = calloc(ring_size, sizeof(UserOperation));
+    if(buffer == NULL || ring == NULL) {
+        printf("Error allocating the operation stream buffers.\n");
+        free(buffer);
+        free(ring);
+        if(fd != STDIN_FILENO) {
+            close(fd);
+        }
+        return -1;
+    }
+    int status = 0;
+    size_t length = 0;
+    size_t next = 0;
+    long submitted = 0;
+    long skipped = 0;
+    long line_number = 0;
+    int reclaimed = 0;          // ring[next] is free again after a full lap
+    int discarding = 0;         // Inside a line too long for the buffer
+    for(;;) {
+        ssize_t got = read(fd, buffer + length, INGEST_BUFFER_BYTES - length);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got < 0) {
+            printf("Error reading operation stream %s.\n", path);
+            status = -1;
+            break;
+        }
+        length += (size_t)got;
+        int at_end = got == 0;
+        size_t start = 0;
+        while(start < length) {
+            char *newline = memchr(buffer + start, '\n', length - start);
+            if(newline == NULL && !at_end) {
+                break;
+            }
+            if(newline == NULL) {
+                // Last line without a newline; the buffer has room for its end
+                newline = buffer + length;
+            }
+            *newline = '\0';
+            char *line = buffer + start;
+            start = (size_t)(newline - buffer) + 1;
+            line_number++;
+            if(discarding) {
+                discarding = 0;
+                continue;
+            }
+            UserOperation *op = &ring[next];
+            if(submitted >= (long)ring_size && !reclaimed) {
+                // Reuse the record once its previous operation is done
+                operation_wait(op);
+                operation_destroy(op);
+                reclaimed = 1;
+            }
+            int parsed = ingest_parse(line, op);
+            if(parsed < 0) {
+                printf("Skipping malformed operation on line %ld.\n", line_number);
+                skipped++;
+            }
+            if(parsed != 0) {
+                continue;
+            }
+            pool_submit(pool, op);
+            next = (next + 1) % ring_size;
+            submitted++;
+            reclaimed = 0;
+        }
+        if(start > length) {
+            start = length;
+        }
+        memmove(buffer, buffer + start, length - start);
+        length -= start;
+        if(at_end) {
+            break;
+        }
+        if(length == INGEST_BUFFER_BYTES) {
+            if(!discarding) {
+                printf("Skipping operation on line %ld: longer than %d bytes.\n", line_number + 1, INGEST_BUFFER_BYTES);
+                skipped++;
+                discarding = 1;
+            }
+            length = 0;
+        }
+    }
+    // Wait for everything still in flight
+    for(size_t i = 0; i < ring_size && (long)i < submitted; i++) {
+        if(i == next && reclaimed) {
+            continue;
+        }
+        operation_wait(&ring[i]);
+        operation_destroy(&ring[i]);
+    }
+    if(fd != STDIN_FILENO) {
+        close(fd);
+    }
+    free(buffer);
+    free(ring);
+    printf("Replayed %ld operations from %s (%ld lines skipped).\n", submitted, path, skipped);
+    return status;
+}
+
+// Longest request line a connection may send, and the most reply bytes it
+// may have waiting to be written
+#define SERVER_BUFFER_BYTES 4096
+
+// Requests a connection may have awaiting their replies before the server
+// stops reading from it
+#define SERVER_MAX_PIPELINE 256
+
+// Room one reply needs in a connection's output buffer
+#define SERVER_REPLY_BYTES 32
+
+// Events taken from epoll at a time
+#define SERVER_EVENTS 64
+
+// Status of a request line that could not be parsed
+#define OPERATION_MALFORMED -2
+
+struct Server;
+
+// One client connection. Requests are parsed into operations queued in
+// arrival order from head to tail through reply_next, and replies are only
+// written from the head, so a client that pipelines its requests gets the
+// replies in the order it sent them.
+typedef struct Connection {
+    int fd;                             // -1 once closed
+    struct Server *server;
+    char input[SERVER_BUFFER_BYTES + 1];
+    size_t input_length;
+    char output[SERVER_BUFFER_BYTES];
+    size_t output_start;
+    size_t output_length;               // Bytes from output_start still to send
+    UserOperation *head;
+    UserOperation *tail;
+    UserOperation *stalled;             // Queued but refused by the full pool
+    int queued;                         // Operations from head to tail
+    int running;                        // Operations in the pool
+    int read_closed;
+    int discarding;                     // Inside a request line too long for input
+    uint32_t events;                    // Events registered with epoll
+    int marked;                         // On the server's service list
+    struct Connection *next_service;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+// The network front end. Only the event loop touches the connections;
+// workers push completed operations onto completed and wake the loop
+// through the eventfd. Central log reports asked for with SIGHUP are
+// written by the reporter thread.
+typedef struct Server {
+    WorkerPool *pool;
+    int epoll_fd;
+    int listen_fd;
+    int event_fd;
+    int signal_fd;
+    UserOperation *_Atomic completed;
+    Connection *connections;
+    Connection *service;                // Connections to service before the next wait
+    int stalled;                        // Connections with a stalled operation
+    long running;                       // Operations in the pool
+    long served;                        // Replies queued for sending
+    char unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    pthread_t report_thread;
+    int report_thread_started;
+    pthread_mutex_t report_lock;        // Guards report_wanted and report_stop
+    pthread_cond_t report_request;
+    int report_wanted;                  // A SIGHUP came in since the last report began
+    int report_stop;
+} Server;
+
+// Function called by a worker when a served operation completes: hand it to
+// the event loop, waking the loop if nothing else was waiting for it
+static void server_operation_done(UserOperation *op) {
+    Server *server = ((Connection*)op->context)->server;
+    op->next = atomic_load_explicit(&server->completed, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&server->completed, &op->next, op,
+                                                 memory_order_release, memory_order_relaxed)) {
+    }
+    if(op->next == NULL) {
+        uint64_t one = 1;
+        ssize_t written = write(server->event_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+// Function to queue a connection for servicing at the end of this round
+static void server_mark(Server *server, Connection *connection) {
+    if(!connection->marked) {
+        connection->marked = 1;
+        connection->next_service = server->service;
+        server->service = connection;
+    }
+}
+
+// Function to hand a queued operation to the pool without blocking the
+// event loop; if the pool is full it stays stalled until a slot frees up
+static void connection_submit(Connection *connection, UserOperation *op) {
+    Server *server = connection->server;
+    if(pool_try_submit(server->pool, op) != 0) {
+        if(connection->stalled == NULL) {
+            connection->stalled = op;
+            server->stalled++;
+        }
+        return;
+    }
+    if(connection->stalled == op) {
+        connection->stalled = NULL;
+        server->stalled--;
+    }
+    connection->running++;
+    server->running++;
+}
+
+// Function to parse the complete request lines in a connection's input and
+// queue them, until the pool or the pipeline is full
+static void connection_parse(Connection *connection) {
+    size_t start = 0;
+    while(connection->stalled == NULL && connection->queued < SERVER_MAX_PIPELINE && start < connection->input_length) {
+        char *newline = memchr(connection->input + start, '\n', connection->input_length - start);
+        if(newline == NULL && !connection->read_closed) {
+            break;
+        }
+        if(newline == NULL) {
+            // Last request without a newline; the buffer has room for its end
+            newline = connection->input + connection->input_length;
+        }
+        *newline = '\0';
+        char *line = connection->input + start;
+        start = (size_t)(newline - connection->input) + 1;
+        if(connection->discarding) {
+            connection->discarding = 0;
+            continue;
+        }
+        UserOperation *op = operation_alloc();
+        if(op == NULL) {
+            printf("Error allocating a request; closing the connection.\n");
+            connection->read_closed = 1;
+            start = connection->input_length;
+            break;
+        }
+        int parsed = ingest_parse(line, op);
+        if(parsed > 0) {
+            operation_free(op);
+            continue;
+        }
+        op->on_complete = server_operation_done;
+        op->context = connection;
+        if(connection->tail != NULL) {
+            connection->tail->reply_next = op;
+        } else {
+            connection->head = op;
+        }
+        connection->tail = op;
+        connection->queued++;
+        if(parsed < 0) {
+            op->status = OPERATION_MALFORMED;
+            op->ready = 1;
+            continue;
+        }
+        connection_submit(connection, op);
+    }
+    if(start > connection->input_length) {
+        start = connection->input_length;
+    }
+    memmove(connection->input, connection->input + start, connection->input_length - start);
+    connection->input_length -= start;
+    if(connection->input_length == SERVER_BUFFER_BYTES) {
+        // A full buffer without a newline: refuse the line and skip its rest
+        UserOperation *op = connection->discarding ? NULL : operation_alloc();
+        if(op != NULL) {
+            op->status = OPERATION_MALFORMED;
+            op->ready = 1;
+            if(connection->tail != NULL) {
+                connection->tail->reply_next = op;
+            } else {
+                connection->head = op;
+            }
+            connection->tail = op;
+            connection->queued++;
+        }
+        connection->discarding = 1;
+        connection->input_length = 0;
+    }
+}
+
+// Function to format the replies of the finished operations at the head of
+// a connection's queue, as far as the output buffer has room
+static void connection_reply(Connection *connection) {
+    if(connection->output_start > 0) {
+        memmove(connection->output, connection->output + connection->output_start, connection->output_length);
+        connection->output_start = 0;
+    }
+    while(connection->head != NULL && connection->head->ready &&
+          SERVER_BUFFER_BYTES - connection->output_length >= SERVER_REPLY_BYTES) {
+        UserOperation *op = connection->head;
+        char *reply = connection->output + connection->output_length;
+        int length;
+        if(op->status == 0 && strcmp(op->operation, "transfer") == 0) {
+            length = snprintf(reply, SERVER_REPLY_BYTES, "OK\n");
+        } else if(op->status == 0) {
+            length = snprintf(reply, SERVER_REPLY_BYTES, "OK %" PRId64 "\n", op->balance);
+        } else if(op->status == BALANCE_INSUFFICIENT_FUNDS) {
+            length = snprintf(reply, SERVER_REPLY_BYTES, "ERR insufficient funds\n");
+        } else if(op->status == BALANCE_OVERFLOW) {
+            length = snprintf(reply, SERVER_REPLY_BYTES, "ERR balance limit\n");
+        } else if(op->status == OPERATION_MALFORMED) {
+            length = snprintf(reply, SERVER_REPLY_BYTES, "ERR malformed request\n");
+        } else {
+            length = snprintf(reply, SERVER_REPLY_BYTES, "ERR failed\n");
+        }
+        connection->output_length += (size_t)length;
+        connection->head = op->reply_next;
+        if(connection->head == NULL) {
+            connection->tail = NULL;
+        }
+        connection->queued--;
+        connection->server->served++;
+        operation_free(op);
+    }
+}
+
+// Function to read what a connection has sent into its input buffer;
+// returns -1 if the connection failed
+static int connection_read(Connection *connection) {
+    while(!connection->read_closed && connection->input_length < SERVER_BUFFER_BYTES) {
+        ssize_t got = recv(connection->fd, connection->input + connection->input_length,
+                           SERVER_BUFFER_BYTES - connection->input_length, 0);
+        if(got > 0) {
+            connection->input_length += (size_t)got;
+        } else if(got == 0) {
+            connection->read_closed = 1;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to send as much of a connection's output as the socket takes;
+// returns -1 if the connection failed
+static int connection_write(Connection *connection) {
+    while(connection->output_length > 0) {
+        ssize_t sent = send(connection->fd, connection->output + connection->output_start,
+                            connection->output_length, MSG_NOSIGNAL);
+        if(sent > 0) {
+            connection->output_start += (size_t)sent;
+            connection->output_length -= (size_t)sent;
+        } else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if(sent == 0 || errno != EINTR) {
+            return -1;
+        }
+    }
+    if(connection->output_length == 0) {
+        connection->output_start = 0;
+    }
+    return 0;
+}
+
+// Function to close a connection. Its replies are dropped; operations still
+// in the pool are freed as they complete, and the connection after them.
+static void connection_close(Connection *connection) {
+    Server *server = connection->server;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    connection->fd = -1;
+    UserOperation *op = connection->head;
+    while(op != NULL) {
+        UserOperation *next = op->reply_next;
+        if(op->ready || op == connection->stalled) {
+            operation_free(op);
+        }
+        op = next;
+    }
+    if(connection->stalled != NULL) {
+        connection->stalled = NULL;
+        server->stalled--;
+    }
+    connection->head = NULL;
+    connection->tail = NULL;
+    connection->queued = 0;
+    server_mark(server, connection);
+}
+
+// Function to unlink and free a closed connection with nothing running
+static void connection_free(Connection *connection) {
+    Server *server = connection->server;
+    if(connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if(connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    free(connection);
+}
+
+// Function to move a connection along: resubmit a stalled operation, queue
+// new requests, write finished replies and watch the socket for what it is
+// waiting on
+static void connection_service(Connection *connection) {
+    Server *server = connection->server;
+    if(connection->fd < 0) {
+        if(connection->running == 0) {
+            connection_free(connection);
+        }
+        return;
+    }
+    if(connection->stalled != NULL) {
+        connection_submit(connection, connection->stalled);
+    }
+    connection_reply(connection);
+    connection_parse(connection);
+    connection_reply(connection);
+    if(connection_write(connection) != 0) {
+        connection_close(connection);
+        return;
+    }
+    if(connection->read_closed && connection->head == NULL && connection->output_length == 0) {
+        connection_close(connection);
+        return;
+    }
+    uint32_t events = 0;
+    if(!connection->read_closed && connection->stalled == NULL && connection->queued < SERVER_MAX_PIPELINE &&
+       connection->input_length < SERVER_BUFFER_BYTES) {
+        events |= EPOLLIN;
+    }
+    if(connection->output_length > 0) {
+        events |= EPOLLOUT;
+    }
+    if(events != connection->events) {
+        struct epoll_event event = {.events = events, .data.ptr = connection};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
+    }
+}
+
+// Function to service every connection marked this round
+static void server_service(Server *server) {
+    while(server->service != NULL) {
+        Connection *connection = server->service;
+        server->service = connection->next_service;
+        connection->marked = 0;
+        connection_service(connection);
+    }
+}
+
+// Function to take back the operations the workers completed and mark their
+// connections, along with any that wait for room in the pool
+static void server_drain_completions(Server *server) {
+    // Reset the eventfd before taking the list, so a push after this wakes us again
+    uint64_t count;
+    ssize_t got = read(server->event_fd, &count, sizeof(count));
+    (void)got;
+    UserOperation *op = atomic_exchange_explicit(&server->completed, NULL, memory_order_acquire);
+    while(op != NULL) {
+        UserOperation *next = op->next;
+        Connection *connection = op->context;
+        operation_destroy(op);
+        connection->running--;
+        server->running--;
+        if(connection->fd < 0) {
+            operation_free(op);
+        } else {
+            op->ready = 1;
+        }
+        server_mark(server, connection);
+        op = next;
+    }
+    if(server->stalled > 0) {
+        for(Connection *connection = server->connections; connection != NULL; connection = connection->next) {
+            if(connection->stalled != NULL) {
+                server_mark(server, connection);
+            }
+        }
+    }
+}
+
+// Function to accept every pending connection
+static void server_accept(Server *server) {
+    for(;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Error accepting a connection.\n");
+            }
+            return;
+        }
+        // Replies are small and pipelined; do not hold them back (fails harmlessly on Unix sockets)
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Connection *connection = calloc(1, sizeof(Connection));
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        if(connection == NULL || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            printf("Error registering a connection.\n");
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->server = server;
+        connection->events = EPOLLIN;
+        connection->next = server->connections;
+        if(server->connections != NULL) {
+            server->connections->prev = connection;
+        }
+        server->connections = connection;
+    }
+}
+
+// Function to stop taking requests: close the listening socket, drop what
+// connections sent but the server has not queued, and fail stalled requests
+static void server_begin_shutdown(Server *server) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->listen_fd, NULL);
+    close(server->listen_fd);
+    server->listen_fd = -1;
+    for(Connection *connection = server->connections; connection != NULL; connection = connection->next) {
+        if(connection->fd < 0) {
+            continue;
+        }
+        connection->read_closed = 1;
+        connection->input_length = 0;
+        if(connection->stalled != NULL) {
+            connection->stalled->status = -1;
+            connection->stalled->ready = 1;
+            connection->stalled = NULL;
+            server->stalled--;
+        }
+        server_mark(server, connection);
+    }
+}
+
+// Function to open the non-blocking listening socket for "unix:PATH" or
+// [HOST:]PORT (HOST may be bracketed for IPv6); returns -1 on failure
+static int server_listen(Server *server, const char *address) {
+    if(strncmp(address, "unix:", 5) == 0) {
+        const char *path = address + 5;
+        struct sockaddr_un local = {.sun_family = AF_UNIX};
+        if(path[0] == '\0' || strlen(path) >= sizeof(local.sun_path)) {
+            printf("Invalid socket path: %s\n", path);
+            return -1;
+        }
+        strcpy(local.sun_path, path);
+        // A socket file left behind by an earlier run would fail the bind
+        unlink(path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd < 0 || bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            printf("Error listening on %s.\n", address);
+            if(fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        strcpy(server->unix_path, path);
+        return fd;
+    }
+    char host[256] = "";
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if(colon != NULL) {
+        size_t length = (size_t)(colon - address);
+        if(length >= sizeof(host)) {
+            printf("Invalid listen address: %s\n", address);
+            return -1;
+        }
+        memcpy(host, address, length);
+        host[length] = '\0';
+        port = colon + 1;
+        if(length >= 2 && host[0] == '[' && host[length - 1] == ']') {
+            host[length - 1] = '\0';
+            memmove(host, host + 1, length - 1);
+        }
+    }
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+    struct addrinfo *addresses;
+    if(getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &addresses) != 0) {
+        printf("Invalid listen address: %s\n", address);
+        return -1;
+    }
+    int fd = -1;
+    for(struct addrinfo *candidate = addresses; candidate != NULL; candidate = candidate->ai_next) {
+        fd = socket(candidate->ai_family, candidate->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, candidate->ai_protocol);
+        if(fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if(fd < 0) {
+        printf("Error listening on %s.\n", address);
+    }
+    return fd;
+}
+
+// Thread function that writes the central log reports SIGHUP asks for, so
+// the event loop never waits on one. Requests that arrive during a report
+// are answered together by the next; one still wanted at shutdown is
+// written before the thread exits.
+static void* server_reporter(void *arg) {
+    Server *server = arg;
+    pthread_mutex_lock(&server->report_lock);
+    for(;;) {
+        while(!server->report_wanted && !server->report_stop) {
+            pthread_cond_wait(&server->report_request, &server->report_lock);
+        }
+        if(!server->report_wanted) {
+            break;
+        }
+        server->report_wanted = 0;
+        pthread_mutex_unlock(&server->report_lock);
+        generate_central_log();
+        pthread_mutex_lock(&server->report_lock);
+    }
+    pthread_mutex_unlock(&server->report_lock);
+    return NULL;
+}
+
+// Function to hand a central log report to the reporter thread
+static void server_request_report(Server *server) {
+    pthread_mutex_lock(&server->report_lock);
+    server->report_wanted = 1;
+    pthread_cond_signal(&server->report_request);
+    pthread_mutex_unlock(&server->report_lock);
+}
+
+// Function to run the event loop until a shutdown signal, then until every
+// operation in the pool has come back
+static int server_loop(Server *server) {
+    struct epoll_event events[SERVER_EVENTS];
+    int stopping = 0;
+    while(!stopping || server->running > 0) {
+        int count = epoll_wait(server->epoll_fd, events, SERVER_EVENTS, -1);
+        if(count < 0 && errno == EINTR) {
+            continue;
+        }
+        if(count < 0) {
+            printf("Error waiting for server events.\n");
+            return -1;
+        }
+        for(int i = 0; i < count; i++) {
+            void *tag = events[i].data.ptr;
+            if(tag == &server->listen_fd) {
+                server_accept(server);
+            } else if(tag == &server->event_fd) {
+                server_drain_completions(server);
+            } else if(tag == &server->signal_fd) {
+                struct signalfd_siginfo info;
+                ssize_t got = read(server->signal_fd, &info, sizeof(info));
+                if(got == (ssize_t)sizeof(info) && info.ssi_signo == SIGHUP) {
+                    server_request_report(server);
+                } else if(!stopping) {
+                    printf("Shutting down the server.\n");
+                    stopping = 1;
+                    server_begin_shutdown(server);
+                }
+            } else {
+                Connection *connection = tag;
+                if(connection->fd < 0) {
+                    continue;
+                }
+                if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    connection_close(connection);
+                } else if((events[i].events & EPOLLIN) && connection_read(connection) != 0) {
+                    connection_close(connection);
+                }
+                server_mark(server, connection);
+            }
+        }
+        server_service(server);
+    }
+    return 0;
+}
+
+// Function to register one of the server's own descriptors with epoll,
+// tagged with the address of the field that holds it
+static int server_watch(Server *server, int *fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = fd};
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, *fd, &event);
+}
+
+// Function to serve operations on address until SIGINT or SIGTERM; SIGHUP
+// adds a central log report (see generate_central_log()), written off the
+// event loop by the reporter thread. The caller must
+// have blocked all three in every thread. Clients send request lines in
+// the --ingest format and may pipeline them; each request gets one reply
+// line, in request order:
+//   OK BALANCE | OK (transfers) | ERR insufficient funds |
+//   ERR balance limit | ERR malformed request | ERR failed
+// As with --ingest, the operations themselves run concurrently, so a client
+// that needs one request to see another's effect waits for its reply first.
+// The event loop only parses, queues and writes; the pool runs the
+// operations and hands them back through an eventfd as they complete. On
+// shutdown the server stops accepting and reading, waits for the operations
+// in flight and sends what replies it can without blocking.
+int run_server(WorkerPool *pool, const char *address) {
+    Server server = {.pool = pool, .epoll_fd = -1, .event_fd = -1, .signal_fd = -1,
+                     .report_lock = PTHREAD_MUTEX_INITIALIZER, .report_request = PTHREAD_COND_INITIALIZER};
+    atomic_init(&server.completed, NULL);
+    server.listen_fd = server_listen(&server, address);
+    if(server.listen_fd < 0) {
+        return -1;
+    }
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    int status = 0;
+    if(server.epoll_fd < 0 || server.event_fd < 0 || server.signal_fd < 0 ||
+       server_watch(&server, &server.listen_fd) != 0 || server_watch(&server, &server.event_fd) != 0 ||
+       server_watch(&server, &server.signal_fd) != 0 ||
+       pthread_create(&server.report_thread, NULL, server_reporter, &server) != 0) {
+        printf("Error starting the server.\n");
+        status = -1;
+    } else {
+        server.report_thread_started = 1;
+        printf("Listening on %s.\n", address);
+        fflush(stdout);
+        status = server_loop(&server);
+    }
+    // Workers may still hold operations if the loop failed; they need the eventfd
+    while(server.running > 0) {
+        usleep(1000);
+        server_drain_completions(&server);
+    }
+    if(server.report_thread_started) {
+        pthread_mutex_lock(&server.report_lock);
+        server.report_stop = 1;
+        pthread_cond_signal(&server.report_request);
+        pthread_mutex_unlock(&server.report_lock);
+        pthread_join(server.report_thread, NULL);
+    }
+    while(server.connections != NULL) {
+        Connection *connection = server.connections;
+        if(connection->fd >= 0) {
+            connection_close(connection);
+        }
+        connection_free(connection);
+    }
+    if(server.listen_fd >= 0) {
+        close(server.listen_fd);
+    }
+    if(server.unix_path[0] != '\0') {
+        unlink(server.unix_path);
+    }
+    if(server.signal_fd >= 0) {
+        close(server.signal_fd);
+    }
+    if(server.event_fd >= 0) {
+        close(server.event_fd);
+    }
+    if(server.epoll_fd >= 0) {
+        close(server.epoll_fd);
+    }
+    printf("Served %ld requests on %s.\n", server.served, address);
+    return status;
+}
+
+// Account updates done by each contention benchmark thread
+#define BENCH_CONTENTION_OPERATIONS 2000000
+
+// Distance, in account numbers, between the spread-out accounts in the
+// contention benchmark; far enough apart to never share a cache line
+#define BENCH_CONTENTION_STRIDE 16
+
+// One contention benchmark thread and the account it updates
+typedef struct {
+    pthread_t thread;
+    Account *account;
+} ContentionWorker;
+
+// Function to update one account in a loop, the way every operation touches
+// its account: take the lock, change the balance, release the lock
+static void* contention_worker(void *arg) {
+    ContentionWorker *worker = arg;
+    Account *account = worker->account;
+    for(long i = 0; i < BENCH_CONTENTION_OPERATIONS; i++) {
+        pthread_mutex_lock(&account->lock);
+        atomic_fetch_add_explicit(&account->balance, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&account->lock);
+    }
+    return NULL;
+}
+
+// Function to time thread_count threads, each updating its own account,
+// with the accounts stride numbers apart; returns updates per second
+static double contention_run(int thread_count, int stride) {
+    ContentionWorker *workers = calloc(thread_count, sizeof(ContentionWorker));
+    if(workers == NULL) {
+        printf("Error allocating benchmark threads.\n");
+        return -1;
+    }
+    for(int i = 0; i < thread_count; i++) {
+        workers[i].account = account_at(i * stride);
+    }
+    Timestamp start = timestamp_now();
+    for(int i = 0; i < thread_count; i++) {
+        pthread_create(&workers[i].thread, NULL, contention_worker, &workers[i]);
+    }
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    Timestamp elapsed = timestamp_now() - start;
+    free(workers);
+    return (double)thread_count * BENCH_CONTENTION_OPERATIONS * 1000000.0 / (double)(elapsed > 0 ? elapsed : 1);
+}
+
+// Function to measure false sharing between accounts: threads updating
+// adjacent accounts should run as fast as threads updating accounts far
+// apart. Runs in memory only; no account files or logs are written.
+static int run_contention_benchmark() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = bench_threads > 0 ? bench_threads : (cores > 1 ? (int)cores : 2);
+    char account_id[50];
+    for(int i = 0; i < thread_count * BENCH_CONTENTION_STRIDE; i++) {
+        sprintf(account_id, "bench-%d", i);
+        Account *account = get_account(account_id);
+        if(account == NULL) {
+            printf("Error creating benchmark account %s.\n", account_id);
+            return -1;
+        }
+        atomic_store(&account->balance_loaded, 1);
+    }
+    printf("Contention benchmark: %d threads, %d updates each, %zu-byte accounts\n",
+           thread_count, BENCH_CONTENTION_OPERATIONS, sizeof(Account));
+    double adjacent = contention_run(thread_count, 1);
+    double spread = contention_run(thread_count, BENCH_CONTENTION_STRIDE);
+    if(adjacent < 0 || spread < 0) {
+        return -1;
+    }
+    printf("  adjacent accounts:      %.2f M updates/s\n", adjacent / 1e6);
+    printf("  accounts %d apart:      %.2f M updates/s\n", BENCH_CONTENTION_STRIDE, spread / 1e6);
+    printf("  adjacent / spread:      %.2f\n", adjacent / spread);
+    return 0;
+}
+
+// Rounds of deltas the batch benchmark applies to its balances
+#define BENCH_BATCH_ROUNDS 2000
+
+// Function to time rounds of one batch kernel over a copy of balances;
+// returns deltas per second, leaving the final balances in result
+static double batch_apply_run(MoneyBatchKernel kernel, const Money balances[], const Money deltas[],
+                              size_t count, Money result[]) {
+    memcpy(result, balances, count * sizeof(Money));
+    Timestamp start = timestamp_now();
+    for(int round = 0; round < BENCH_BATCH_ROUNDS; round++) {
+        if(kernel.apply(result, deltas, count) != count) {
+            return -1;
+        }
+    }
+    Timestamp elapsed = timestamp_now() - start;
+    return (double)count * BENCH_BATCH_ROUNDS * 1000000.0 / (double)(elapsed > 0 ? elapsed : 1);
+}
+
+// Function to measure the batch kernel on an end-of-day style run over
+// --bench-accounts balances: interest credited to every account and a fee
+// debited from every other one, repeated BENCH_BATCH_ROUNDS times. The
+// selected kernel must end with the same balances as the scalar one, and a
+// run that would overdraw an account must be refused without changing any
+// balance. Runs in memory only.
+static int run_batch_benchmark() {
+    size_t count = (size_t)bench_accounts;
+    Money *balances = malloc(count * sizeof(Money));
+    Money *deltas = malloc(count * sizeof(Money));
+    Money *scalar_result = malloc(count * sizeof(Money));
+    Money *kernel_result = malloc(count * sizeof(Money));
+    if(balances == NULL || deltas == NULL || scalar_result == NULL || kernel_result == NULL) {
+        printf("Error allocating benchmark balances.\n");
+        free(balances);
+        free(deltas);
+        free(scalar_result);
+        free(kernel_result);
+        return -1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        balances[i] = (Money)(thread_random() % 100000000) + 100000;
+        deltas[i] = balances[i] / 10000 - (i % 2 == 0 ? 25 : 0);
+    }
+    MoneyBatchKernel scalar = {"scalar", money_batch_apply_scalar};
+    MoneyBatchKernel kernel = money_batch_kernel();
+    printf("Batch benchmark: %zu balances, %d rounds, %s kernel\n", count, BENCH_BATCH_ROUNDS, kernel.name);
+    double scalar_rate = batch_apply_run(scalar, balances, deltas, count, scalar_result);
+    double kernel_rate = batch_apply_run(kernel, balances, deltas, count, kernel_result);
+    int status = 0;
+    if(scalar_rate < 0 || kernel_rate < 0 || memcmp(scalar_result, kernel_result, count * sizeof(Money)) != 0) {
+        printf("Batch kernels disagree.\n");
+        status = -1;
+    }
+    
+    // Overdraw the last account: the run must fail there and leave every balance as it was
+    memcpy(kernel_result, balances, count * sizeof(Money));
+    deltas[count - 1] = -balances[count - 1] - 1;
+    size_t failed = 0;
+    if(money_apply_batch(kernel_result, deltas, count, &failed) != BALANCE_INSUFFICIENT_FUNDS ||
+       failed != count - 1 || memcmp(kernel_result, balances, count * sizeof(Money)) != 0) {
+        printf("Batch kernel did not refuse an overdrawing run.\n");
+        status = -1;
+    }
+    if(status == 0) {
+        char label[32];
+        printf("  %-24s%.2f M deltas/s\n", "scalar:", scalar_rate / 1e6);
+        snprintf(label, sizeof(label), "%s:", kernel.name);
+        printf("  %-24s%.2f M deltas/s\n", label, kernel_rate / 1e6);
+        snprintf(label, sizeof(label), "%s / scalar:", kernel.name);
+        printf("  %-24s%.2f\n", label, kernel_rate / scalar_rate);
+    }
+    free(balances);
+    free(deltas);
+    free(scalar_result);
+    free(kernel_result);
+    return status;
+}
+
+// Operations the workload benchmark mixes
+typedef enum {
+    BENCH_TRANSFER,
+    BENCH_DEPOSIT,
+    BENCH_WITHDRAW,
+    BENCH_VIEW_BALANCE,
+    BENCH_OP_COUNT
+} BenchOp;
 
-// Name of the transaction log file
-#define TRANSACTION_LOG "transactions.log"
+static const char *const bench_op_names[BENCH_OP_COUNT] = {"transfer", "deposit", "withdraw", "view_balance"};
 
-// Structure representing an account
+// Zipfian generator over account ranks 0..n-1 (Gray et al., as used by
+// YCSB); rank 0 is the hottest account. theta 0 gives a uniform choice.
 typedef struct {
-    char account_id[50];
-    pthread_mutex_t lock;
-} Account;
-
-// Array of accounts
-Account accounts[MAX_ACCOUNTS];
-int account_count = 0;
+    int n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+    double half_pow_theta;
+} ZipfGenerator;
 
-// Mutex for managing the accounts array
-pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+// Function to prepare a Zipfian generator; O(n) once
+static void zipf_init(ZipfGenerator *zipf, int n, double theta) {
+    zipf->n = n;
+    zipf->theta = theta;
+    if(theta <= 0) {
+        return;
+    }
+    double zetan = 0;
+    for(int i = 1; i <= n; i++) {
+        zetan += 1.0 / pow((double)i, theta);
+    }
+    double zeta2 = 1.0 + pow(0.5, theta);
+    zipf->zetan = zetan;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    zipf->half_pow_theta = pow(0.5, theta);
+}
 
-// Mutex for the transaction log
-pthread_mutex_t transaction_log_lock = PTHREAD_MUTEX_INITIALIZER;
+// Function to draw an account rank
+static int zipf_next(const ZipfGenerator *zipf) {
+    if(zipf->theta <= 0) {
+        return (int)(thread_random() % (uint64_t)zipf->n);
+    }
+    double u = (double)(thread_random() >> 11) * 0x1.0p-53;
+    double uz = u * zipf->zetan;
+    if(uz < 1.0) {
+        return 0;
+    }
+    if(uz < 1.0 + zipf->half_pow_theta) {
+        return 1;
+    }
+    int rank = (int)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
 
-// Path to the central transaction log
-char central_transaction_log[100] = ACCOUNTS_DIR "/" TRANSACTION_LOG;
+// One workload benchmark thread and the latencies it measured
+typedef struct {
+    pthread_t thread;
+    const ZipfGenerator *zipf;
+    const AccountHandle *handles;
+    WorkerPool *pool;           // The sharded engine, if the benchmark runs on it
+    uint64_t deadline;
+    LatencyHistogram latencies[BENCH_OP_COUNT];
+} WorkloadWorker;
 
-// Function to get the file path for an account
-void get_account_filepath(const char *account_id, char *filepath) {
-    sprintf(filepath, "%s/%s.txt", ACCOUNTS_DIR, account_id);
+// Function to run one benchmark operation through the sharded engine and
+// wait for it
+static void workload_submit(WorkerPool *pool, BenchOp op, AccountHandle account, AccountHandle target, Money amount) {
+    UserOperation operation = {0};
+    strcpy(operation.operation, bench_op_names[op]);
+    operation.account = account_from_handle(account);
+    operation.target = op == BENCH_TRANSFER ? account_from_handle(target) : NULL;
+    strcpy(operation.user_id, account_name(operation.account));
+    operation.amount = amount;
+    pool_submit(pool, &operation);
+    operation_wait(&operation);
+    operation_destroy(&operation);
 }
 
-// Function to retrieve or create an account
-Account* get_account(const char *account_id) {
-    pthread_mutex_lock(&global_lock);
-    for(int i = 0; i < account_count; i++) {
-        if(strcmp(accounts[i].account_id, account_id) == 0) {
-            pthread_mutex_unlock(&global_lock);
-            return &accounts[i];
+// Function to run the configured operation mix until the deadline
+static void* workload_worker(void *arg) {
+    WorkloadWorker *worker = arg;
+    while(monotonic_ns() < worker->deadline) {
+        int pick = (int)(thread_random() % 100);
+        BenchOp op = BENCH_TRANSFER;
+        while(op < BENCH_VIEW_BALANCE && pick >= bench_mix[op]) {
+            pick -= bench_mix[op];
+            op++;
         }
+        AccountHandle account = worker->handles[zipf_next(worker->zipf)];
+        int amount = 1 + (int)(thread_random() % BENCH_MAX_AMOUNT);
+        uint64_t start = monotonic_ns();
+        if(worker->pool != NULL) {
+            AccountHandle target = op == BENCH_TRANSFER ? worker->handles[zipf_next(worker->zipf)] : account;
+            workload_submit(worker->pool, op, account, target, amount);
+            latency_record(&worker->latencies[op], monotonic_ns() - start);
+            continue;
+        }
+        switch(op) {
+        case BENCH_TRANSFER: {
+            AccountHandle target = worker->handles[zipf_next(worker->zipf)];
+            transfer_handle(account, target, amount);
+            break;
+        }
+        case BENCH_DEPOSIT:
+            deposit_handle(account, amount);
+            break;
+        case BENCH_WITHDRAW:
+            withdraw_handle(account, amount);
+            break;
+        default:
+            view_balance_handle(account);
+            break;
+        }
+        latency_record(&worker->latencies[op], monotonic_ns() - start);
     }
-    // If account does not exist, create it
-    if(account_count < MAX_ACCOUNTS) {
-        strcpy(accounts[account_count].account_id, account_id);
-        pthread_mutex_init(&accounts[account_count].lock, NULL);
-        account_count++;
-        pthread_mutex_unlock(&global_lock);
-        return &accounts[account_count-1];
-    }
-    pthread_mutex_unlock(&global_lock);
     return NULL;
 }
 
-// Function to read the balance of an account
-int read_balance(const char *account_id, int *balance) {
-    char filepath[100];
-    get_account_filepath(account_id, filepath);
-    FILE *file = fopen(filepath, "r");
-    if(file == NULL) {
-        printf("Account %s does not exist.\n", account_id);
+// Function to run the workload benchmark: bench_threads threads issue the
+// bench_mix of operations against bench_accounts accounts, picked with
+// bench_skew, for bench_seconds, through the engine as configured (balance
+// store, WAL, durability policy, transaction log and, with shard_count set,
+// the sharded engine, which the threads then submit to). Operation messages
+// are discarded while it runs; throughput and latency percentiles for each
+// operation type are printed at the end.
+static int run_workload_benchmark() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = bench_threads > 0 ? bench_threads : (cores > 0 ? (int)cores : 1);
+    AccountHandle *handles = malloc((size_t)bench_accounts * sizeof(AccountHandle));
+    WorkloadWorker *workers = calloc(thread_count, sizeof(WorkloadWorker));
+    if(handles == NULL || workers == NULL) {
+        printf("Error allocating the workload benchmark.\n");
+        free(handles);
+        free(workers);
         return -1;
     }
-    if(fscanf(file, "%d", balance) != 1) {
-        printf("Invalid balance format for account %s.\n", account_id);
-        fclose(file);
-        return -1;
+    ZipfGenerator zipf;
+    zipf_init(&zipf, bench_accounts, bench_skew);
+    
+    // Keep per-operation results off the terminal while the benchmark runs
+    ConsoleMode saved_console_mode = console_mode;
+    console_mode = CONSOLE_OFF;
+    
+    int status = 0;
+    char account_id[50];
+    for(int i = 0; i < bench_accounts && status == 0; i++) {
+        sprintf(account_id, "bench-%d", i);
+        create_account(account_id, BENCH_INITIAL_BALANCE);
+        handles[i] = account_handle(account_id);
+        if(handles[i] == INVALID_ACCOUNT_HANDLE) {
+            status = -1;
+        }
+    }
+    WorkerPool pool;
+    if(status == 0 && shard_count > 0 && pool_start_sharded(&pool, shard_count, queue_depth) != 0) {
+        status = -1;
+    }
+    int sharded = status == 0 && shard_count > 0;
+    uint64_t start = monotonic_ns();
+    int started = 0;
+    for(; status == 0 && started < thread_count; started++) {
+        workers[started].zipf = &zipf;
+        workers[started].handles = handles;
+        workers[started].pool = sharded ? &pool : NULL;
+        workers[started].deadline = start + (uint64_t)bench_seconds * 1000000000u;
+        if(pthread_create(&workers[started].thread, NULL, workload_worker, &workers[started]) != 0) {
+            status = -1;
+            break;
+        }
+    }
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (double)(monotonic_ns() - start) / 1e9;
+    if(sharded) {
+        pool_stop(&pool);
     }
-    fclose(file);
-    return 0;
-}
-
-// Function to write the balance to an account file atomically
-int write_balance_atomic(const char *account_id, int new_balance) {
-    char filepath[100];
-    char temp_filepath[150];
-    get_account_filepath(account_id, filepath);
-    sprintf(temp_filepath, "%s.tmp", filepath);
     
-    FILE *temp_file = fopen(temp_filepath, "w");
-    if(temp_file == NULL) {
-        printf("Error opening temporary file for account %s.\n", account_id);
+    console_mode = saved_console_mode;
+    if(status != 0) {
+        printf("Workload benchmark failed to start.\n");
+        free(handles);
+        free(workers);
         return -1;
     }
-    fprintf(temp_file, "%d\n", new_balance);
-    fclose(temp_file);
     
-    // Replace the original file with the temporary file
-    if(rename(temp_filepath, filepath) != 0) {
-        printf("Error replacing file for account %s.\n", account_id);
-        unlink(temp_filepath);
-        return -1;
+    printf("Workload benchmark: %d accounts, %d threads, %d shards, %.1f s, skew %.2f, mix %d/%d/%d/%d\n",
+           bench_accounts, thread_count, shard_count, elapsed, bench_skew,
+           bench_mix[BENCH_TRANSFER], bench_mix[BENCH_DEPOSIT], bench_mix[BENCH_WITHDRAW], bench_mix[BENCH_VIEW_BALANCE]);
+    printf("  %-14s %12s %12s %10s %10s %10s\n", "operation", "count", "ops/s", "p50 us", "p99 us", "p999 us");
+    LatencyHistogram total = {{0}, 0};
+    for(int op = 0; op <= BENCH_OP_COUNT; op++) {
+        LatencyHistogram merged = {{0}, 0};
+        if(op < BENCH_OP_COUNT) {
+            for(int i = 0; i < thread_count; i++) {
+                latency_merge(&merged, &workers[i].latencies[op]);
+            }
+            latency_merge(&total, &merged);
+        } else {
+            merged = total;
+        }
+        if(merged.total == 0 && op < BENCH_OP_COUNT) {
+            continue;
+        }
+        printf("  %-14s %12llu %12.0f %10.1f %10.1f %10.1f\n", op < BENCH_OP_COUNT ? bench_op_names[op] : "all",
+               (unsigned long long)merged.total, (double)merged.total / elapsed,
+               latency_percentile(&merged, 0.50) / 1e3, latency_percentile(&merged, 0.99) / 1e3,
+               latency_percentile(&merged, 0.999) / 1e3);
     }
+    free(handles);
+    free(workers);
     return 0;
 }
 
-// Function to log transactions atomically
-void log_transaction_atomic(const char *operation_type, const char *user_id, const char *details, const char *status) {
-    pthread_mutex_lock(&transaction_log_lock);
-    FILE *log_file = fopen(central_transaction_log, "a");
-    if(log_file == NULL) {
-        printf("Error opening transaction log file.\n");
-        pthread_mutex_unlock(&transaction_log_lock);
-        return;
+// Initial balance of stress benchmark accounts, low enough next to
+// BENCH_MAX_AMOUNT that withdrawals and transfers regularly overdraw
+#define STRESS_INITIAL_BALANCE 500
+
+// Transfers in each stress benchmark transfer_batch() call; one transfer in
+// eight goes through a batch instead of on its own
+#define STRESS_BATCH_TRANSFERS 4
+
+// Returned by stress_fork_backends() in the child processes
+#define STRESS_CHILD -2
+
+// Runs of the stress benchmark killed with SIGKILL before the one that
+// recovers from them, and the longest each runs, in milliseconds
+#define STRESS_CRASH_ROUNDS 6
+#define STRESS_CRASH_MAX_MS 600
+
+// Operations finished by the stress benchmark, watched for progress
+static _Atomic uint64_t stress_progress = 0;
+
+// Operations each stress benchmark run is to do (0 runs until the
+// deadline), and how many its threads have taken on so far
+static uint64_t stress_operations = 0;
+static _Atomic uint64_t stress_claimed = 0;
+
+// Operations every stress benchmark run has done, shared with the child
+// processes (see stress_fork_backends())
+static _Atomic uint64_t *stress_total = NULL;
+
+// Set in a stress benchmark process that is going to be killed: it only
+// transfers, checkpoints constantly and runs until the kill. stress_crashes
+// counts the kills the next run recovers from.
+static int stress_crash_mode = 0;
+static int stress_crashes = 0;
+
+// One stress benchmark thread and what its committed operations added up to
+typedef struct {
+    pthread_t thread;
+    const ZipfGenerator *zipf;
+    const AccountHandle *handles;
+    WorkerPool *pool;           // The sharded engine, if the benchmark runs on it
+    uint64_t deadline;
+    uint64_t operations;
+    uint64_t refused;           // Operations that did not commit (overdrafts, transfers to self...)
+    Money deposited;
+    Money withdrawn;
+    int negative;               // Set if a balance was ever seen below zero
+} StressWorker;
+
+// Function to run one stress benchmark operation through the sharded
+// engine; returns its status
+static int stress_submit(WorkerPool *pool, BenchOp op, AccountHandle account, AccountHandle target, Money amount,
+                         Money *balance) {
+    UserOperation operation = {0};
+    strcpy(operation.operation, bench_op_names[op]);
+    operation.account = account_from_handle(account);
+    operation.target = op == BENCH_TRANSFER ? account_from_handle(target) : NULL;
+    strcpy(operation.user_id, account_name(operation.account));
+    operation.amount = amount;
+    pool_submit(pool, &operation);
+    operation_wait(&operation);
+    int status = operation.status;
+    *balance = operation.balance;
+    operation_destroy(&operation);
+    return status;
+}
+
+// Function to run one stress benchmark operation directly on the engine;
+// returns its status
+static int stress_apply(StressWorker *worker, BenchOp op, AccountHandle handle, Money amount, Money *balance) {
+    Account *account = account_from_handle(handle);
+    *balance = 0;
+    switch(op) {
+    case BENCH_TRANSFER: {
+        if(thread_random() % 8 != 0) {
+            Account *target = account_from_handle(worker->handles[zipf_next(worker->zipf)]);
+            return transfer_accounts(account, target, amount, TRANSFER_LOCK_ACCOUNTS | TRANSFER_LOG_RECEIPT);
+        }
+        // A batch that moves money around a ring of accounts
+        TransferRequest transfers[STRESS_BATCH_TRANSFERS];
+        int results[STRESS_BATCH_TRANSFERS];
+        for(int i = 0; i < STRESS_BATCH_TRANSFERS; i++) {
+            Account *from = account_from_handle(worker->handles[zipf_next(worker->zipf)]);
+            Account *to = account_from_handle(worker->handles[zipf_next(worker->zipf)]);
+            transfers[i] = (TransferRequest){account_name(from), account_name(to), 1 + (Money)(thread_random() % BENCH_MAX_AMOUNT)};
+        }
+        return transfer_batch(transfers, STRESS_BATCH_TRANSFERS, results) == STRESS_BATCH_TRANSFERS ? 0 : -1;
+    }
+    case BENCH_DEPOSIT:
+        return deposit_account(account, amount, balance);
+    case BENCH_WITHDRAW:
+        return withdraw_account(account, amount, balance);
+    default:
+        return view_account_balance(account, balance);
     }
-    // Get current time
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestamp[20];
-    strftime(timestamp, sizeof(timestamp)-1, "%Y-%m-%d %H:%M:%S", t);
-    
-    fprintf(log_file, "%s | %s | %s | %s | %s\n", timestamp, operation_type, user_id, details, status);
-    fclose(log_file);
-    pthread_mutex_unlock(&transaction_log_lock);
 }
 
-// Function to create a new account
-void create_account(const char *account_id, int initial_balance) {
-    Account *account = get_account(account_id);
-    if(account == NULL) {
-        printf("Error creating account %s.\n", account_id);
-        log_transaction_atomic("Create Account", account_id, "Initial balance", "Failed");
-        return;
+// Function to run random operations until the deadline, keeping count of
+// the money deposits and withdrawals actually moved
+static void* stress_worker(void *arg) {
+    StressWorker *worker = arg;
+    while(stress_crash_mode || stress_operations == 0
+          ? monotonic_ns() < worker->deadline
+          : atomic_fetch_add_explicit(&stress_claimed, 1, memory_order_relaxed) < stress_operations) {
+        int pick = (int)(thread_random() % 100);
+        BenchOp op = BENCH_TRANSFER;
+        while(!stress_crash_mode && op < BENCH_VIEW_BALANCE && pick >= bench_mix[op]) {
+            pick -= bench_mix[op];
+            op++;
+        }
+        AccountHandle account = worker->handles[zipf_next(worker->zipf)];
+        Money amount = 1 + (Money)(thread_random() % BENCH_MAX_AMOUNT);
+        Money balance;
+        int status;
+        if(worker->pool != NULL) {
+            AccountHandle target = op == BENCH_TRANSFER ? worker->handles[zipf_next(worker->zipf)] : account;
+            status = stress_submit(worker->pool, op, account, target, amount, &balance);
+        } else {
+            status = stress_apply(worker, op, account, amount, &balance);
+        }
+        if(status != 0) {
+            worker->refused++;
+        } else if(op == BENCH_DEPOSIT) {
+            worker->deposited += amount;
+        } else if(op == BENCH_WITHDRAW) {
+            worker->withdrawn += amount;
+        }
+        if(balance < 0) {
+            worker->negative = 1;
+        }
+        worker->operations++;
+        atomic_fetch_add_explicit(&stress_progress, 1, memory_order_relaxed);
     }
-    
-    pthread_mutex_lock(&account->lock);
-    char filepath[100];
-    get_account_filepath(account_id, filepath);
-    
-    // Check if account file already exists
-    FILE *file = fopen(filepath, "r");
-    if(file != NULL) {
-        printf("Account %s already exists.\n", account_id);
-        fclose(file);
-        pthread_mutex_unlock(&account->lock);
-        log_transaction_atomic("Create Account", account_id, "Initial balance", "Failed");
-        return;
+    return NULL;
+}
+
+// Thread function that ends the process if the stress benchmark stops
+// making progress for bench_timeout seconds, which means a deadlock or a
+// lost wakeup. It runs until the process exits, so shutting the engine
+// down has to finish in time too (see run_stress_benchmark()).
+static void* stress_watchdog(void *arg) {
+    (void)arg;
+    uint64_t seen = atomic_load(&stress_progress);
+    int idle = 0;
+    for(;;) {
+        sleep(1);
+        uint64_t progress = atomic_load(&stress_progress);
+        idle = progress == seen ? idle + 1 : 0;
+        seen = progress;
+        if(idle >= bench_timeout) {
+            printf("  no progress for %d s on %s: deadlocked\n", bench_timeout, balance_store->name);
+            fflush(stdout);
+            _exit(1);
+        }
     }
-    
-    // Write initial balance atomically
-    if(write_balance_atomic(account_id, initial_balance) == 0) {
-        printf("Account %s created with initial balance %d.\n", account_id, initial_balance);
-        log_transaction_atomic("Create Account", account_id, "Initial balance", "Success");
-    } else {
-        printf("Failed to create account %s.\n", account_id);
-        log_transaction_atomic("Create Account", account_id, "Initial balance", "Failed");
+    return NULL;
+}
+
+// Function to check the balances recovered after the stress benchmark runs
+// killed mid-run: those runs only transfer, so every account they created
+// must be there and the balances must still add up to the initial funds.
+// Returns the recovered total, or -1 if it is wrong.
+static Money stress_check_recovery() {
+    Money total = 0;
+    int recovered = 0;
+    int count = atomic_load(&account_count);
+    for(int i = 0; i < count; i++) {
+        Account *account = account_at(i);
+        if(atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+            total += atomic_load(&account->balance);
+            recovered++;
+        }
     }
-    pthread_mutex_unlock(&account->lock);
+    Money expected = (Money)recovered * STRESS_INITIAL_BALANCE;
+    printf("  recovered %d accounts after %d crashes: total %" PRId64 ", expected %" PRId64 ", book total %" PRId64 "\n",
+           recovered, stress_crashes, total, expected, book_total());
+    if(total != expected || book_total() != expected) {
+        printf("  money was not conserved across the crashes\n");
+        return -1;
+    }
+    return total;
 }
 
-// Function to transfer funds atomically
-void transfer(const char *from_account_id, const char *to_account_id, int amount) {
-    if(strcmp(from_account_id, to_account_id) == 0) {
-        printf("Cannot transfer to the same account.\n");
-        log_transaction_atomic("Transfer", from_account_id, "Attempted to transfer to self", "Failed");
-        return;
+// Function to run the stress benchmark on the engine as configured:
+// bench_threads threads (default two per core) issue random transfers,
+// transfer batches, deposits, withdrawals and balance views against
+// bench_accounts accounts, stress_operations of them in all (or for
+// bench_seconds if that is 0), under a watchdog. Afterwards
+// every balance must be non-negative and their sum, like the book total,
+// must equal what the committed deposits and withdrawals left. Returns -1
+// on any failure, including throughput below bench_min_ops or money lost
+// or made by the crashes before it (see stress_fork_backends()).
+static int run_stress_benchmark() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = bench_threads > 0 ? bench_threads : (cores > 1 ? 2 * (int)cores : 4);
+    AccountHandle *handles = malloc((size_t)bench_accounts * sizeof(AccountHandle));
+    StressWorker *workers = calloc(thread_count, sizeof(StressWorker));
+    if(handles == NULL || workers == NULL) {
+        printf("Error allocating the stress benchmark.\n");
+        free(handles);
+        free(workers);
+        return -1;
     }
-    
-    // Order accounts to prevent deadlock
-    const char *first, *second;
-    if(strcmp(from_account_id, to_account_id) < 0) {
-        first = from_account_id;
-        second = to_account_id;
-    } else {
-        first = to_account_id;
-        second = from_account_id;
+    ZipfGenerator zipf;
+    zipf_init(&zipf, bench_accounts, bench_skew);
+    pthread_t watchdog;
+    if(!stress_crash_mode && pthread_create(&watchdog, NULL, stress_watchdog, NULL) != 0) {
+        printf("Error starting the stress benchmark watchdog.\n");
+        free(handles);
+        free(workers);
+        return -1;
+    }
+    if(!stress_crash_mode) {
+        pthread_detach(watchdog);
+    }
+    Money expected = stress_crashes > 0 ? stress_check_recovery() : 0;
+    if(expected < 0) {
+        free(handles);
+        free(workers);
+        return -1;
     }
     
-    Account *first_account = get_account(first);
-    Account *second_account = get_account(second);
+    ConsoleMode saved_console_mode = console_mode;
+    console_mode = CONSOLE_OFF;
     
-    if(first_account == NULL || second_account == NULL) {
-        printf("One or both accounts (%s or %s) do not exist.\n", from_account_id, to_account_id);
-        log_transaction_atomic("Transfer", from_account_id, "One or both accounts do not exist", "Failed");
-        return;
+    // Accounts that survived the crashes are used as they are
+    int status = 0;
+    char account_id[50];
+    for(int i = 0; i < bench_accounts && status == 0; i++) {
+        sprintf(account_id, "stress-%d", i);
+        handles[i] = account_handle(account_id);
+        Account *account = account_from_handle(handles[i]);
+        if(account == NULL || !atomic_load_explicit(&account->balance_loaded, memory_order_acquire)) {
+            handles[i] = create_account(account_id, STRESS_INITIAL_BALANCE);
+            expected += STRESS_INITIAL_BALANCE;
+        }
+        if(handles[i] == INVALID_ACCOUNT_HANDLE) {
+            status = -1;
+        }
+        atomic_fetch_add_explicit(&stress_progress, 1, memory_order_relaxed);
     }
-    
-    // Lock both accounts in order
-    pthread_mutex_lock(&first_account->lock);
-    pthread_mutex_lock(&second_account->lock);
-    
-    int balance_from, balance_to;
-    if(read_balance(from_account_id, &balance_from) != 0 ||
-       read_balance(to_account_id, &balance_to) != 0) {
-        printf("Error reading account balances.\n");
-        log_transaction_atomic("Transfer", from_account_id, "Reading balances failed", "Failed");
-        pthread_mutex_unlock(&second_account->lock);
-        pthread_mutex_unlock(&first_account->lock);
-        return;
+    WorkerPool pool;
+    if(status == 0 && shard_count > 0 && pool_start_sharded(&pool, shard_count, queue_depth) != 0) {
+        status = -1;
     }
-    
-    if(balance_from < amount) {
-        printf("Transfer failed: Insufficient funds in account %s. Current balance: %d\n", from_account_id, balance_from);
-        log_transaction_atomic("Transfer", from_account_id, "Insufficient funds", "Failed");
-        pthread_mutex_unlock(&second_account->lock);
-        pthread_mutex_unlock(&first_account->lock);
-        return;
+    int sharded = status == 0 && shard_count > 0;
+    uint64_t start = monotonic_ns();
+    int started = 0;
+    for(; status == 0 && started < thread_count; started++) {
+        workers[started].zipf = &zipf;
+        workers[started].handles = handles;
+        workers[started].pool = sharded ? &pool : NULL;
+        workers[started].deadline = stress_crash_mode ? UINT64_MAX : start + (uint64_t)bench_seconds * 1000000000u;
+        if(pthread_create(&workers[started].thread, NULL, stress_worker, &workers[started]) != 0) {
+            status = -1;
+            break;
+        }
     }
-    
-    int new_balance_from = balance_from - amount;
-    int new_balance_to = balance_to + amount;
-    
-    // Write new balances atomically
-    if(write_balance_atomic(from_account_id, new_balance_from) == 0 &&
-       write_balance_atomic(to_account_id, new_balance_to) == 0) {
-        printf("Transferred %d from %s to %s.\n", amount, from_account_id, to_account_id);
-        log_transaction_atomic("Transfer", from_account_id, "Transfer successful", "Success");
-        log_transaction_atomic("Transfer", to_account_id, "Transfer received", "Success");
-    } else {
-        // Rollback in case of failure
-        write_balance_atomic(from_account_id, balance_from);
-        write_balance_atomic(to_account_id, balance_to);
-        printf("Transfer from %s to %s failed and has been rolled back.\n", from_account_id, to_account_id);
-        log_transaction_atomic("Transfer", from_account_id, "Transfer failed and rolled back", "Failed");
-        log_transaction_atomic("Transfer", to_account_id, "Transfer failed and rolled back", "Failed");
+    for(int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
     }
-    
-    pthread_mutex_unlock(&second_account->lock);
-    pthread_mutex_unlock(&first_account->lock);
-}
-
-// Function to deposit funds into an account
-void deposit(const char *account_id, int amount) {
-    Account *account = get_account(account_id);
-    if(account == NULL) {
-        printf("Deposit failed: Account %s does not exist.\n", account_id);
-        log_transaction_atomic("Deposit", account_id, "Account does not exist", "Failed");
-        return;
+    double elapsed = (double)(monotonic_ns() - start) / 1e9;
+    if(sharded) {
+        pool_stop(&pool);
     }
-    
-    pthread_mutex_lock(&account->lock);
-    int balance;
-    if(read_balance(account_id, &balance) != 0) {
-        printf("Error reading balance for account %s.\n", account_id);
-        log_transaction_atomic("Deposit", account_id, "Reading balance failed", "Failed");
-        pthread_mutex_unlock(&account->lock);
-        return;
+    console_mode = saved_console_mode;
+    if(status != 0) {
+        printf("Stress benchmark failed to start on %s.\n", balance_store->name);
+        free(handles);
+        free(workers);
+        return -1;
     }
     
-    int new_balance = balance + amount;
-    if(write_balance_atomic(account_id, new_balance) == 0) {
-        printf("Deposited %d to account %s. New balance: %d\n", amount, account_id, new_balance);
-        log_transaction_atomic("Deposit", account_id, "Deposit successful", "Success");
-    } else {
-        printf("Failed to deposit %d to account %s.\n", amount, account_id);
-        log_transaction_atomic("Deposit", account_id, "Deposit failed", "Failed");
+    uint64_t operations = 0, refused = 0;
+    int negative = 0;
+    for(int i = 0; i < thread_count; i++) {
+        operations += workers[i].operations;
+        refused += workers[i].refused;
+        expected += workers[i].deposited - workers[i].withdrawn;
+        negative |= workers[i].negative;
     }
-    pthread_mutex_unlock(&account->lock);
-}
-
-// Function to withdraw funds from an account
-void withdraw(const char *account_id, int amount) {
-    Account *account = get_account(account_id);
-    if(account == NULL) {
-        printf("Withdrawal failed: Account %s does not exist.\n", account_id);
-        log_transaction_atomic("Withdraw", account_id, "Account does not exist", "Failed");
-        return;
+    Money total = 0;
+    for(int i = 0; i < bench_accounts; i++) {
+        Money balance = atomic_load(&account_from_handle(handles[i])->balance);
+        negative |= balance < 0;
+        total += balance;
     }
-    
-    pthread_mutex_lock(&account->lock);
-    int balance;
-    if(read_balance(account_id, &balance) != 0) {
-        printf("Error reading balance for account %s.\n", account_id);
-        log_transaction_atomic("Withdraw", account_id, "Reading balance failed", "Failed");
-        pthread_mutex_unlock(&account->lock);
-        return;
+    double rate = (double)operations / elapsed;
+    printf("Stress benchmark on %s: %d accounts, %d threads, %d shards, %.1f s, skew %.2f\n",
+           balance_store->name, bench_accounts, thread_count, shard_count, elapsed, bench_skew);
+    printf("  %" PRIu64 " operations (%" PRIu64 " refused), %.0f ops/s\n", operations, refused, rate);
+    if(stress_total != NULL) {
+        atomic_fetch_add(stress_total, operations);
     }
-    
-    if(balance < amount) {
-        printf("Withdrawal failed: Insufficient funds in account %s. Current balance: %d\n", account_id, balance);
-        log_transaction_atomic("Withdraw", account_id, "Insufficient funds", "Failed");
-        pthread_mutex_unlock(&account->lock);
-        return;
+    printf("  total %" PRId64 ", expected %" PRId64 ", book total %" PRId64 "\n", total, expected, book_total());
+    if(total != expected || book_total() != expected) {
+        printf("  money was not conserved\n");
+        status = -1;
     }
-    
-    int new_balance = balance - amount;
-    if(write_balance_atomic(account_id, new_balance) == 0) {
-        printf("Withdrew %d from account %s. New balance: %d\n", amount, account_id, new_balance);
-        log_transaction_atomic("Withdraw", account_id, "Withdrawal successful", "Success");
-    } else {
-        printf("Failed to withdraw %d from account %s.\n", amount, account_id);
-        log_transaction_atomic("Withdraw", account_id, "Withdrawal failed", "Failed");
+    if(negative) {
+        printf("  a balance went below zero\n");
+        status = -1;
     }
-    pthread_mutex_unlock(&account->lock);
+    if(bench_min_ops > 0 && rate < bench_min_ops) {
+        printf("  throughput is below the required %ld ops/s\n", bench_min_ops);
+        status = -1;
+    }
+    atomic_fetch_add(&stress_progress, 1);
+    free(handles);
+    free(workers);
+    return status;
 }
 
-// Function to view the balance of an account
-void view_balance(const char *account_id) {
-    Account *account = get_account(account_id);
-    if(account == NULL) {
-        printf("View balance failed: Account %s does not exist.\n", account_id);
-        log_transaction_atomic("View Balance", account_id, "Account does not exist", "Failed");
-        return;
+// Function to check, once the engine is shut down, that the balance store
+// holds the balance every stress benchmark account ended with. The memory
+// store keeps nothing to check.
+static int stress_check_store() {
+    if(balance_store == &memory_balance_store) {
+        return 0;
     }
-    
-    pthread_mutex_lock(&account->lock);
-    int balance;
-    if(read_balance(account_id, &balance) != 0) {
-        printf("Error reading balance for account %s.\n", account_id);
-        log_transaction_atomic("View Balance", account_id, "Reading balance failed", "Failed");
-        pthread_mutex_unlock(&account->lock);
-        return;
+    int mismatched = 0;
+    int count = atomic_load(&account_count);
+    for(int i = 0; i < count; i++) {
+        Account *account = account_at(i);
+        Money stored;
+        if(balance_store->load(account, &stored) != 0 || stored != atomic_load(&account->balance)) {
+            mismatched++;
+        }
     }
-    
-    printf("Account %s Balance: %d\n", account_id, balance);
-    log_transaction_atomic("View Balance", account_id, "Balance viewed", "Success");
-    pthread_mutex_unlock(&account->lock);
+    if(mismatched > 0) {
+        printf("  %d stored balances do not match\n", mismatched);
+        return -1;
+    }
+    return 0;
 }
 
-// Function to generate a central log of all account balances
-void generate_central_log() {
-    char central_log_path[100];
-    sprintf(central_log_path, "%s/central_log.txt", ACCOUNTS_DIR);
-    FILE *log_file = fopen(central_log_path, "w");
-    if(log_file == NULL) {
-        printf("Error creating central log.\n");
-        return;
+// Function to remove a directory and everything in it
+static int remove_tree(const char *path) {
+    DIR *dir = opendir(path);
+    if(dir == NULL) {
+        return -1;
     }
-    fprintf(log_file, "Central Log - Account Balances\n");
-    fprintf(log_file, "--------------------------------------------------\n");
-    
-    pthread_mutex_lock(&global_lock);
-    for(int i = 0; i < account_count; i++) {
-        pthread_mutex_lock(&accounts[i].lock);
-        int balance;
-        if(read_balance(accounts[i].account_id, &balance) == 0) {
-            fprintf(log_file, "Account: %s, Balance: %d\n", accounts[i].account_id, balance);
+    struct dirent *entry;
+    char child[PATH_MAX];
+    int status = 0;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if(lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            status |= remove_tree(child);
+        } else if(unlink(child) != 0) {
+            status = -1;
         }
-        pthread_mutex_unlock(&accounts[i].lock);
     }
-    pthread_mutex_unlock(&global_lock);
-    
-    fclose(log_file);
-    printf("Central log created at: %s\n", central_log_path);
+    closedir(dir);
+    return rmdir(path) == 0 ? status : -1;
 }
 
-// Structure representing a user operation
-typedef struct {
-    char user_id[50];
-    char operation[20];
-    char target_account[50];
-    int amount;
-} UserOperation;
+// Function to start a stress benchmark child process in its scratch directory
+static void stress_child_enter(const char *scratch, const BalanceStore *store) {
+    if(chdir(scratch) != 0) {
+        printf("Error entering %s.\n", scratch);
+        _exit(1);
+    }
+    balance_store = store;
+}
 
-// Thread function to perform user operations
-void* user_operations(void *arg) {
-    UserOperation *op = (UserOperation*)arg;
-    if(strcmp(op->operation, "transfer") == 0) {
-        transfer(op->user_id, op->target_account, op->amount);
+// Function to run the stress benchmark once per balance store, each in a
+// child process of its own working in a fresh scratch directory, so no
+// state carries over between stores and existing accounts are untouched.
+// With the WAL on, a persistent store first goes through
+// STRESS_CRASH_ROUNDS runs killed with SIGKILL at a random moment while
+// they transfer and checkpoint; the measured run then starts by checking
+// what it recovered. Must run before any thread starts. Returns
+// STRESS_CHILD in each child, which goes on to set up its engine, and the
+// exit status in the parent. bench_ops is split evenly over the stores,
+// and the parent prints how many operations they ran in total.
+static int stress_fork_backends() {
+    int failed = 0;
+    size_t store_count = sizeof(balance_stores) / sizeof(balance_stores[0]);
+    stress_operations = ((uint64_t)bench_ops + store_count - 1) / store_count;
+    stress_total = mmap(NULL, sizeof(*stress_total), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(stress_total == MAP_FAILED) {
+        printf("Error allocating the stress benchmark.\n");
+        stress_total = NULL;
+        return 1;
     }
-    else if(strcmp(op->operation, "deposit") == 0) {
-        deposit(op->user_id, op->amount);
+    atomic_init(stress_total, 0);
+    for(size_t i = 0; i < store_count; i++) {
+        char scratch[] = "bs-stress-XXXXXX";
+        if(mkdtemp(scratch) == NULL) {
+            printf("Error creating a stress benchmark directory.\n");
+            return 1;
+        }
+        int crash_rounds = wal_enabled && balance_stores[i] != &memory_balance_store ? STRESS_CRASH_ROUNDS : 0;
+        stress_crashes = 0;
+        for(int round = 0; round < crash_rounds; round++) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if(pid == 0) {
+                // The runs that get killed stay quiet; the run after them reports
+                stress_child_enter(scratch, balance_stores[i]);
+                if(freopen("/dev/null", "w", stdout) == NULL) {
+                    _exit(1);
+                }
+                stress_crash_mode = 1;
+                wal_checkpoint_bytes = 1;
+                flush_interval_ms = 1;
+                return STRESS_CHILD;
+            }
+            if(pid < 0) {
+                printf("Error running the stress benchmark on %s.\n", balance_stores[i]->name);
+                break;
+            }
+            usleep((useconds_t)(1 + thread_random() % STRESS_CRASH_MAX_MS) * 1000);
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            stress_crashes++;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid == 0) {
+            stress_child_enter(scratch, balance_stores[i]);
+            return STRESS_CHILD;
+        }
+        int child_status = 0;
+        if(pid < 0 || waitpid(pid, &child_status, 0) != pid) {
+            printf("Error running the stress benchmark on %s.\n", balance_stores[i]->name);
+            child_status = -1;
+        } else if(WIFSIGNALED(child_status)) {
+            printf("  killed by signal %d on %s\n", WTERMSIG(child_status), balance_stores[i]->name);
+        }
+        if(remove_tree(scratch) != 0) {
+            printf("Error removing %s.\n", scratch);
+        }
+        if(child_status != 0) {
+            printf("Stress benchmark FAILED on %s.\n", balance_stores[i]->name);
+            failed++;
+        }
     }
-    else if(strcmp(op->operation, "withdraw") == 0) {
-        withdraw(op->user_id, op->amount);
+    printf("Stress benchmark ran %" PRIu64 " operations in total.\n", atomic_load(stress_total));
+    munmap(stress_total, sizeof(*stress_total));
+    stress_total = NULL;
+    if(failed == 0) {
+        printf("Stress benchmark passed on every balance store.\n");
     }
-    else if(strcmp(op->operation, "view_balance") == 0) {
-        view_balance(op->user_id);
+    return failed == 0 ? 0 : 1;
+}
+
+// Function to print command line usage
+static void print_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --durability=POLICY    write-through (default), group-commit or periodic\n");
+    printf("  --flush-interval=MS    milliseconds between background balance flushes (default %d)\n", DEFAULT_FLUSH_INTERVAL_MS);
+    printf("  --no-wal               rewrite account files directly instead of using the write-ahead log\n");
+    printf("  --balance-store=STORE  files (default, one file per account), mmap (one mapped file) or memory\n");
+    printf("  --checkpoint-bytes=N   WAL segment size that triggers a checkpoint (default %d)\n", DEFAULT_WAL_CHECKPOINT_BYTES);
+    printf("  --wal-io=MODE          sync (default) or uring: write WAL records, buffered logs and flushed account files through io_uring\n");
+    printf("  --max-accounts=N       most accounts that can be created (default %d, 0 for no limit)\n", DEFAULT_MAX_ACCOUNTS);
+    printf("  --workers=N            worker threads running operations (default: one per core)\n");
+    printf("  --queue-depth=N        operations queued before submitters block (default %d)\n", DEFAULT_QUEUE_DEPTH);
+    printf("  --shards=N             run operations on N single-writer shards instead of the workers\n");
+    printf("  --ingest=FILE          replay the operations in FILE (- for stdin) instead of the demo\n");
+    printf("  --listen=ADDR          serve operations on unix:PATH or [HOST:]PORT until SIGINT or SIGTERM (SIGHUP updates the central log)\n");
+    printf("  --inject-latency=MIN-MAX  sleep a random MIN..MAX milliseconds after each operation\n");
+    printf("  --console=MODE         direct (default), async (batched by a writer thread) or off: operation results\n");
+    printf("  --log-format=FORMAT    text (default) or binary transaction log records\n");
+    printf("  --log-mode=MODE        direct (default), buffered or group-commit transaction logging\n");
+    printf("  --log-fsync            sync each transaction log write\n");
+    printf("  --log-batch=N          records per transaction log batch (default %d)\n", DEFAULT_LOG_BATCH_RECORDS);
+    printf("  --log-max-wait=US      longest a record waits for its batch, in microseconds (default %d)\n", DEFAULT_LOG_MAX_WAIT_US);
+    printf("  --log-rotate-bytes=N   rotate the transaction log once it reaches N bytes\n");
+    printf("  --log-rotate-seconds=S rotate the transaction log every S seconds\n");
+    printf("  --benchmark=NAME       run a benchmark instead of the demo: contention, batch, workload or stress\n");
+    printf("  --bench-accounts=N     accounts the workload and batch benchmarks use (default %d)\n", DEFAULT_BENCH_ACCOUNTS);
+    printf("  --bench-threads=N      benchmark threads (default: one per core)\n");
+    printf("  --bench-seconds=S      how long the workload benchmark runs, and the stress benchmark with --bench-ops=0 (default %d)\n", DEFAULT_BENCH_SECONDS);
+    printf("  --bench-mix=T,D,W,V    percent transfers, deposits, withdrawals, views (default 50,20,20,10)\n");
+    printf("  --bench-skew=THETA     Zipfian skew of account choice, 0 (uniform, default) to below 1\n");
+    printf("  --bench-timeout=S      seconds without progress before the stress benchmark reports a deadlock (default %d)\n", DEFAULT_BENCH_TIMEOUT);
+    printf("  --bench-min-ops=N      fail the stress benchmark below N ops/s on any balance store\n");
+    printf("  --bench-ops=N          operations the stress benchmark runs, split over the balance stores (default %d)\n", DEFAULT_BENCH_OPS);
+#ifdef BS_INSTRUMENT
+    printf("  --stats-interval=S     dump the instrumentation every S seconds (also on SIGUSR1 and at exit)\n");
+#endif
+}
+
+// Function to parse command line options into the engine settings
+static int parse_options(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"durability", required_argument, NULL, 'd'},
+        {"flush-interval", required_argument, NULL, 'f'},
+        {"no-wal", no_argument, NULL, 'n'},
+        {"balance-store", required_argument, NULL, 'S'},
+        {"checkpoint-bytes", required_argument, NULL, 'c'},
+        {"wal-io", required_argument, NULL, 'U'},
+        {"max-accounts", required_argument, NULL, 'X'},
+        {"workers", required_argument, NULL, 'W'},
+        {"queue-depth", required_argument, NULL, 'Q'},
+        {"shards", required_argument, NULL, 'P'},
+        {"ingest", required_argument, NULL, 'i'},
+        {"listen", required_argument, NULL, 'l'},
+        {"inject-latency", required_argument, NULL, 'L'},
+        {"console", required_argument, NULL, 'C'},
+        {"log-format", required_argument, NULL, 'F'},
+        {"log-mode", required_argument, NULL, 'm'},
+        {"log-fsync", no_argument, NULL, 's'},
+        {"log-batch", required_argument, NULL, 'b'},
+        {"log-max-wait", required_argument, NULL, 'w'},
+        {"log-rotate-bytes", required_argument, NULL, 'r'},
+        {"log-rotate-seconds", required_argument, NULL, 't'},
+        {"benchmark", required_argument, NULL, 'B'},
+        {"bench-accounts", required_argument, NULL, 'A'},
+        {"bench-threads", required_argument, NULL, 'T'},
+        {"bench-seconds", required_argument, NULL, 'D'},
+        {"bench-mix", required_argument, NULL, 'M'},
+        {"bench-skew", required_argument, NULL, 'Z'},
+        {"bench-timeout", required_argument, NULL, 'O'},
+        {"bench-min-ops", required_argument, NULL, 'G'},
+        {"bench-ops", required_argument, NULL, 'N'},
+#ifdef BS_INSTRUMENT
+        {"stats-interval", required_argument, NULL, 'I'},
+#endif
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch(opt) {
+        case 'd':
+            if(strcmp(optarg, "write-through") == 0) {
+                durability_policy = DURABILITY_WRITE_THROUGH;
+            } else if(strcmp(optarg, "group-commit") == 0) {
+                durability_policy = DURABILITY_GROUP_COMMIT;
+            } else if(strcmp(optarg, "periodic") == 0) {
+                durability_policy = DURABILITY_PERIODIC;
+            } else {
+                printf("Unknown durability policy: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'f':
+            flush_interval_ms = atoi(optarg);
+            if(flush_interval_ms <= 0) {
+                printf("Invalid flush interval: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            wal_enabled = 0;
+            break;
+        case 'S': {
+            const BalanceStore *selected = NULL;
+            for(size_t i = 0; i < sizeof(balance_stores) / sizeof(balance_stores[0]); i++) {
+                if(strcmp(optarg, balance_stores[i]->name) == 0) {
+                    selected = balance_stores[i];
+                }
+            }
+            if(selected == NULL) {
+                printf("Unknown balance store: %s\n", optarg);
+                return -1;
+            }
+            balance_store = selected;
+            break;
+        }
+        case 'c':
+            wal_checkpoint_bytes = atoll(optarg);
+            if(wal_checkpoint_bytes <= 0) {
+                printf("Invalid checkpoint size: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'U':
+            if(strcmp(optarg, "sync") == 0) {
+                wal_io_mode = WAL_IO_SYNC;
+            } else if(strcmp(optarg, "uring") == 0) {
+                wal_io_mode = WAL_IO_URING;
+            } else {
+                printf("Unknown WAL I/O mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'X':
+            max_accounts = atoi(optarg);
+            if(max_accounts < 0) {
+                printf("Invalid account limit: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'W':
+            worker_count = atoi(optarg);
+            if(worker_count < 0) {
+                printf("Invalid worker count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'Q':
+            queue_depth = atoi(optarg);
+            if(queue_depth <= 0) {
+                printf("Invalid queue depth: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'i':
+            ingest_path = optarg;
+            break;
+        case 'l':
+            listen_address = optarg;
+            break;
+        case 'P':
+            shard_count = atoi(optarg);
+            if(shard_count <= 0) {
+                printf("Invalid shard count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'L': {
+            int min_ms, max_ms;
+            if(sscanf(optarg, "%d-%d", &min_ms, &max_ms) != 2 || min_ms < 0 || max_ms < min_ms) {
+                printf("Invalid latency range: %s\n", optarg);
+                return -1;
+            }
+            latency_min_us = min_ms * 1000;
+            latency_max_us = max_ms * 1000;
+            break;
+        }
+        case 'C':
+            if(strcmp(optarg, "direct") == 0) {
+                console_mode = CONSOLE_DIRECT;
+            } else if(strcmp(optarg, "async") == 0) {
+                console_mode = CONSOLE_ASYNC;
+            } else if(strcmp(optarg, "off") == 0) {
+                console_mode = CONSOLE_OFF;
+            } else {
+                printf("Unknown console mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'F':
+            if(strcmp(optarg, "text") == 0) {
+                log_format = LOG_FORMAT_TEXT;
+            } else if(strcmp(optarg, "binary") == 0) {
+                log_format = LOG_FORMAT_BINARY;
+            } else {
+                printf("Unknown log format: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm':
+            if(strcmp(optarg, "direct") == 0) {
+                log_mode = LOG_DIRECT;
+            } else if(strcmp(optarg, "buffered") == 0) {
+                log_mode = LOG_BUFFERED;
+            } else if(strcmp(optarg, "group-commit") == 0) {
+                log_mode = LOG_GROUP_COMMIT;
+            } else {
+                printf("Unknown log mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            log_fsync = 1;
+            break;
+        case 'b':
+            log_batch_records = atoi(optarg);
+            if(log_batch_records <= 0) {
+                printf("Invalid log batch size: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            log_max_wait_us = atoi(optarg);
+            if(log_max_wait_us < 0) {
+                printf("Invalid log wait: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'r':
+            log_rotate_bytes = atoll(optarg);
+            break;
+        case 't':
+            log_rotate_seconds = atoi(optarg);
+            break;
+        case 'B':
+            if(strcmp(optarg, "contention") != 0 && strcmp(optarg, "batch") != 0 && strcmp(optarg, "workload") != 0 &&
+               strcmp(optarg, "stress") != 0) {
+                printf("Unknown benchmark: %s\n", optarg);
+                return -1;
+            }
+            benchmark_name = optarg;
+            break;
+        case 'A':
+            bench_accounts = atoi(optarg);
+            if(bench_accounts < 2) {
+                printf("Invalid benchmark account count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            bench_threads = atoi(optarg);
+            if(bench_threads < 0) {
+                printf("Invalid benchmark thread count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'D':
+            bench_seconds = atoi(optarg);
+            if(bench_seconds <= 0) {
+                printf("Invalid benchmark duration: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'M':
+            if(sscanf(optarg, "%d,%d,%d,%d", &bench_mix[0], &bench_mix[1], &bench_mix[2], &bench_mix[3]) != 4 ||
+               bench_mix[0] < 0 || bench_mix[1] < 0 || bench_mix[2] < 0 || bench_mix[3] < 0 ||
+               bench_mix[0] + bench_mix[1] + bench_mix[2] + bench_mix[3] != 100) {
+                printf("Invalid benchmark mix (four percentages adding up to 100): %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'Z':
+            bench_skew = atof(optarg);
+            if(bench_skew < 0 || bench_skew >= 1) {
+                printf("Invalid benchmark skew: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'O':
+            bench_timeout = atoi(optarg);
+            if(bench_timeout <= 0) {
+                printf("Invalid benchmark timeout: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'G':
+            bench_min_ops = atol(optarg);
+            if(bench_min_ops < 0) {
+                printf("Invalid benchmark throughput: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'N':
+            bench_ops = atol(optarg);
+            if(bench_ops < 0) {
+                printf("Invalid benchmark operation count: %s\n", optarg);
+                return -1;
+            }
+            break;
+#ifdef BS_INSTRUMENT
+        case 'I':
+            stats_interval = atoi(optarg);
+            if(stats_interval <= 0) {
+                printf("Invalid stats interval: %s\n", optarg);
+                return -1;
+            }
+            break;
+#endif
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    if(ingest_path != NULL && listen_address != NULL) {
+        printf("--ingest and --listen cannot be combined.\n");
+        return -1;
+    }
+    if(wal_io_mode == WAL_IO_URING && !wal_enabled) {
+        printf("--wal-io=uring needs the write-ahead log.\n");
+        return -1;
     }
-    // Simulate delay
-    usleep((rand() % 400 + 100) * 1000); // 100 to 500 milliseconds
-    free(op);
-    pthread_exit(NULL);
+    return 0;
 }
 
 // Main function
-int main() {
+int main(int argc, char *argv[]) {
+    if(parse_options(argc, argv) != 0) {
+        return 1;
+    }
+    if(listen_address != NULL) {
+        // The server takes shutdown and report signals through a signalfd;
+        // block them before any thread starts so every thread inherits the mask
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+    // The contention and batch benchmarks run in memory only, before the engine starts
+    if(benchmark_name != NULL && strcmp(benchmark_name, "contention") == 0) {
+        return run_contention_benchmark() == 0 ? 0 : 1;
+    }
+    if(benchmark_name != NULL && strcmp(benchmark_name, "batch") == 0) {
+        return run_batch_benchmark() == 0 ? 0 : 1;
+    }
+    // The stress benchmark runs once per balance store, each in its own process
+    if(benchmark_name != NULL && strcmp(benchmark_name, "stress") == 0) {
+        int status = stress_fork_backends();
+        if(status != STRESS_CHILD) {
+            return status;
+        }
+    }
+#ifdef BS_INSTRUMENT
+    if(instrumentation_start() != 0) {
+        return 1;
+    }
+#endif
+    if(console_open() != 0) {
+        return 1;
+    }
+    
     // Ensure the accounts directory exists
     struct stat st = {0};
     if (stat(ACCOUNTS_DIR, &st) == -1) {
@@ -381,71 +7201,146 @@ int main() {
     
     // Set the path for the central transaction log
     strcpy(central_transaction_log, ACCOUNTS_DIR "/" TRANSACTION_LOG);
+    if(log_format == LOG_FORMAT_BINARY) {
+        strcpy(central_transaction_log, ACCOUNTS_DIR "/" TRANSACTION_LOG_BINARY);
+    }
+    
+    // Open the transaction log for the whole run
+    transaction_log.fsync = log_fsync;
+    transaction_log.batch_records = log_batch_records;
+    transaction_log.max_wait_us = log_max_wait_us;
+    transaction_log.rotate_bytes = log_rotate_bytes;
+    transaction_log.rotate_seconds = log_rotate_seconds;
+    if(log_writer_open(&transaction_log, central_transaction_log, 0, log_mode) != 0) {
+        return 1;
+    }
+    log_session_start();
+    
+    // Replay anything a previous run left in the write-ahead log
+    if(balance_store_open() != 0 || wal_recover() != 0 || wal_open() != 0) {
+        return 1;
+    }
+    book_total_open();
+    if(start_balance_flusher() != 0) {
+        return 1;
+    }
+    
+    // The workload and stress benchmarks drive the engine as configured instead of the demo
+    if(benchmark_name != NULL) {
+        int stress = strcmp(benchmark_name, "stress") == 0;
+        int status = stress ? run_stress_benchmark() : run_workload_benchmark();
+        stop_balance_flusher();
+        wal_close();
+        if(stress && status == 0) {
+            status = stress_check_store();
+        }
+        balance_store->close();
+        log_writer_close(&transaction_log);
+#ifdef BS_INSTRUMENT
+        instrumentation_dump();
+#endif
+        return status == 0 ? 0 : 1;
+    }
     
     // List of user IDs
     char *user_ids[] = {"User1", "User2", "User3"};
     int num_users = sizeof(user_ids)/sizeof(user_ids[0]);
     
     // Initial balance for each account
-    int initial_balance = 1000;
-    
-    // Create user accounts
-    printf("Creating user accounts...\n");
-    for(int i = 0; i < num_users; i++) {
-        create_account(user_ids[i], initial_balance);
-    }
-    printf("All accounts created.\n\n");
-    
-    // Define threads
-    pthread_t threads[10];
-    int thread_count = 0;
-    
-    // Define user operations
-    // Example: Transfer from User1 to User2, transfer from User2 to User3, transfer from User3 to User1
-    UserOperation *op1 = malloc(sizeof(UserOperation));
-    strcpy(op1->user_id, "User1");
-    strcpy(op1->operation, "transfer");
-    strcpy(op1->target_account, "User2");
-    op1->amount = 500;
-    pthread_create(&threads[thread_count++], NULL, user_operations, (void*)op1);
-    
-    UserOperation *op2 = malloc(sizeof(UserOperation));
-    strcpy(op2->user_id, "User2");
-    strcpy(op2->operation, "transfer");
-    strcpy(op2->target_account, "User3");
-    op2->amount = 300;
-    pthread_create(&threads[thread_count++], NULL, user_operations, (void*)op2);
-    
-    UserOperation *op3 = malloc(sizeof(UserOperation));
-    strcpy(op3->user_id, "User3");
-    strcpy(op3->operation, "transfer");
-    strcpy(op3->target_account, "User1");
-    op3->amount = 200;
-    pthread_create(&threads[thread_count++], NULL, user_operations, (void*)op3);
-    
-    // Additional operations can be added here
-    // For example:
-    // UserOperation *op4 = malloc(sizeof(UserOperation));
-    // strcpy(op4->user_id, "User1");
-    // strcpy(op4->operation, "deposit");
-    // op4->amount = 150;
-    // pthread_create(&threads[thread_count++], NULL, user_operations, (void*)op4);
-    
-    // Wait for all threads to complete
-    for(int i = 0; i < thread_count; i++) {
-        pthread_join(threads[i], NULL);
+    Money initial_balance = 1000;
+    
+    // Create user accounts, unless the operations are streamed in or served
+    if(ingest_path == NULL && listen_address == NULL) {
+        console_printf("Creating user accounts...\n");
+        for(int i = 0; i < num_users; i++) {
+            create_account(user_ids[i], initial_balance);
+        }
+        console_printf("All accounts created.\n\n");
+    }
+    
+    // Start the workers
+    WorkerPool pool;
+    int started = shard_count > 0 ? pool_start_sharded(&pool, shard_count, queue_depth) : pool_start(&pool, worker_count, queue_depth);
+    if(started != 0) {
+        return 1;
+    }
+    int status = 0;
+    if(listen_address != NULL) {
+        // Serve clients' operations instead of the demo ones
+        status = run_server(&pool, listen_address);
+    } else if(ingest_path != NULL) {
+        // Replay the streamed operations instead of the demo ones
+        status = ingest_operations(&pool, ingest_path);
+    } else {
+        UserOperation *ops[10];
+        int op_count = 0;
+        
+        // Define user operations
+        // Example: Transfer from User1 to User2, transfer from User2 to User3, transfer from User3 to User1
+        UserOperation *op1 = operation_alloc();
+        strcpy(op1->user_id, "User1");
+        strcpy(op1->operation, "transfer");
+        strcpy(op1->target_account, "User2");
+        op1->amount = 500;
+        pool_submit(&pool, op1);
+        ops[op_count++] = op1;
+        
+        UserOperation *op2 = operation_alloc();
+        strcpy(op2->user_id, "User2");
+        strcpy(op2->operation, "transfer");
+        strcpy(op2->target_account, "User3");
+        op2->amount = 300;
+        pool_submit(&pool, op2);
+        ops[op_count++] = op2;
+        
+        UserOperation *op3 = operation_alloc();
+        strcpy(op3->user_id, "User3");
+        strcpy(op3->operation, "transfer");
+        strcpy(op3->target_account, "User1");
+        op3->amount = 200;
+        pool_submit(&pool, op3);
+        ops[op_count++] = op3;
+        
+        // Additional operations can be added here
+        // For example:
+        // UserOperation *op4 = operation_alloc();
+        // strcpy(op4->user_id, "User1");
+        // strcpy(op4->operation, "deposit");
+        // op4->amount = 150;
+        // pool_submit(&pool, op4);
+        // ops[op_count++] = op4;
+        
+        // Wait for all operations to complete
+        for(int i = 0; i < op_count; i++) {
+            operation_wait(ops[i]);
+            operation_destroy(ops[i]);
+            operation_free(ops[i]);
+        }
     }
+    pool_stop(&pool);
+    console_close();
     
     // Generate central log after all operations
     generate_central_log();
+    stop_balance_flusher();
+    wal_close();
+    balance_store->close();
+    log_writer_close(&transaction_log);
     printf("All operations completed.\n");
+#ifdef BS_INSTRUMENT
+    instrumentation_dump();
+#endif
     
     // Destroy mutexes
     for(int i = 0; i < account_count; i++) {
-        pthread_mutex_destroy(&accounts[i].lock);
+        pthread_mutex_destroy(&account_at(i)->lock);
+    }
+    account_index_destroy();
+    for(int i = 0; i < ACCOUNT_SEGMENT_COUNT; i++) {
+        free(account_segments[i]);
+        free(account_info_segments[i]);
     }
     pthread_mutex_destroy(&global_lock);
-    pthread_mutex_destroy(&transaction_log_lock);
     
-    return 0;
+    return status == 0 ? 0 : 1;
 }
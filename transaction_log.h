@@ -0,0 +1,133 @@
+// Transaction log record format shared by BS.c and txlog_dump.c
+#ifndef TRANSACTION_LOG_H
+#define TRANSACTION_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Wall-clock time in microseconds since the Unix epoch. Fixed width and
+// ordered like the time itself, so it can be stored and compared as-is.
+typedef uint64_t Timestamp;
+
+// Size of a formatted timestamp including the terminating NUL
+#define TIMESTAMP_TEXT_SIZE 27
+
+// Value of BinaryLogRecord.reserved in session records ("BTXL")
+#define TXLOG_MAGIC 0x4C585442u
+
+// Version of the binary format, stored in session records' amount
+#define TXLOG_VERSION 1
+
+// Operation codes
+typedef enum {
+    LOG_OP_SESSION = 0,         // Start of a run; account numbers restart
+    LOG_OP_ACCOUNT_NAME,        // Binds an account number to its ID
+    LOG_OP_CREATE_ACCOUNT,
+    LOG_OP_TRANSFER,
+    LOG_OP_DEPOSIT,
+    LOG_OP_WITHDRAW,
+    LOG_OP_VIEW_BALANCE,
+    LOG_OP_COUNT
+} LogOp;
+
+// Outcome details, one per message the text log has always used
+typedef enum {
+    LOG_DETAIL_NONE = 0,
+    LOG_DETAIL_INITIAL_BALANCE,
+    LOG_DETAIL_TRANSFER_TO_SELF,
+    LOG_DETAIL_ACCOUNTS_MISSING,
+    LOG_DETAIL_READING_BALANCES_FAILED,
+    LOG_DETAIL_INSUFFICIENT_FUNDS,
+    LOG_DETAIL_TRANSFER_SUCCESSFUL,
+    LOG_DETAIL_TRANSFER_RECEIVED,
+    LOG_DETAIL_TRANSFER_ROLLED_BACK,
+    LOG_DETAIL_ACCOUNT_MISSING,
+    LOG_DETAIL_READING_BALANCE_FAILED,
+    LOG_DETAIL_DEPOSIT_SUCCESSFUL,
+    LOG_DETAIL_DEPOSIT_FAILED,
+    LOG_DETAIL_WITHDRAWAL_SUCCESSFUL,
+    LOG_DETAIL_WITHDRAWAL_FAILED,
+    LOG_DETAIL_BALANCE_VIEWED,
+    LOG_DETAIL_BALANCE_LIMIT,
+    LOG_DETAIL_INVALID_AMOUNT,
+    LOG_DETAIL_COUNT
+} LogDetail;
+
+typedef enum {
+    LOG_STATUS_SUCCESS = 0,
+    LOG_STATUS_FAILED,
+    LOG_STATUS_COUNT
+} LogStatus;
+
+static const char *const log_op_names[LOG_OP_COUNT] = {
+    "Session", "Account Name", "Create Account", "Transfer", "Deposit", "Withdraw", "View Balance"
+};
+
+static const char *const log_detail_names[LOG_DETAIL_COUNT] = {
+    "",
+    "Initial balance",
+    "Attempted to transfer to self",
+    "One or both accounts do not exist",
+    "Reading balances failed",
+    "Insufficient funds",
+    "Transfer successful",
+    "Transfer received",
+    "Transfer failed and rolled back",
+    "Account does not exist",
+    "Reading balance failed",
+    "Deposit successful",
+    "Deposit failed",
+    "Withdrawal successful",
+    "Withdrawal failed",
+    "Balance viewed",
+    "Balance limit exceeded",
+    "Invalid amount"
+};
+
+static const char *const log_status_names[LOG_STATUS_COUNT] = {"Success", "Failed"};
+
+// Fixed-width binary log record. A file is a sequence of these, in append
+// order. Operation records name their account by its number, which is bound
+// to an account ID by an earlier LOG_OP_ACCOUNT_NAME record of the same
+// session: that record's amount is the ID length, and the ID itself follows
+// in the next ceil(length / sizeof(BinaryLogRecord)) record-sized blocks.
+typedef struct {
+    Timestamp timestamp;
+    uint32_t account;
+    uint32_t reserved;          // TXLOG_MAGIC in session records, otherwise 0
+    int64_t amount;
+    uint16_t opcode;            // LogOp
+    uint8_t status;             // LogStatus
+    uint8_t detail;             // LogDetail
+    uint32_t padding;
+} BinaryLogRecord;
+
+_Static_assert(sizeof(BinaryLogRecord) == 32, "BinaryLogRecord must stay 32 bytes");
+
+// Function to format a timestamp as "YYYY-MM-DD HH:MM:SS.uuuuuu" into a
+// buffer of at least TIMESTAMP_TEXT_SIZE bytes. The date and time part is
+// cached per thread and only rebuilt when the second changes, so the common
+// case is a copy plus six digits and never touches the time zone lock.
+static inline int format_timestamp(Timestamp timestamp, char *text) {
+    static __thread time_t cached_second = -1;
+    static __thread char cached_text[20];
+    time_t second = (time_t)(timestamp / 1000000u);
+    if(second != cached_second) {
+        struct tm t;
+        localtime_r(&second, &t);
+        strftime(cached_text, sizeof(cached_text), "%Y-%m-%d %H:%M:%S", &t);
+        cached_second = second;
+    }
+    memcpy(text, cached_text, 19);
+    text[19] = '.';
+    unsigned micros = (unsigned)(timestamp % 1000000u);
+    for(int i = 25; i > 19; i--) {
+        text[i] = (char)('0' + micros % 10);
+        micros /= 10;
+    }
+    text[26] = '\0';
+    return 26;
+}
+
+#endif
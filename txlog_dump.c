@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transaction_log.h"
+
+// Renders binary transaction logs written by BS --log-format=binary in the
+// same "timestamp | op | user | details | status" lines as the text log.
+// Rotated files should be passed oldest first, followed by the current one,
+// since account names are only recorded once per session.
+//
+// Build: gcc -O2 txlog_dump.c -o txlog_dump
+
+// Account numbers seen in the current session and the IDs bound to them
+typedef struct {
+    char **names;
+    size_t capacity;
+} NameTable;
+
+// Function to drop every binding, as at the start of a session
+static void names_reset(NameTable *table) {
+    for(size_t i = 0; i < table->capacity; i++) {
+        free(table->names[i]);
+        table->names[i] = NULL;
+    }
+}
+
+// Function to bind an account number to an ID
+static int names_set(NameTable *table, uint32_t number, const char *name) {
+    if(number >= table->capacity) {
+        size_t capacity = table->capacity ? table->capacity : 64;
+        while(capacity <= number) {
+            capacity *= 2;
+        }
+        char **grown = realloc(table->names, capacity * sizeof(char*));
+        if(grown == NULL) {
+            return -1;
+        }
+        memset(grown + table->capacity, 0, (capacity - table->capacity) * sizeof(char*));
+        table->names = grown;
+        table->capacity = capacity;
+    }
+    free(table->names[number]);
+    table->names[number] = strdup(name);
+    return table->names[number] != NULL ? 0 : -1;
+}
+
+// Function to look up the ID bound to an account number
+static const char* names_get(const NameTable *table, uint32_t number) {
+    if(number < table->capacity && table->names[number] != NULL) {
+        return table->names[number];
+    }
+    return "?";
+}
+
+// Function to render one binary log file to stdout
+static int dump_file(const char *path, NameTable *table) {
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) {
+        fprintf(stderr, "Error opening %s.\n", path);
+        return -1;
+    }
+    BinaryLogRecord record;
+    long offset = 0;
+    int status = 0;
+    while(fread(&record, sizeof(record), 1, file) == 1) {
+        offset++;
+        if(record.opcode == LOG_OP_SESSION) {
+            if(record.reserved != TXLOG_MAGIC || record.amount != TXLOG_VERSION) {
+                fprintf(stderr, "%s: unsupported session header at record %ld.\n", path, offset - 1);
+                status = -1;
+                break;
+            }
+            names_reset(table);
+            continue;
+        }
+        if(record.opcode == LOG_OP_ACCOUNT_NAME) {
+            char name[sizeof(BinaryLogRecord) * 4];
+            size_t length = (size_t)record.amount;
+            size_t blocks = (length + sizeof(BinaryLogRecord) - 1) / sizeof(BinaryLogRecord);
+            if(length >= sizeof(name) || fread(name, sizeof(BinaryLogRecord), blocks, file) != blocks) {
+                fprintf(stderr, "%s: truncated account name at record %ld.\n", path, offset - 1);
+                status = -1;
+                break;
+            }
+            offset += (long)blocks;
+            name[length] = '\0';
+            names_set(table, record.account, name);
+            continue;
+        }
+        if(record.opcode >= LOG_OP_COUNT || record.detail >= LOG_DETAIL_COUNT || record.status >= LOG_STATUS_COUNT) {
+            fprintf(stderr, "%s: invalid record %ld.\n", path, offset - 1);
+            status = -1;
+            break;
+        }
+        char timestamp[TIMESTAMP_TEXT_SIZE];
+        format_timestamp(record.timestamp, timestamp);
+        printf("%s | %s | %s | %s | %s\n", timestamp, log_op_names[record.opcode], names_get(table, record.account),
+               log_detail_names[record.detail], log_status_names[record.status]);
+    }
+    fclose(file);
+    return status;
+}
+
+// Main function
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+        return 2;
+    }
+    NameTable table = {NULL, 0};
+    int status = 0;
+    for(int i = 1; i < argc; i++) {
+        if(dump_file(argv[i], &table) != 0) {
+            status = 1;
+        }
+    }
+    names_reset(&table);
+    free(table.names);
+    return status;
+}